@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef DISTANCEFIELD_HPP
+#define DISTANCEFIELD_HPP
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <set>
+#include <skimap/SkipListMapV2.hpp>
+#include <vector>
+
+namespace skimap {
+
+/**
+     * Euclidean Distance Field cell. Stores the distance from the nearest
+     * obstacle and the index of that obstacle.
+     * K template represents datatype for indices.
+     * D template represents datatype for distances.
+     */
+template <typename K, typename D> struct DistanceVoxel {
+  D distance;
+  K ox, oy, oz;
+  bool has_obstacle;
+  bool occupied;
+
+  /**
+       * Void constructor. Cell far from any obstacle.
+       */
+  DistanceVoxel()
+      : distance(std::numeric_limits<D>::max()), ox(0), oy(0), oz(0),
+        has_obstacle(false), occupied(false) {}
+
+  /**
+       * Pointer Copy Constructor.
+       * @param data source data
+       */
+  DistanceVoxel(DistanceVoxel *data) { *this = *data; }
+
+  /**
+       * Sum Overload. Distance cells are overwritten, not accumulated.
+       * @param v2 new cell
+       * @return new cell
+       */
+  DistanceVoxel operator+(const DistanceVoxel &v2) const { return v2; }
+
+  /**
+       * Difference Overload. Nothing was accumulated, so the cell is left
+       * as it is.
+       * @param v2 removed cell
+       * @return this cell
+       */
+  DistanceVoxel operator-(const DistanceVoxel &v2) const { return *this; }
+
+  /**
+       * Serializes object into stream.
+       */
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const DistanceVoxel<K, D> &voxel) {
+    os << std::setprecision(std::numeric_limits<double>::digits10 + 2);
+    os << double(voxel.distance) << " ";
+    os << long(voxel.ox) << " " << long(voxel.oy) << " " << long(voxel.oz)
+       << " ";
+    os << int(voxel.has_obstacle) << " " << int(voxel.occupied);
+    return os;
+  }
+
+  /**
+       * Hydrates object from stream.
+       */
+  friend std::istream &operator>>(std::istream &is,
+                                  DistanceVoxel<K, D> &voxel) {
+    double distance;
+    long ox, oy, oz;
+    int has_obstacle, occupied;
+    is >> distance >> ox >> oy >> oz >> has_obstacle >> occupied;
+    voxel.distance = D(distance);
+    voxel.ox = K(ox);
+    voxel.oy = K(oy);
+    voxel.oz = K(oz);
+    voxel.has_obstacle = has_obstacle != 0;
+    voxel.occupied = occupied != 0;
+    return is;
+  }
+};
+
+/**
+     * Incremental Euclidean Distance Field built on top of a SkiMap. Cells
+     * are stored in a SkipListMapV2 with the same resolution of the source
+     * map, so the field shares its column indexing and is allocated only
+     * within 'max_distance' from obstacles.
+     * Obstacle changes are propagated with raise/lower wavefronts (dynamic
+     * brushfire) which touch only the region affected by the change. Each
+     * cell remembers its nearest obstacle, so distance and gradient cost a
+     * single point lookup in the cell map (one find per level), no search
+     * of the obstacles. integrateChangedSince feeds the field from the
+     * version journal of the source map.
+     * K template represents datatype for indices.
+     * D template represents datatype for coordinates and distances.
+     */
+template <class K, class D, int X_DEPTH = 8, int Y_DEPTH = 8, int Z_DEPTH = 8>
+class DistanceField {
+public:
+  typedef DistanceVoxel<K, D> Cell;
+  typedef SkipListMapV2<Cell, K, D, X_DEPTH, Y_DEPTH, Z_DEPTH> CellMap;
+
+  /**
+       * Cell index
+       */
+  struct Index3 {
+    K x, y, z;
+    Index3() : x(0), y(0), z(0) {}
+    Index3(K x, K y, K z) : x(x), y(y), z(z) {}
+  };
+
+  /**
+       *
+       * @param resolution_x
+       * @param resolution_y
+       * @param resolution_z
+       * @param max_distance distance truncation; cells farther than this
+       * from any obstacle are not stored.
+       */
+  DistanceField(D resolution_x, D resolution_y, D resolution_z,
+                D max_distance)
+      : _cells(std::numeric_limits<K>::min(), std::numeric_limits<K>::max(),
+               resolution_x, resolution_y, resolution_z),
+        _resolution_x(resolution_x), _resolution_y(resolution_y),
+        _resolution_z(resolution_z), _max_distance(max_distance) {
+    _cells.setDeintegrationFilter(&DistanceField::_isLive);
+  }
+
+  /**
+       *
+       * @param resolution
+       * @param max_distance distance truncation
+       */
+  DistanceField(D resolution, D max_distance)
+      : _cells(std::numeric_limits<K>::min(), std::numeric_limits<K>::max(),
+               resolution, resolution, resolution),
+        _resolution_x(resolution), _resolution_y(resolution),
+        _resolution_z(resolution), _max_distance(max_distance) {
+    _cells.setDeintegrationFilter(&DistanceField::_isLive);
+  }
+
+  virtual ~DistanceField() {}
+
+  /**
+       * Marks a cell as obstacle. Change is propagated on next update().
+       * @param ix
+       * @param iy
+       * @param iz
+       */
+  void addObstacle(K ix, K iy, K iz) {
+    Cell *cell = _cell(ix, iy, iz, true);
+    if (cell == NULL || cell->occupied)
+      return;
+    cell->occupied = true;
+    cell->distance = D(0);
+    cell->ox = ix;
+    cell->oy = iy;
+    cell->oz = iz;
+    cell->has_obstacle = true;
+    _open.push(QueueEntry(D(0), ix, iy, iz, false));
+  }
+
+  /**
+       * Removes an obstacle. Change is propagated on next update().
+       * @param ix
+       * @param iy
+       * @param iz
+       */
+  void removeObstacle(K ix, K iy, K iz) {
+    Cell *cell = _cell(ix, iy, iz, false);
+    if (cell == NULL || !cell->occupied)
+      return;
+    cell->occupied = false;
+    _clear(ix, iy, iz, cell);
+    _open.push(QueueEntry(D(0), ix, iy, iz, true));
+  }
+
+  /**
+       * Feeds the field with the voxels changed by an integration batch.
+       * The occupancy of each changed voxel is read back from the source map
+       * through 'occupied_filter', a functor bool(const V*).
+       * @param map source map
+       * @param changed indices of changed voxels
+       * @param occupied_filter occupancy predicate
+       */
+  template <class MAP, class F>
+  void integrateChanges(MAP &map, const std::vector<Index3> &changed,
+                        F occupied_filter) {
+    for (int i = 0; i < changed.size(); i++) {
+      const Index3 &c = changed[i];
+      if (occupied_filter(map.find(c.x, c.y, c.z))) {
+        addObstacle(c.x, c.y, c.z);
+      } else {
+        removeObstacle(c.x, c.y, c.z);
+      }
+    }
+    update();
+  }
+
+  /**
+       * Feeds the field with the changes of a versioned source map (see
+       * SkipListMapV2::fetchChangedSince), which must share the resolution
+       * of the field. Dirty columns are the unit of change: their voxels
+       * are offered as obstacles, and obstacles of the field in dirty or
+       * erased columns that the map lost are removed. If the erased
+       * columns since version were pruned every obstacle is checked.
+       * @param map source map
+       * @param version last version of the map fed to the field
+       * @param occupied_filter occupancy predicate, functor bool(const V*)
+       */
+  template <class MAP, class F>
+  void integrateChangedSince(MAP &map, typename MAP::Version version,
+                             F occupied_filter) {
+    std::vector<typename MAP::Voxel3D> voxels;
+    std::vector<typename MAP::ErasedColumn> erased;
+    map.fetchChangedSince(version, voxels);
+    bool complete = map.fetchErasedSince(version, erased);
+
+    std::vector<Index3> changed;
+    std::set<std::pair<K, K> > columns;
+    for (size_t i = 0; i < voxels.size(); i++) {
+      K ix, iy, iz;
+      if (map.coordinatesToIndex(voxels[i].x, voxels[i].y, voxels[i].z, ix,
+                                 iy, iz)) {
+        changed.push_back(Index3(ix, iy, iz));
+        columns.insert(std::make_pair(ix, iy));
+      }
+    }
+    for (size_t i = 0; i < erased.size(); i++) {
+      columns.insert(std::make_pair(erased[i].ix, erased[i].iy));
+    }
+
+    // obstacles the map may have lost, integrateChanges removes them
+    std::vector<typename CellMap::IndexedVoxel> cells;
+    if (!complete) {
+      _cells.boxSearch(typename CellMap::IndexBox(), cells);
+      _appendObstacles(cells, changed);
+    } else {
+      typename std::set<std::pair<K, K> >::const_iterator it;
+      for (it = columns.begin(); it != columns.end(); ++it) {
+        _cells.boxSearch(typename CellMap::IndexBox(
+                             it->first, it->first, it->second, it->second,
+                             std::numeric_limits<K>::min(),
+                             std::numeric_limits<K>::max()),
+                         cells);
+        _appendObstacles(cells, changed);
+      }
+    }
+    integrateChanges(map, changed, occupied_filter);
+  }
+
+  /**
+       * Propagates pending obstacle changes. Raise waves clear cells whose
+       * nearest obstacle disappeared, lower waves spread new distances from
+       * obstacles and from the border of raised regions. Cleared cells that
+       * no obstacle reaches again are erased, keeping the field sparse.
+       */
+  void update() {
+    while (!_open.empty()) {
+      QueueEntry entry = _open.top();
+      _open.pop();
+
+      Cell *cell = _cell(entry.x, entry.y, entry.z, false);
+      if (cell == NULL)
+        continue;
+
+      if (entry.raise) {
+        _raise(entry);
+      } else if (cell->has_obstacle && entry.distance <= cell->distance) {
+        _lower(entry, *cell);
+      }
+    }
+
+    // Cell operator- is a no-op: deintegration just erases dead cells
+    std::vector<typename CellMap::IndexedVoxel> dead;
+    Cell empty;
+    for (size_t i = 0; i < _cleared.size(); i++) {
+      const Index3 &c = _cleared[i];
+      Cell *cell = _cells.find(c.x, c.y, c.z);
+      if (cell != NULL && !_isLive(cell)) {
+        dead.push_back(
+            typename CellMap::IndexedVoxel(c.x, c.y, c.z, &empty));
+      }
+    }
+    _cleared.clear();
+    if (!dead.empty())
+      _cells.deintegrateVoxels(dead);
+  }
+
+  /**
+       * Distance lookup.
+       * @param ix
+       * @param iy
+       * @param iz
+       * @param distance OUTPUT distance from nearest obstacle, 'max_distance'
+       * if no obstacle is closer than that.
+       * @return TRUE if an obstacle is within 'max_distance'.
+       */
+  bool getDistance(K ix, K iy, K iz, D &distance) {
+    Cell *cell = _cells.find(ix, iy, iz);
+    if (cell == NULL || !cell->has_obstacle) {
+      distance = _max_distance;
+      return false;
+    }
+    distance = cell->distance;
+    return true;
+  }
+
+  /**
+       * Distance lookup by coordinates.
+       */
+  bool getDistance(D x, D y, D z, D &distance) {
+    K ix, iy, iz;
+    if (_cells.coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return getDistance(ix, iy, iz, distance);
+    }
+    distance = _max_distance;
+    return false;
+  }
+
+  /**
+       * Gradient lookup. Gradient of an Euclidean distance field is the unit
+       * vector pointing away from the nearest obstacle.
+       * @param ix
+       * @param iy
+       * @param iz
+       * @param gx OUTPUT gradient X component
+       * @param gy OUTPUT gradient Y component
+       * @param gz OUTPUT gradient Z component
+       * @return TRUE if gradient is defined (an obstacle is within
+       * 'max_distance' and the cell is not the obstacle itself).
+       */
+  bool getGradient(K ix, K iy, K iz, D &gx, D &gy, D &gz) {
+    gx = gy = gz = D(0);
+    Cell *cell = _cells.find(ix, iy, iz);
+    if (cell == NULL || !cell->has_obstacle || cell->distance <= D(0))
+      return false;
+    gx = D(long(ix) - long(cell->ox)) * _resolution_x / cell->distance;
+    gy = D(long(iy) - long(cell->oy)) * _resolution_y / cell->distance;
+    gz = D(long(iz) - long(cell->oz)) * _resolution_z / cell->distance;
+    return true;
+  }
+
+  /**
+       * Gradient lookup by coordinates.
+       */
+  bool getGradient(D x, D y, D z, D &gx, D &gy, D &gz) {
+    K ix, iy, iz;
+    if (_cells.coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return getGradient(ix, iy, iz, gx, gy, gz);
+    }
+    gx = gy = gz = D(0);
+    return false;
+  }
+
+  /**
+       * @return underlying cell map
+       */
+  CellMap &cells() { return _cells; }
+
+  D maxDistance() const { return _max_distance; }
+
+protected:
+  /**
+       * Wavefront entry
+       */
+  struct QueueEntry {
+    D distance;
+    K x, y, z;
+    bool raise;
+
+    QueueEntry(D distance, K x, K y, K z, bool raise)
+        : distance(distance), x(x), y(y), z(z), raise(raise) {}
+
+    bool operator<(const QueueEntry &other) const {
+      return distance > other.distance;
+    }
+  };
+
+  /**
+       * Retrieves a cell, optionally allocating it.
+       */
+  Cell *_cell(K ix, K iy, K iz, bool create) {
+    Cell *cell = _cells.find(ix, iy, iz);
+    if (cell == NULL && create) {
+      Cell empty;
+      if (_cells.integrateVoxel(ix, iy, iz, &empty)) {
+        cell = _cells.find(ix, iy, iz);
+      }
+    }
+    return cell;
+  }
+
+  void _clear(K ix, K iy, K iz, Cell *cell) {
+    cell->distance = std::numeric_limits<D>::max();
+    cell->has_obstacle = false;
+    _cleared.push_back(Index3(ix, iy, iz));
+  }
+
+  /**
+       * Appends the indices of the obstacle cells among 'cells'.
+       */
+  static void
+  _appendObstacles(const std::vector<typename CellMap::IndexedVoxel> &cells,
+                   std::vector<Index3> &indices) {
+    for (size_t i = 0; i < cells.size(); i++) {
+      if (cells[i].data->occupied)
+        indices.push_back(Index3(cells[i].ix, cells[i].iy, cells[i].iz));
+    }
+  }
+
+  /**
+       * A cell is worth storing while it is an obstacle or near one.
+       */
+  static bool _isLive(const Cell *cell) {
+    return cell->occupied || cell->has_obstacle;
+  }
+
+  D _obstacleDistance(K ix, K iy, K iz, K ox, K oy, K oz) {
+    D dx = D(long(ix) - long(ox)) * _resolution_x;
+    D dy = D(long(iy) - long(oy)) * _resolution_y;
+    D dz = D(long(iz) - long(oz)) * _resolution_z;
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+  }
+
+  /**
+       * Checks whether the obstacle referenced by a cell still exists.
+       */
+  bool _isObstacle(K ox, K oy, K oz) {
+    Cell *obstacle = _cells.find(ox, oy, oz);
+    return obstacle != NULL && obstacle->occupied;
+  }
+
+  /**
+       * Raise step: neighbours pointing to a vanished obstacle are cleared
+       * and raised in turn, valid neighbours are re-queued to lower the
+       * cleared region.
+       */
+  void _raise(const QueueEntry &entry) {
+    for (int dx = -1; dx <= 1; dx++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dz = -1; dz <= 1; dz++) {
+          if (dx == 0 && dy == 0 && dz == 0)
+            continue;
+          long nx = long(entry.x) + dx;
+          long ny = long(entry.y) + dy;
+          long nz = long(entry.z) + dz;
+          if (!_isValid(nx, ny, nz))
+            continue;
+          Cell *neighbour = _cells.find(K(nx), K(ny), K(nz));
+          if (neighbour == NULL || !neighbour->has_obstacle)
+            continue;
+          if (!_isObstacle(neighbour->ox, neighbour->oy, neighbour->oz)) {
+            _clear(K(nx), K(ny), K(nz), neighbour);
+            _open.push(QueueEntry(entry.distance, K(nx), K(ny), K(nz), true));
+          } else {
+            _open.push(
+                QueueEntry(neighbour->distance, K(nx), K(ny), K(nz), false));
+          }
+        }
+      }
+    }
+  }
+
+  /**
+       * Lower step: the nearest obstacle of the cell is offered to its
+       * neighbours, within the truncation distance.
+       */
+  void _lower(const QueueEntry &entry, const Cell &cell) {
+    if (!_isObstacle(cell.ox, cell.oy, cell.oz))
+      return;
+    for (int dx = -1; dx <= 1; dx++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dz = -1; dz <= 1; dz++) {
+          if (dx == 0 && dy == 0 && dz == 0)
+            continue;
+          long nx = long(entry.x) + dx;
+          long ny = long(entry.y) + dy;
+          long nz = long(entry.z) + dz;
+          if (!_isValid(nx, ny, nz))
+            continue;
+          D distance =
+              _obstacleDistance(K(nx), K(ny), K(nz), cell.ox, cell.oy, cell.oz);
+          if (distance > _max_distance)
+            continue;
+          Cell *neighbour = _cell(K(nx), K(ny), K(nz), true);
+          if (neighbour == NULL || distance >= neighbour->distance)
+            continue;
+          neighbour->distance = distance;
+          neighbour->ox = cell.ox;
+          neighbour->oy = cell.oy;
+          neighbour->oz = cell.oz;
+          neighbour->has_obstacle = true;
+          _open.push(QueueEntry(distance, K(nx), K(ny), K(nz), false));
+        }
+      }
+    }
+  }
+
+  bool _isValid(long ix, long iy, long iz) {
+    return ix >= std::numeric_limits<K>::min() &&
+           ix <= std::numeric_limits<K>::max() &&
+           iy >= std::numeric_limits<K>::min() &&
+           iy <= std::numeric_limits<K>::max() &&
+           iz >= std::numeric_limits<K>::min() &&
+           iz <= std::numeric_limits<K>::max();
+  }
+
+  CellMap _cells;
+  D _resolution_x;
+  D _resolution_y;
+  D _resolution_z;
+  D _max_distance;
+  std::priority_queue<QueueEntry> _open;
+  // cells cleared by raise waves since last update()
+  std::vector<Index3> _cleared;
+};
+}
+
+#endif /* DISTANCEFIELD_HPP */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef FINALMAP_HPP
+#define FINALMAP_HPP
+
+#include <cstddef>
+
+namespace skimap {
+
+/**
+     * Sealed variant of a 3D map (SkipListMap, SkipListMapV2, SkiMap,
+     * SkipListMapPacked, HashedVoxelMap) for callers not deriving from it.
+     * Nothing can override MAP anymore, so calls on a FinalMap object,
+     * reference or pointer bind statically, and the coordinates overloads
+     * of integrateVoxel and find call the index ones of MAP directly instead
+     * of through the vtable: the whole per-point path can inline in the
+     * caller. Calls through a MAP pointer still dispatch as usual.
+     * Constructors are the ones of MAP.
+     * MAP template represents the sealed map type.
+     */
+template <class MAP> class FinalMap final : public MAP {
+public:
+  typedef MAP ParentMap;
+  typedef typename MAP::Value V;
+  typedef typename MAP::Index K;
+  typedef typename MAP::Coordinate D;
+
+  using MAP::MAP;
+  using MAP::integrateVoxel;
+  using MAP::find;
+
+  virtual bool integrateVoxel(D x, D y, D z, V *data) {
+    K ix, iy, iz;
+    if (MAP::coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return MAP::integrateVoxel(ix, iy, iz, data);
+    }
+    return false;
+  }
+
+  virtual V *find(D x, D y, D z) {
+    K ix, iy, iz;
+    if (MAP::coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return MAP::find(ix, iy, iz);
+    }
+    return NULL;
+  }
+};
+}
+
+#endif /* FINALMAP_HPP */
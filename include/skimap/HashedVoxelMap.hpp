@@ -0,0 +1,659 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef HASHEDVOXELMAP_HPP
+#define HASHEDVOXELMAP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <boost/thread.hpp>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <omp.h>
+#include <skimap/utils/PackedKey.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
+#include <skimap/utils/VoxelFilters.hpp>
+#include <skimap/voxels/GenericTile2D.hpp>
+#include <skimap/voxels/GenericVoxel3D.hpp>
+#include <utility>
+#include <vector>
+
+namespace skimap {
+
+/**
+     * Voxel map on an open addressing hash table keyed by the packed index
+     * (ix, iy, iz), with linear probing. Integration and find cost a hash
+     * and a short probe instead of a skip list descent, ordered range scans
+     * are lost: radiusSearch probes each index of the box when the box is
+     * small, scans the table otherwise, fetchTiles sorts the keys.
+     * Same public interface of SkipListMapV2 for integrateVoxel, find,
+     * fetchVoxels, radiusSearch and fetchTiles.
+     * With concurrency access voxels are inserted concurrently: a new
+     * voxel claims its slot with a CAS on the key, an existing one is fused
+     * under one of STRIPES mutexes. The table doubles past MAX_LOAD under
+     * an exclusive lock, every other operation holds it shared. Queries may
+     * run concurrently with integration, predicates read each voxel under
+     * its stripe mutex. Fetched voxels point into the table, which may fuse
+     * new data into them at any time: reading them after the query needs
+     * the caller to serialize with integration.
+     * Each index uses at most 21 bits (see PackedKey).
+     * V template represents datatype for user data.
+     * K template represents datatype for indices.
+     * D template represents datatype for coordinates.
+     */
+template <class V, class K, class D> class HashedVoxelMap {
+public:
+  typedef V Value;
+  typedef K Index;
+  typedef D Coordinate;
+  typedef GenericVoxel3D<V, D> Voxel3D;
+  typedef GenericTile2D<V, D> Tiles2D;
+  typedef PackedKey<K> PACKING;
+  typedef typename PACKING::Key Key;
+
+  /**
+       * Table slot: key 0 is an empty slot, a claimed slot has a NULL value
+       * until its voxel is published.
+       */
+  struct Slot {
+    std::atomic<Key> key;
+    std::atomic<V *> value;
+  };
+
+  static const int STRIPES = 64;
+  static const long CHUNK = 4096;
+  static constexpr double MAX_LOAD = 0.7;
+
+  /**
+       *
+       * @param min_index
+       * @param max_index
+       * @param resolution_x
+       * @param resolution_y
+       * @param resolution_z
+       * @param zero_level ground height used by fetchTiles
+       * @param capacity initial number of slots, rounded to a power of two
+       */
+  HashedVoxelMap(K min_index, K max_index, D resolution_x, D resolution_y,
+                 D resolution_z, D zero_level = D(0.0), long capacity = 1024)
+      : _min_index_value(std::max(long(min_index), -PACKING::bias())),
+        _max_index_value(std::min(long(max_index), PACKING::bias() - 1)),
+        _resolution_x(resolution_x), _resolution_y(resolution_y),
+        _resolution_z(resolution_z), _size(0),
+        _self_concurrency_management(false) {
+    _capacity = 16;
+    while (_capacity < capacity)
+      _capacity *= 2;
+    _slots = _allocate(_capacity);
+    setZeroLevel(zero_level);
+  }
+
+  /**
+       */
+  HashedVoxelMap(D resolution, D zero_level = D(0.0))
+      : _min_index_value(
+            std::max(long(std::numeric_limits<K>::min()), -PACKING::bias())),
+        _max_index_value(
+            std::min(long(std::numeric_limits<K>::max()), PACKING::bias() - 1)),
+        _resolution_x(resolution), _resolution_y(resolution),
+        _resolution_z(resolution), _capacity(1024), _size(0),
+        _self_concurrency_management(false) {
+    _slots = _allocate(_capacity);
+    setZeroLevel(zero_level);
+  }
+
+  virtual ~HashedVoxelMap() {
+    for (long i = 0; i < _capacity; i++)
+      delete _slots[i].value.load();
+    delete[] _slots;
+  }
+
+  /**
+       * Sets the ground height used by fetchTiles.
+       */
+  void setZeroLevel(D zero_level) {
+    _zero_level = zero_level;
+    _zero_level_key = K(floor(_zero_level / _resolution_z));
+  }
+
+  bool isValidIndex(K ix, K iy, K iz) {
+    return ix >= _min_index_value && ix <= _max_index_value &&
+           iy >= _min_index_value && iy <= _max_index_value &&
+           iz >= _min_index_value && iz <= _max_index_value;
+  }
+
+  bool coordinatesToIndex(D x, D y, D z, K &ix, K &iy, K &iz) {
+    ix = K(floor(x / _resolution_x));
+    iy = K(floor(y / _resolution_y));
+    iz = K(floor(z / _resolution_z));
+    return isValidIndex(ix, iy, iz);
+  }
+
+  bool indexToCoordinates(K ix, K iy, K iz, D &x, D &y, D &z) {
+    x = ix * _resolution_x + _resolution_x * 0.5;
+    y = iy * _resolution_y + _resolution_y * 0.5;
+    z = iz * _resolution_z + _resolution_z * 0.5;
+    return true;
+  }
+
+  virtual bool integrateVoxel(D x, D y, D z, V *data) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return integrateVoxel(ix, iy, iz, data);
+    }
+    return false;
+  }
+
+  /**
+       * Integrates a voxel (V operator+ with the existing one).
+       */
+  virtual bool integrateVoxel(K ix, K iy, K iz, V *data) {
+    if (!isValidIndex(ix, iy, iz))
+      return false;
+    return _integrateKey(PACKING::packIndex(ix, iy, iz), data);
+  }
+
+  /**
+       * Voxel keys of a batch of points, converted with SIMD (see
+       * PackedKey::fromCoordinates), for integrateKeys. Points out of the
+       * map range get key 0.
+       * @param transform rigid transform applied to the points, 4x4
+       * row-major, or NULL
+       * @param keys OUTPUT 'size' keys
+       */
+  void coordinatesToKeys(const D *x, const D *y, const D *z, long size,
+                         Key *keys, const D *transform = NULL) {
+    D inverse_resolution[3] = {D(1) / _resolution_x, D(1) / _resolution_y,
+                               D(1) / _resolution_z};
+    PACKING::fromCoordinates(x, y, z, size, inverse_resolution,
+                             _min_index_value, _max_index_value, transform,
+                             keys);
+  }
+
+  /**
+       * Integrates a batch of voxels by key. Data falling in the same voxel
+       * is fused first (V operator+), so each voxel is claimed once; voxels
+       * are integrated in parallel with concurrency access. Keys 0 are
+       * skipped.
+       * @return number of voxels touched
+       */
+  long integrateKeys(const Key *keys, const V *data, long size) {
+    std::vector<std::pair<Key, long>> order;
+    order.reserve(size);
+    for (long i = 0; i < size; i++) {
+      if (keys[i] != 0)
+        order.push_back(std::make_pair(keys[i], i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<std::pair<Key, V>> voxels;
+    voxels.reserve(order.size());
+    for (long i = 0; i < long(order.size()); i++) {
+      if (i > 0 && order[i].first == order[i - 1].first) {
+        voxels.back().second = voxels.back().second + data[order[i].second];
+      } else {
+        voxels.push_back(std::make_pair(order[i].first, data[order[i].second]));
+      }
+    }
+
+#pragma omp parallel for if (this->hasConcurrencyAccess())
+    for (long i = 0; i < long(voxels.size()); i++) {
+      _integrateKey(voxels[i].first, &voxels[i].second);
+    }
+    return voxels.size();
+  }
+
+  /**
+       * Integrates a batch of points given as arrays of coordinates,
+       * optionally moved by a rigid transform: coordinatesToKeys followed by
+       * integrateKeys.
+       * @return number of voxels touched
+       */
+  long integrateVoxels(const D *x, const D *y, const D *z, const V *data,
+                       long size, const D *transform = NULL) {
+    std::vector<Key> keys(size);
+    coordinatesToKeys(x, y, z, size, keys.data(), transform);
+    return integrateKeys(keys.data(), data, size);
+  }
+
+  virtual V *find(K ix, K iy, K iz) {
+    if (!isValidIndex(ix, iy, iz))
+      return NULL;
+    boost::shared_lock<boost::shared_mutex> lock(_table_mutex,
+                                                 boost::defer_lock);
+    if (this->hasConcurrencyAccess())
+      lock.lock();
+    return _lookup(PACKING::packIndex(ix, iy, iz));
+  }
+
+  virtual V *find(D x, D y, D z) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return find(ix, iy, iz);
+    }
+    return NULL;
+  }
+
+  virtual long voxelsCount() { return _size; }
+
+  /**
+       * @return number of slots of the table
+       */
+  long capacity() { return _capacity; }
+
+  /**
+       * Fetches all voxels, in no particular order, with a parallel scan of
+       * the table.
+       * @param voxels OUTPUT voxels
+       */
+  virtual void fetchVoxels(std::vector<Voxel3D> &voxels) {
+    fetchVoxels(voxels, AllVoxelsFilter<V>());
+  }
+
+  /**
+       * Fetches voxels matching a predicate, in no particular order.
+       * @param voxels OUTPUT voxels
+       * @param predicate functor bool(const V *)
+       */
+  template <class PREDICATE>
+  void fetchVoxels(std::vector<Voxel3D> &voxels, PREDICATE predicate) {
+    boost::shared_lock<boost::shared_mutex> lock(_table_mutex,
+                                                 boost::defer_lock);
+    if (this->hasConcurrencyAccess())
+      lock.lock();
+    _gatherSlots(voxels, [&](Key key, V *data, Voxel3D &voxel) {
+      if (!_test(key, data, predicate))
+        return false;
+      voxel = _voxel(key, data);
+      return true;
+    });
+  }
+
+  /**
+       * Radius search, same semantics of SkipListMapV2::radiusSearch. A box
+       * with less indices than slots is probed index by index, X slices in
+       * parallel, and comes out sorted; a larger one scans the table and
+       * comes out in no particular order.
+       */
+  virtual void radiusSearch(K cx, K cy, K cz, K radiusx, K radiusy, K radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    long min_x = std::max(long(cx) - radiusx, _min_index_value);
+    long max_x = std::min(long(cx) + radiusx, _max_index_value);
+    long min_y = std::max(long(cy) - radiusy, _min_index_value);
+    long max_y = std::min(long(cy) + radiusy, _max_index_value);
+    long min_z = std::max(long(cz) - radiusz, _min_index_value);
+    long max_z = std::min(long(cz) + radiusz, _max_index_value);
+    if (min_x > max_x || min_y > max_y || min_z > max_z) {
+      voxels.clear();
+      return;
+    }
+
+    D rx, ry, rz, radius;
+    D centerx, centery, centerz;
+    indexToCoordinates(radiusx, radiusy, radiusz, rx, ry, rz);
+    indexToCoordinates(cx, cy, cz, centerx, centery, centerz);
+    radius = (rx + ry + rz) / 3.0;
+
+    auto inside = [&](const Voxel3D &voxel) {
+      return boxed || sqrt(pow(centerx - voxel.x, 2) +
+                           pow(centery - voxel.y, 2) +
+                           pow(centerz - voxel.z, 2)) <= radius;
+    };
+
+    boost::shared_lock<boost::shared_mutex> lock(_table_mutex,
+                                                 boost::defer_lock);
+    if (this->hasConcurrencyAccess())
+      lock.lock();
+
+    double volume = double(max_x - min_x + 1) * double(max_y - min_y + 1) *
+                    double(max_z - min_z + 1);
+    if (volume > _capacity) {
+      _gatherSlots(voxels, [&](Key key, V *data, Voxel3D &voxel) {
+        K ix, iy, iz;
+        PACKING::unpackIndex(key, ix, iy, iz);
+        if (ix < min_x || ix > max_x || iy < min_y || iy > max_y ||
+            iz < min_z || iz > max_z)
+          return false;
+        voxel = _voxel(key, data);
+        return inside(voxel);
+      });
+      return;
+    }
+
+    auto visit_slice = [&](int i, Voxel3D *output, long capacity) {
+      long count = 0;
+      K ix = K(min_x + i);
+      for (long iy = min_y; iy <= max_y; iy++) {
+        for (long iz = min_z; iz <= max_z; iz++) {
+          Key key = PACKING::packIndex(ix, K(iy), K(iz));
+          V *data = _lookup(key);
+          if (data == NULL)
+            continue;
+          Voxel3D voxel = _voxel(key, data);
+          if (!inside(voxel))
+            continue;
+          if (output != NULL) {
+            if (count == capacity)
+              return count;
+            output[count] = voxel;
+          }
+          count++;
+        }
+      }
+      return count;
+    };
+
+    parallelGatherBounded(
+        int(max_x - min_x + 1),
+        [&](int i) { return visit_slice(i, NULL, 0); },
+        [&](int i, Voxel3D *output, long capacity) {
+          return visit_slice(i, output, capacity);
+        },
+        voxels);
+  }
+
+  virtual void radiusSearch(D cx, D cy, D cz, D radiusx, D radiusy, D radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(cx, cy, cz, ix, iy, iz)) {
+      K iradiusx, iradiusy, iradiusz;
+      iradiusx = K(floor(radiusx / _resolution_x));
+      iradiusy = K(floor(radiusy / _resolution_y));
+      iradiusz = K(floor(radiusz / _resolution_z));
+      radiusSearch(ix, iy, iz, iradiusx, iradiusy, iradiusz, voxels, boxed);
+    }
+  }
+
+  /**
+       * Fetches one tile per (X,Y) column, same semantics of
+       * SkiMap::fetchTiles: the tile holds the lowest voxel at or above the
+       * zero level, if it is below min_voxel_height. Keys are gathered in
+       * parallel and sorted, so columns come out sorted.
+       * @param voxels OUTPUT tiles
+       * @param min_voxel_height
+       */
+  virtual void fetchTiles(std::vector<Tiles2D> &voxels, D min_voxel_height) {
+    typedef std::pair<Key, V *> Entry;
+    std::vector<Entry> entries;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(_table_mutex,
+                                                   boost::defer_lock);
+      if (this->hasConcurrencyAccess())
+        lock.lock();
+      _gatherSlots(entries, [&](Key key, V *data, Entry &entry) {
+        entry = Entry(key, data);
+        return true;
+      });
+    }
+    std::sort(entries.begin(), entries.end());
+
+    Key zero_uz = PACKING::unbias(std::max(
+        K(_min_index_value), std::min(K(_max_index_value), _zero_level_key)));
+    voxels.clear();
+    for (long i = 0; i < long(entries.size());) {
+      Key ux, uy, uz;
+      PACKING::unpack(entries[i].first, ux, uy, uz);
+      long ground = -1;
+      long j = i;
+      for (; j < long(entries.size()); j++) {
+        Key gx, gy, gz;
+        PACKING::unpack(entries[j].first, gx, gy, gz);
+        if (gx != ux || gy != uy)
+          break;
+        if (ground < 0 && gz >= zero_uz)
+          ground = j;
+      }
+
+      K ix, iy, iz;
+      D x, y, z;
+      PACKING::unpackIndex(entries[i].first, ix, iy, iz);
+      indexToCoordinates(ix, iy, _zero_level_key, x, y, z);
+      Tiles2D tile(x, y, z, NULL);
+      if (ground >= 0) {
+        PACKING::unpackIndex(entries[ground].first, ix, iy, iz);
+        D height = iz * _resolution_z + _resolution_z * 0.5;
+        if (height <= min_voxel_height)
+          tile.data = entries[ground].second;
+      }
+      voxels.push_back(tile);
+      i = j;
+    }
+  }
+
+  virtual void enableConcurrencyAccess(bool status = true) {
+    _self_concurrency_management = status;
+  }
+
+  bool hasConcurrencyAccess() { return _self_concurrency_management; }
+
+protected:
+  static Slot *_allocate(long capacity) {
+    Slot *slots = new Slot[capacity];
+    for (long i = 0; i < capacity; i++) {
+      slots[i].key.store(0, std::memory_order_relaxed);
+      slots[i].value.store(NULL, std::memory_order_relaxed);
+    }
+    return slots;
+  }
+
+  /**
+       * splitmix64 finalizer: packed keys of neighbouring voxels differ in
+       * a few low bits, the mix spreads them over the table.
+       */
+  static Key _hash(Key key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+  }
+
+  /**
+       * Integrates the voxel of a valid key, growing the table if needed.
+       */
+  bool _integrateKey(Key key, V *data) {
+    for (;;) {
+      long capacity;
+      bool inserted = false;
+      {
+        boost::shared_lock<boost::shared_mutex> lock(_table_mutex,
+                                                     boost::defer_lock);
+        if (this->hasConcurrencyAccess())
+          lock.lock();
+        capacity = _capacity;
+        Slot *slot = _claim(key, data, inserted);
+        if (slot != NULL) {
+          if (!inserted)
+            _fuse(key, *slot, data);
+          if (!inserted || _size <= MAX_LOAD * _capacity)
+            return true;
+        }
+      }
+      // table full or past MAX_LOAD: grow, and retry if nothing was inserted
+      _grow(capacity);
+      if (inserted)
+        return true;
+    }
+  }
+
+  /**
+       * Finds the slot of a key, claiming an empty one with a copy of 'data'
+       * if the key is missing.
+       * @param inserted OUTPUT TRUE if the slot was claimed by this call
+       * @return the slot, NULL if the table is full
+       */
+  Slot *_claim(Key key, V *data, bool &inserted) {
+    Key mask = Key(_capacity - 1);
+    Key index = _hash(key) & mask;
+    for (long probe = 0; probe < _capacity; probe++) {
+      Slot &slot = _slots[index];
+      Key current = slot.key.load(std::memory_order_acquire);
+      if (current == 0) {
+        if (slot.key.compare_exchange_strong(current, key,
+                                             std::memory_order_acq_rel)) {
+          slot.value.store(new V(data), std::memory_order_release);
+          _size++;
+          inserted = true;
+          return &slot;
+        }
+      }
+      if (current == key)
+        return &slot;
+      index = (index + 1) & mask;
+    }
+    return NULL;
+  }
+
+  /**
+       * Fuses data in the voxel of a slot claimed by another integration,
+       * waiting for the voxel to be published.
+       */
+  void _fuse(Key key, Slot &slot, V *data) {
+    V *voxel;
+    while ((voxel = slot.value.load(std::memory_order_acquire)) == NULL)
+      boost::this_thread::yield();
+    if (this->hasConcurrencyAccess()) {
+      boost::mutex::scoped_lock lock(_stripes[_stripe(key)]);
+      *voxel = *voxel + *data;
+    } else {
+      *voxel = *voxel + *data;
+    }
+  }
+
+  /**
+       * @return stripe mutex guarding the voxel of a key
+       */
+  static int _stripe(Key key) { return int((_hash(key) >> 32) % STRIPES); }
+
+  /**
+       * Evaluates a predicate on a voxel, under its stripe mutex with
+       * concurrency access, since integration fuses data into it in place.
+       */
+  template <class PREDICATE>
+  bool _test(Key key, const V *data, PREDICATE &predicate) {
+    if (!this->hasConcurrencyAccess())
+      return predicate(data);
+    boost::mutex::scoped_lock lock(_stripes[_stripe(key)]);
+    return predicate(data);
+  }
+
+  /**
+       * @return voxel of a key, NULL if missing or not yet published
+       */
+  V *_lookup(Key key) {
+    Key mask = Key(_capacity - 1);
+    Key index = _hash(key) & mask;
+    for (long probe = 0; probe < _capacity; probe++) {
+      Key current = _slots[index].key.load(std::memory_order_acquire);
+      if (current == key)
+        return _slots[index].value.load(std::memory_order_acquire);
+      if (current == 0)
+        return NULL;
+      index = (index + 1) & mask;
+    }
+    return NULL;
+  }
+
+  /**
+       * Doubles the table, unless another integration already grew it.
+       * @param capacity capacity seen by the caller
+       */
+  void _grow(long capacity) {
+    boost::unique_lock<boost::shared_mutex> lock(_table_mutex,
+                                                 boost::defer_lock);
+    if (this->hasConcurrencyAccess())
+      lock.lock();
+    if (_capacity != capacity)
+      return;
+
+    long grown_capacity = _capacity * 2;
+    Slot *slots = _allocate(grown_capacity);
+    Key mask = Key(grown_capacity - 1);
+
+#pragma omp parallel for
+    for (long i = 0; i < _capacity; i++) {
+      Key key = _slots[i].key.load(std::memory_order_relaxed);
+      if (key == 0)
+        continue;
+      for (Key index = _hash(key) & mask;; index = (index + 1) & mask) {
+        Key empty = 0;
+        if (slots[index].key.compare_exchange_strong(empty, key)) {
+          slots[index].value.store(
+              _slots[i].value.load(std::memory_order_relaxed));
+          break;
+        }
+      }
+    }
+
+    delete[] _slots;
+    _slots = slots;
+    _capacity = grown_capacity;
+  }
+
+  Voxel3D _voxel(Key key, V *data) {
+    K ix, iy, iz;
+    D x, y, z;
+    PACKING::unpackIndex(key, ix, iy, iz);
+    indexToCoordinates(ix, iy, iz, x, y, z);
+    return Voxel3D(x, y, z, data);
+  }
+
+  /**
+       * Gathers the published voxels of the table, CHUNK slots per work item
+       * (see parallelGatherBounded). Caller holds the table lock.
+       * @param output OUTPUT items
+       * @param emit functor bool(Key, V *, T &) filling an item, FALSE to
+       * skip the voxel
+       */
+  template <class T, class EMIT>
+  void _gatherSlots(std::vector<T> &output, EMIT emit) {
+    auto visit_chunk = [&](int c, T *items, long capacity) {
+      long count = 0;
+      long end = std::min(_capacity, (c + 1) * CHUNK);
+      T item;
+      for (long i = c * CHUNK; i < end; i++) {
+        Key key = _slots[i].key.load(std::memory_order_acquire);
+        V *data = _slots[i].value.load(std::memory_order_acquire);
+        if (key == 0 || data == NULL || !emit(key, data, item))
+          continue;
+        if (items != NULL) {
+          if (count == capacity)
+            return count;
+          items[count] = item;
+        }
+        count++;
+      }
+      return count;
+    };
+
+    parallelGatherBounded(
+        int((_capacity + CHUNK - 1) / CHUNK),
+        [&](int c) { return visit_chunk(c, NULL, 0); },
+        [&](int c, T *items, long capacity) {
+          return visit_chunk(c, items, capacity);
+        },
+        output);
+  }
+
+  long _min_index_value;
+  long _max_index_value;
+  D _resolution_x;
+  D _resolution_y;
+  D _resolution_z;
+  D _zero_level;
+  K _zero_level_key;
+  Slot *_slots;
+  long _capacity;
+  std::atomic<long> _size;
+  bool _self_concurrency_management;
+  boost::shared_mutex _table_mutex;
+  boost::mutex _stripes[STRIPES];
+};
+}
+
+#endif /* HASHEDVOXELMAP_HPP */
@@ -10,12 +10,15 @@
 #ifndef KDSKIPLIST_HPP
 #define KDSKIPLIST_HPP
 
+#include <algorithm>
 #include <boost/thread.hpp>
 #include <fstream>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <queue>
 #include <skimap/SkipList.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
+#include <skimap/utils/VoxelFilters.hpp>
 #include <skimap/voxels/GenericVoxelKD.hpp>
 #include <vector>
 
@@ -35,6 +38,8 @@ class KDSkipList
     typedef std::vector<Index> Indices;
     typedef std::vector<D> Coordinates;
 
+    static const int STRIPES = 64;
+
     /**
            */
     KDSkipList(int DIM, D resolution)
@@ -53,12 +58,6 @@ class KDSkipList
            */
     virtual ~KDSkipList()
     {
-        for (typename std::map<K, boost::mutex *>::iterator it =
-                 this->mutex_map.begin();
-             it != this->mutex_map.end(); ++it)
-        {
-            delete it->second;
-        }
     }
 
     /**
@@ -73,7 +72,7 @@ class KDSkipList
     }
 
     /////
-    virtual bool isValidIndices(Indices &idx)
+    bool isValidIndices(const Indices &idx)
     {
         if (idx.size() != DIM)
             return false;
@@ -91,7 +90,7 @@ class KDSkipList
            * @param idx  RESIZE IT BY YOURSELF!
            * @return
            */
-    virtual bool coordinatesToIndex(Coordinates cds, Indices &idx)
+    bool coordinatesToIndex(const Coordinates &cds, Indices &idx)
     {
         //dx.resize(cds.size());
         for (size_t i = 0; i < cds.size(); i++)
@@ -108,9 +107,10 @@ class KDSkipList
            * @param resolution
            * @return
            */
-    virtual bool singleIndexToCoordinate(K index, D &coordinate, D resolution)
+    bool singleIndexToCoordinate(K index, D &coordinate, D resolution)
     {
         coordinate = index * resolution + resolution * 0.5;
+        return true;
     }
 
     /**
@@ -119,7 +119,7 @@ class KDSkipList
            * @param cds RESIZE IT BY YOURSELF!
            * @return
            */
-    virtual bool indexToCoordinates(const Indices &idx, Coordinates &cds)
+    bool indexToCoordinates(const Indices &idx, Coordinates &cds)
     {
         for (size_t i = 0; i < idx.size(); i++)
         {
@@ -142,29 +142,11 @@ class KDSkipList
         typedef const typename KNODE::NodeType Node;
 
         const Node *node = _root_list->find(idx[0]);
-
-        int pointer = 1;
-        while (pointer < DIM)
+        for (int pointer = 1; pointer < DIM && node != NULL; pointer++)
         {
-            K current_index = idx[pointer];
-            if (node != NULL)
-            {
-                if (pointer == DIM - 1)
-                {
-                    return reinterpret_cast<V *>(reinterpret_cast<Node *>(node)->value);
-                }
-                else
-                {
-                    node = reinterpret_cast<KNODE *>(reinterpret_cast<Node *>(node)->value)->find(current_index);
-                }
-            }
-            else
-            {
-                break;
-            }
-            pointer++;
+            node = reinterpret_cast<KNODE *>(node->value)->find(idx[pointer]);
         }
-        return NULL;
+        return node != NULL ? reinterpret_cast<V *>(node->value) : NULL;
     }
 
     /**
@@ -184,34 +166,24 @@ class KDSkipList
     }
 
     /**
-      * Lock concurrency access to a X branch
-      * @param key x index
+      * Lock concurrency access to a first dimension branch. Branches share
+      * STRIPES mutexes, so writers of different branches rarely contend.
+      * @param key first index
       * @return
       */
-    virtual void lockMap(K key)
+    void lockMap(K key)
     {
-        this->mutex_map_mutex.lock();
-        if (this->mutex_map.count(key) == 0)
-        {
-            mutex_map[key] = new boost::mutex();
-        }
-        this->mutex_map_mutex.unlock();
-        mutex_map[key]->lock();
+        _stripes[_stripe(key)].lock();
     }
 
     /**
-      * UnLock concurrency access to a X branch
-      * @param key x index
+      * UnLock concurrency access to a first dimension branch
+      * @param key first index
       * @return
       */
-    virtual void unlockMap(K key)
+    void unlockMap(K key)
     {
-        this->mutex_map_mutex.lock();
-        if (this->mutex_map.count(key) > 0)
-        {
-            mutex_map[key]->unlock();
-        }
-        this->mutex_map_mutex.unlock();
+        _stripes[_stripe(key)].unlock();
     }
 
     /**
@@ -253,6 +225,21 @@ class KDSkipList
 
             KNODE *current = _root_list;
             const Node *node = current->find(idx[0]);
+            if (node == NULL)
+            {
+                // Root list is shared by all the branches, with DIM 1 it
+                // holds the voxels themselves
+                void *value;
+                if (DIM > 1)
+                    value = new KNODE(_min_index_value, _max_index_value);
+                else
+                    value = new V;
+                if (this->hasConcurrencyAccess())
+                    _root_list->lock(idx[0]);
+                node = _root_list->insert(idx[0], value);
+                if (this->hasConcurrencyAccess())
+                    _root_list->unlock(idx[0]);
+            }
 
             int pointer = 0;
             while (pointer < DIM)
@@ -297,134 +284,190 @@ class KDSkipList
     }
 
     /**
-           *
-           * @param voxels
+           * Integrates a batch of voxels (V operator+ with the existing ones).
+           * Indices are sorted once, then each first dimension branch is
+           * visited a single time per batch, in parallel if concurrency access
+           * is enabled: runs sharing a prefix descend the levels once, and
+           * missing subtrees are built bottom-up and linked in sorted order
+           * (SkipList::appendSorted) instead of point by point.
+           * @param indices voxels indices
+           * @param data voxels data, one per indices
+           * @return number of integrated voxels
            */
-    virtual void fetchVoxels(std::vector<VoxelKD> &voxels, Indices min_idx = Indices(0), Indices max_idx = Indices(0))
+    virtual long integrateVoxels(const std::vector<Indices> &indices, const V *data)
     {
-        Indices idx(DIM);
-
-        std::vector<typename KNODE::NodeType *> temp_nodes;
-        if (min_idx.size() == idx.size() && max_idx.size() == idx.size())
+        std::vector<long> order;
+        order.reserve(indices.size());
+        for (long i = 0; i < long(indices.size()); i++)
         {
-            _root_list->retrieveNodesByRange(min_idx[0], max_idx[0], temp_nodes);
+            if (isValidIndices(indices[i]))
+                order.push_back(i);
         }
-        else
+        std::sort(order.begin(), order.end(), [&](long a, long b) {
+            return indices[a] < indices[b];
+        });
+
+        // Runs of the first dimension
+        std::vector<long> runs;
+        for (long i = 0; i < long(order.size()); i++)
         {
-            _root_list->retrieveNodes(temp_nodes);
+            if (i == 0 || indices[order[i]][0] != indices[order[i - 1]][0])
+                runs.push_back(i);
         }
+        runs.push_back(order.size());
 
-#pragma omp parallel
+        BatchRun batch(indices, data, order);
+#pragma omp parallel for schedule(dynamic) if (hasConcurrencyAccess())
+        for (int r = 0; r < int(runs.size()) - 1; r++)
         {
-            std::vector<VoxelKD> voxels_private;
+            K key = indices[order[runs[r]]][0];
+            if (this->hasConcurrencyAccess())
+                this->lockMap(key);
 
-#pragma omp for nowait
-            for (int i = 0; i < temp_nodes.size(); i++)
+            const typename KNODE::NodeType *node = _root_list->find(key);
+            if (node == NULL)
             {
-                Indices idx(DIM);
-                idx[0] = reinterpret_cast<typename KNODE::NodeType *>(temp_nodes[i])->key;
-                fetchDimension(reinterpret_cast<KNODE *>(temp_nodes[i]->value), idx, voxels_private, 1, min_idx, max_idx);
+                void *branch = buildSubtree(batch, runs[r], runs[r + 1], 1);
+                if (this->hasConcurrencyAccess())
+                    _root_list->lock(key);
+                _root_list->insert(key, branch);
+                if (this->hasConcurrencyAccess())
+                    _root_list->unlock(key);
+            }
+            else if (DIM == 1)
+            {
+                V *voxel = reinterpret_cast<V *>(node->value);
+                for (long i = runs[r]; i < runs[r + 1]; i++)
+                    *voxel = *voxel + data[order[i]];
+            }
+            else
+            {
+                integrateRun(reinterpret_cast<KNODE *>(node->value), batch, runs[r], runs[r + 1], 1);
             }
 
-#pragma omp critical
-            voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
+            if (this->hasConcurrencyAccess())
+                this->unlockMap(key);
         }
+        return long(order.size());
     }
 
-    void fetchDimension(KNODE *root, Indices idx, std::vector<VoxelKD> &voxels, int current_dim, Indices min_idx = Indices(0), Indices max_idx = Indices(0))
+    /**
+           * Batch integration of voxels given by coordinates, see
+           * integrateVoxels.
+           * @param cds voxels coordinates
+           * @param data voxels data, one per coordinates
+           * @return number of integrated voxels
+           */
+    virtual long integrateVoxels(const std::vector<Coordinates> &cds, const V *data)
     {
-        if (current_dim < DIM - 1)
+        std::vector<Indices> indices(cds.size(), Indices(DIM));
+        for (size_t i = 0; i < cds.size(); i++)
         {
-            std::vector<typename KNODE::NodeType *> temp_nodes;
-            if (root != NULL)
-            {
-                if (min_idx.size() == idx.size() && max_idx.size() == idx.size())
-                {
-                    root->retrieveNodesByRange(min_idx[current_dim], max_idx[current_dim], temp_nodes);
-                }
-                else
-                {
-                    root->retrieveNodes(temp_nodes);
-                }
-                for (int i = 0; i < temp_nodes.size(); i++)
-                {
-                    idx[current_dim] = reinterpret_cast<typename KNODE::NodeType *>(temp_nodes[i])->key;
-                    this->fetchDimension(reinterpret_cast<KNODE *>(temp_nodes[i]->value), idx, voxels, current_dim + 1);
-                }
-            }
+            if (cds[i].size() != size_t(DIM) || !coordinatesToIndex(cds[i], indices[i]))
+                indices[i].clear();
+        }
+        return integrateVoxels(indices, data);
+    }
+
+    /**
+           * Fetches voxels with a two-pass parallel gather (see
+           * parallelGatherBounded). Capacity of 'voxels' is reused across
+           * calls.
+           * @param voxels OUTPUT voxels
+           * @param min_idx optional lower bounds
+           * @param max_idx optional upper bounds
+           */
+    virtual void fetchVoxels(std::vector<VoxelKD> &voxels, Indices min_idx = Indices(0), Indices max_idx = Indices(0))
+    {
+        Indices idx(DIM);
+
+        std::vector<typename KNODE::NodeType *> temp_nodes;
+        if (min_idx.size() == idx.size() && max_idx.size() == idx.size())
+        {
+            _root_list->retrieveNodesByRange(min_idx[0], max_idx[0], temp_nodes);
         }
         else
         {
-            std::vector<typename KNODE::NodeType *> temp_nodes;
-            if (min_idx.size() == idx.size() && max_idx.size() == idx.size())
-            {
-                root->retrieveNodesByRange(min_idx[current_dim], max_idx[current_dim], temp_nodes);
-            }
-            else
-            {
-                root->retrieveNodes(temp_nodes);
-            }
-            for (int i = 0; i < temp_nodes.size(); i++)
-            {
-                idx[idx.size() - 1] = reinterpret_cast<typename KNODE::NodeType *>(temp_nodes[i])->key;
-                Coordinates cds(idx.size());
-                this->indexToCoordinates(idx, cds);
-                voxels.push_back(
-                    VoxelKD(
-                        cds, reinterpret_cast<V *>(reinterpret_cast<typename KNODE::NodeType *>(temp_nodes[i])->value)));
-            }
+            _root_list->retrieveNodes(temp_nodes);
         }
+
+        parallelGatherBounded(
+            int(temp_nodes.size()),
+            [&](int i) {
+                Indices idx(DIM);
+                CountSink sink;
+                visitBranch(temp_nodes[i], idx, sink, min_idx, max_idx);
+                return sink.count;
+            },
+            [&](int i, VoxelKD *output, long capacity) {
+                Indices idx(DIM);
+                WriteSink sink(this, output, capacity);
+                visitBranch(temp_nodes[i], idx, sink, min_idx, max_idx);
+                return sink.written;
+            },
+            voxels);
+    }
+
+    void fetchDimension(KNODE *root, Indices idx, std::vector<VoxelKD> &voxels, int current_dim, Indices min_idx = Indices(0), Indices max_idx = Indices(0))
+    {
+        VectorSink sink(this, voxels);
+        visitDimension(root, idx, sink, current_dim, min_idx, max_idx);
     }
 
     /**
-           * Radius search
-           * @param cx
-           * @param cy
-           * @param radiusx
-           * @param radiusy
-           * @param voxels
-           * @param boxed
+           * Radius search: voxels whose indices are within 'radius' from
+           * 'center', or within the box of half side 'radius' if 'boxed'.
+           * Each dimension is visited only within the radius left by the
+           * partial squared distance of the upper ones (see visitRadius).
+           * @param center query indices
+           * @param radius radius in indices
+           * @param voxels OUTPUT voxels
+           * @param boxed TRUE to fetch the whole box
            */
     virtual void radiusSearch(Indices center, K radius,
                               std::vector<VoxelKD> &voxels, bool boxed = false)
     {
-        Indices min_idx(DIM);
-        Indices max_idx(DIM);
-        for (int i = 0; i < DIM; i++)
-        {
-            min_idx[i] = center[i] - radius;
-            max_idx[i] = center[i] + radius;
-        }
-
-        std::vector<VoxelKD> temp_voxels;
-        this->fetchVoxels(temp_voxels, min_idx, max_idx);
-
         if (boxed)
         {
-            voxels = temp_voxels;
+            Indices min_idx(DIM);
+            Indices max_idx(DIM);
+            for (int i = 0; i < DIM; i++)
+            {
+                min_idx[i] = K(std::max(long(center[i]) - long(radius), long(_min_index_value)));
+                max_idx[i] = K(std::min(long(center[i]) + long(radius), long(_max_index_value)));
+            }
+            this->fetchVoxels(voxels, min_idx, max_idx);
             return;
         }
 
-        K squaredRadius = radius * radius;
-#pragma omp parallel
-        {
-            std::vector<VoxelKD> filtered_voxels;
+        long squared_radius = long(radius) * long(radius);
+        std::vector<typename KNODE::NodeType *> temp_nodes;
+        _root_list->retrieveNodesByRange(
+            K(std::max(long(center[0]) - long(radius), long(_min_index_value))),
+            K(std::min(long(center[0]) + long(radius), long(_max_index_value))),
+            temp_nodes);
 
-#pragma omp for nowait
-            for (int i = 0; i < temp_voxels.size(); i++)
-            {
-                Indices voxel_center(DIM);
-                coordinatesToIndex(temp_voxels[i].coordinates, voxel_center);
-                K d = indicesSquaredDistance(voxel_center, center);
-                if (d <= squaredRadius)
-                {
-                    filtered_voxels.push_back(temp_voxels[i]);
-                }
-            }
+        // Squared radius left to the deeper dimensions of a first level node
+        auto remaining = [&](int i) {
+            long d = long(temp_nodes[i]->key) - long(center[0]);
+            return squared_radius - d * d;
+        };
 
-#pragma omp critical
-            voxels.insert(voxels.end(), filtered_voxels.begin(), filtered_voxels.end());
-        }
+        parallelGatherBounded(
+            int(temp_nodes.size()),
+            [&](int i) {
+                Indices idx(DIM);
+                CountSink sink;
+                visitRadiusBranch(temp_nodes[i], center, idx, sink, remaining(i));
+                return sink.count;
+            },
+            [&](int i, VoxelKD *output, long capacity) {
+                Indices idx(DIM);
+                WriteSink sink(this, output, capacity);
+                visitRadiusBranch(temp_nodes[i], center, idx, sink, remaining(i));
+                return sink.written;
+            },
+            voxels);
     }
 
     /**
@@ -448,6 +491,77 @@ class KDSkipList
         this->radiusSearch(icenter, iradius, voxels, boxed);
     }
 
+    /**
+           * K-Nearest Neighbours search. Each dimension is visited outward
+           * from the query index in increasing distance order, keeping the
+           * best K voxels in a bounded max-heap. A branch is abandoned as soon
+           * as its partial distance exceeds the current K-th best distance.
+           * @param center query indices
+           * @param k number of neighbours
+           * @param voxels OUTPUT neighbours sorted by increasing distance
+           * @param distances OUTPUT euclidean distances of the neighbours
+           * @param filter functor bool(const V*) discarding unwanted voxels
+           * @param max_distance max euclidean distance of a neighbour
+           */
+    template <class F>
+    void nearestSearch(const Indices &center, int k, std::vector<VoxelKD> &voxels,
+                       std::vector<D> &distances, F filter,
+                       D max_distance = std::numeric_limits<D>::max())
+    {
+        voxels.clear();
+        distances.clear();
+        if (k <= 0 || center.size() != size_t(DIM))
+            return;
+
+        std::priority_queue<NeighbourCandidate> heap;
+        D max_squared = max_distance < std::sqrt(std::numeric_limits<D>::max())
+                            ? max_distance * max_distance
+                            : std::numeric_limits<D>::max();
+
+        Indices idx(DIM);
+        nearestDimension(_root_list, center, idx, 0, D(0), heap, k, max_squared, filter);
+
+        voxels.resize(heap.size());
+        distances.resize(heap.size());
+        for (int i = int(heap.size()) - 1; i >= 0; i--)
+        {
+            const NeighbourCandidate &c = heap.top();
+            Coordinates cds(DIM);
+            this->indexToCoordinates(c.idx, cds);
+            voxels[i] = VoxelKD(cds, c.data);
+            distances[i] = std::sqrt(c.squared_distance);
+            heap.pop();
+        }
+    }
+
+    /**
+           * K-Nearest Neighbours search without filtering.
+           * @param center query indices
+           * @param k number of neighbours
+           * @param voxels OUTPUT neighbours sorted by increasing distance
+           */
+    virtual void nearestSearch(const Indices &center, int k, std::vector<VoxelKD> &voxels)
+    {
+        std::vector<D> distances;
+        nearestSearch(center, k, voxels, distances, AllVoxelsFilter<V>());
+    }
+
+    /**
+           * K-Nearest Neighbours search by coordinates.
+           * @param center query coordinates
+           * @param k number of neighbours
+           * @param voxels OUTPUT neighbours sorted by increasing distance
+           */
+    virtual void nearestSearch(const Coordinates &center, int k, std::vector<VoxelKD> &voxels)
+    {
+        Indices icenter(DIM);
+        voxels.clear();
+        if (coordinatesToIndex(center, icenter))
+        {
+            nearestSearch(icenter, k, voxels);
+        }
+    }
+
     /**
            *
            * @param filename
@@ -527,12 +641,385 @@ class KDSkipList
         this->_self_concurrency_management = status;
     }
 
-    virtual bool hasConcurrencyAccess()
+    bool hasConcurrencyAccess()
     {
         return this->_self_concurrency_management;
     }
 
   protected:
+    /**
+           * Sink counting visited voxels
+           */
+    struct CountSink
+    {
+        long count;
+
+        CountSink() : count(0)
+        {
+        }
+
+        void push(const Indices &idx, V *data)
+        {
+            count++;
+        }
+    };
+
+    /**
+           * Sink writing visited voxels in a presized buffer, at most
+           * 'capacity' of them
+           */
+    struct WriteSink
+    {
+        KDSkipList *map;
+        VoxelKD *output;
+        long capacity;
+        long written;
+
+        WriteSink(KDSkipList *map, VoxelKD *output, long capacity)
+            : map(map), output(output), capacity(capacity), written(0)
+        {
+        }
+
+        void push(const Indices &idx, V *data)
+        {
+            if (written >= capacity)
+                return;
+            Coordinates cds(idx.size());
+            map->indexToCoordinates(idx, cds);
+            output[written++] = VoxelKD(cds, data);
+        }
+    };
+
+    /**
+           * Sink appending visited voxels to a vector
+           */
+    struct VectorSink
+    {
+        KDSkipList *map;
+        std::vector<VoxelKD> &voxels;
+
+        VectorSink(KDSkipList *map, std::vector<VoxelKD> &voxels) : map(map), voxels(voxels)
+        {
+        }
+
+        void push(const Indices &idx, V *data)
+        {
+            Coordinates cds(idx.size());
+            map->indexToCoordinates(idx, cds);
+            voxels.push_back(VoxelKD(cds, data));
+        }
+    };
+
+    /**
+           * Visits the voxels under a node of the root list, with a single
+           * dimension the node value is the voxel itself.
+           */
+    template <class SINK>
+    void visitBranch(typename KNODE::NodeType *node, Indices &idx, SINK &sink, const Indices &min_idx, const Indices &max_idx)
+    {
+        idx[0] = node->key;
+        if (DIM == 1)
+            sink.push(idx, reinterpret_cast<V *>(node->value));
+        else
+            visitDimension(reinterpret_cast<KNODE *>(node->value), idx, sink, 1, min_idx, max_idx);
+    }
+
+    /**
+           * Visits the voxels under a node of the root list within the
+           * radius left by 'squared_radius' (see visitRadius).
+           */
+    template <class SINK>
+    void visitRadiusBranch(typename KNODE::NodeType *node, const Indices &center, Indices &idx, SINK &sink, long squared_radius)
+    {
+        idx[0] = node->key;
+        if (DIM == 1)
+            sink.push(idx, reinterpret_cast<V *>(node->value));
+        else
+            visitRadius(reinterpret_cast<KNODE *>(node->value), center, idx, sink, 1, squared_radius);
+    }
+
+    /**
+           * Recursively visits a dimension pushing leaf voxels into a sink.
+           */
+    template <class SINK>
+    void visitDimension(KNODE *root, Indices &idx, SINK &sink, int current_dim, const Indices &min_idx, const Indices &max_idx)
+    {
+        if (root == NULL)
+            return;
+
+        std::vector<typename KNODE::NodeType *> temp_nodes;
+        if (min_idx.size() == idx.size() && max_idx.size() == idx.size())
+        {
+            root->retrieveNodesByRange(min_idx[current_dim], max_idx[current_dim], temp_nodes);
+        }
+        else
+        {
+            root->retrieveNodes(temp_nodes);
+        }
+
+        if (current_dim < DIM - 1)
+        {
+            for (int i = 0; i < temp_nodes.size(); i++)
+            {
+                idx[current_dim] = temp_nodes[i]->key;
+                this->visitDimension(reinterpret_cast<KNODE *>(temp_nodes[i]->value), idx, sink, current_dim + 1, min_idx, max_idx);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < temp_nodes.size(); i++)
+            {
+                idx[idx.size() - 1] = temp_nodes[i]->key;
+                sink.push(idx, reinterpret_cast<V *>(temp_nodes[i]->value));
+            }
+        }
+    }
+
+    /**
+           * Recursively visits a dimension within the radius left by
+           * 'squared_radius', i.e. the squared radius of the query minus the
+           * partial squared distance of the upper dimensions, pushing the
+           * leaf voxels into a sink.
+           */
+    template <class SINK>
+    void visitRadius(KNODE *root, const Indices &center, Indices &idx, SINK &sink, int current_dim, long squared_radius)
+    {
+        if (root == NULL)
+            return;
+
+        long half = long(std::sqrt(double(squared_radius)));
+        while (half * half > squared_radius)
+            half--;
+        while ((half + 1) * (half + 1) <= squared_radius)
+            half++;
+
+        typedef typename KNODE::NodeType Node;
+        Node *node = root->lowerBound(K(std::max(long(center[current_dim]) - half, long(_min_index_value))));
+        for (; node != NULL; node = root->next(node))
+        {
+            long d = long(node->key) - long(center[current_dim]);
+            if (d > half)
+                break;
+            idx[current_dim] = node->key;
+            if (current_dim == DIM - 1)
+                sink.push(idx, reinterpret_cast<V *>(node->value));
+            else
+                visitRadius(reinterpret_cast<KNODE *>(node->value), center, idx, sink, current_dim + 1, squared_radius - d * d);
+        }
+    }
+
+    /**
+           * Sorted batch of voxels for integrateVoxels: 'order' lists the
+           * valid voxels by increasing indices.
+           */
+    struct BatchRun
+    {
+        const std::vector<Indices> &indices;
+        const V *data;
+        const std::vector<long> &order;
+
+        BatchRun(const std::vector<Indices> &indices, const V *data, const std::vector<long> &order)
+            : indices(indices), data(data), order(order)
+        {
+        }
+
+        K key(long i, int dim) const
+        {
+            return indices[order[i]][dim];
+        }
+
+        /**
+               * End of the run of [begin, end) sharing the index of 'begin'
+               * on 'dim'.
+               */
+        long runEnd(long begin, long end, int dim) const
+        {
+            long i = begin + 1;
+            while (i < end && key(i, dim) == key(begin, dim))
+                i++;
+            return i;
+        }
+    };
+
+    /**
+           * Builds the subtree of a run of the batch from dimension 'dim': a
+           * new list filled in key order, or a new voxel fusing the run on the
+           * last dimension.
+           */
+    void *buildSubtree(const BatchRun &batch, long begin, long end, int dim)
+    {
+        if (dim == DIM)
+        {
+            V *voxel = new V;
+            for (long i = begin; i < end; i++)
+                *voxel = *voxel + batch.data[batch.order[i]];
+            return voxel;
+        }
+
+        std::vector<std::pair<K, void *> > pairs;
+        for (long i = begin; i < end;)
+        {
+            long run_end = batch.runEnd(i, end, dim);
+            pairs.push_back(std::make_pair(batch.key(i, dim), buildSubtree(batch, i, run_end, dim + 1)));
+            i = run_end;
+        }
+        KNODE *list = new KNODE(_min_index_value, _max_index_value);
+        list->appendSorted(pairs);
+        return list;
+    }
+
+    /**
+           * Integrates a run of the batch into an existing list of dimension
+           * 'dim': existing children are descended once per run, missing ones
+           * built with buildSubtree and inserted in key order.
+           */
+    void integrateRun(KNODE *list, const BatchRun &batch, long begin, long end, int dim)
+    {
+        std::vector<std::pair<K, void *> > missing;
+        for (long i = begin; i < end;)
+        {
+            long run_end = batch.runEnd(i, end, dim);
+            const typename KNODE::NodeType *node = list->find(batch.key(i, dim));
+            if (node == NULL)
+            {
+                missing.push_back(std::make_pair(batch.key(i, dim), buildSubtree(batch, i, run_end, dim + 1)));
+            }
+            else if (dim == DIM - 1)
+            {
+                V *voxel = reinterpret_cast<V *>(node->value);
+                for (long j = i; j < run_end; j++)
+                    *voxel = *voxel + batch.data[batch.order[j]];
+            }
+            else
+            {
+                integrateRun(reinterpret_cast<KNODE *>(node->value), batch, i, run_end, dim + 1);
+            }
+            i = run_end;
+        }
+
+        // Keys past the last one of the list are appended in linear time
+        long split = 0;
+        if (!list->empty())
+        {
+            K last = list->last()->key;
+            for (; split < long(missing.size()) && missing[split].first < last; split++)
+            {
+                list->insert(missing[split].first, missing[split].second);
+            }
+        }
+        list->appendSorted(std::vector<std::pair<K, void *> >(missing.begin() + split, missing.end()));
+    }
+
+    static int _stripe(K key)
+    {
+        return int((unsigned long)(key) % STRIPES);
+    }
+
+    /**
+           * Candidate of the K-Nearest Neighbours heap, ordered by distance
+           */
+    struct NeighbourCandidate
+    {
+        D squared_distance;
+        Indices idx;
+        V *data;
+
+        NeighbourCandidate(D squared_distance, const Indices &idx, V *data)
+            : squared_distance(squared_distance), idx(idx), data(data)
+        {
+        }
+
+        bool operator<(const NeighbourCandidate &other) const
+        {
+            return squared_distance < other.squared_distance;
+        }
+    };
+
+    /**
+           * Visits a single dimension outward from the center index, nearest
+           * first, recursing into deeper dimensions while the partial squared
+           * distance can still improve the current K-th best candidate. The
+           * forward cursor steps with next, nodes below the center are
+           * collected in key ranges twice as wide each time (see
+           * SkipListMapV2::_visitOutward).
+           */
+    template <class F>
+    void nearestDimension(KNODE *root, const Indices &center, Indices &idx, int current_dim,
+                          D base_squared, std::priority_queue<NeighbourCandidate> &heap,
+                          int k, D max_squared, F &filter)
+    {
+        if (root == NULL)
+            return;
+
+        typedef typename KNODE::NodeType Node;
+        long key = long(center[current_dim]);
+        Node *forward = root->lowerBound(center[current_dim]);
+        std::vector<Node *> backward;
+        long min_key = long(root->getMinKey());
+        long below = key - 1;
+        long width = 8;
+        for (;;)
+        {
+            D worst = long(heap.size()) < k ? max_squared : heap.top().squared_distance;
+            while (backward.empty() && below >= min_key)
+            {
+                D d = D(key - below) * _resolution;
+                if (base_squared + d * d > worst)
+                {
+                    below = min_key - 1;
+                    break;
+                }
+                long from = std::max(min_key, below - width + 1);
+                root->retrieveNodesByRange(K(from), K(below), backward);
+                below = from - 1;
+                width *= 2;
+            }
+            if (forward == NULL && backward.empty())
+                break;
+
+            D forward_d2 = std::numeric_limits<D>::max();
+            D backward_d2 = std::numeric_limits<D>::max();
+            if (forward != NULL)
+            {
+                D d = D(long(forward->key) - key) * _resolution;
+                forward_d2 = base_squared + d * d;
+            }
+            if (!backward.empty())
+            {
+                D d = D(key - long(backward.back()->key)) * _resolution;
+                backward_d2 = base_squared + d * d;
+            }
+
+            bool use_forward = forward_d2 <= backward_d2;
+            D d2 = use_forward ? forward_d2 : backward_d2;
+            if (d2 > worst)
+                break;
+
+            Node *node = use_forward ? forward : backward.back();
+            if (use_forward)
+                forward = root->next(forward);
+            else
+                backward.pop_back();
+
+            idx[current_dim] = node->key;
+            if (current_dim == DIM - 1)
+            {
+                V *data = reinterpret_cast<V *>(node->value);
+                if (filter(data))
+                {
+                    heap.push(NeighbourCandidate(d2, idx, data));
+                    if (long(heap.size()) > k)
+                        heap.pop();
+                }
+            }
+            else
+            {
+                nearestDimension(reinterpret_cast<KNODE *>(node->value), center, idx,
+                                 current_dim + 1, d2, heap, k, max_squared, filter);
+            }
+        }
+    }
+
     Index _max_index_value;
     Index _min_index_value;
     KNODE *_root_list;
@@ -541,10 +1028,8 @@ class KDSkipList
     bool _self_concurrency_management;
     int DIM;
 
-    // concurrency
-    boost::mutex mutex_map_mutex;
-    boost::mutex mutex_super_lock;
-    std::map<K, boost::mutex *> mutex_map;
+    // writers, striped by first index
+    boost::mutex _stripes[STRIPES];
 };
 }
 
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef LEVELPOLICIES_HPP
+#define LEVELPOLICIES_HPP
+
+#include <boost/concept/assert.hpp>
+#include <boost/concept/usage.hpp>
+#include <skimap/SkipList.hpp>
+#include <skimap/SkipListDense.hpp>
+#include <utility>
+#include <vector>
+
+namespace skimap {
+
+/**
+     * Container policies for the X, Y and Z levels of SkipListMapV2. A
+     * policy exposes Container<K, V, DEPTH>::type, a container satisfying
+     * LevelContainer.
+     */
+
+/**
+     * Skip list level: memory proportional to the used keys, O(log n)
+     * access. The choice for sparse levels, e.g. outdoor maps. As X level
+     * its lock serializes writers of the whole map.
+     */
+struct SkipListLevel {
+  template <class K, class V, int DEPTH> struct Container {
+    typedef SkipList<K, V, DEPTH> type;
+  };
+};
+
+/**
+     * Dense level: one slot per key of the index range, O(1) access and a
+     * lock per key. The choice for bounded ranges, e.g. indoor rooms: as Y
+     * or Z level every branch allocates the whole range, so give the map a
+     * narrow [min_index, max_index].
+     */
+struct DenseLevel {
+  template <class K, class V, int DEPTH> struct Container {
+    typedef SkipListDense<K, V, DEPTH> type;
+  };
+};
+
+/**
+     * Requirements of a level container LIST with nodes exposing 'key' and
+     * 'value':
+     * - LIST(min_key, max_key)
+     * - insert, find, unlink, lowerBound, successor, predecessor, next
+     *   (NULL past the last node), first and last (on non empty lists)
+     * - retrieveNodes, retrieveNodesByRange, eraseRange, appendSorted
+     * - getSize, empty, getMinKey, getMaxKey
+     * - lock(key) and unlock(key), excluding other writers of that key
+     *   while nodes are inserted or unlinked
+     * Readers may walk the container while a writer holding the lock
+     * inserts: nodes are published complete.
+     */
+template <class LIST> struct LevelContainer {
+  typedef typename LIST::KeyType K;
+  typedef typename LIST::ValueType V;
+  typedef typename LIST::NodeType NodeType;
+
+  BOOST_CONCEPT_USAGE(LevelContainer) {
+    LIST created(key, key);
+    node = list->insert(key, value);
+    const_node = list->find(key);
+    node = list->unlink(key);
+    node = list->lowerBound(key);
+    node = list->successor(key);
+    node = list->predecessor(key);
+    node = list->next(node);
+    const_node = list->first();
+    const_node = list->last();
+    list->retrieveNodes(nodes);
+    list->retrieveNodes(nodes, node, key);
+    list->retrieveNodesByRange(key, key, nodes);
+    size = list->eraseRange(key, key, &values, &nodes);
+    list->appendSorted(pairs);
+    size = list->getSize();
+    flag = list->empty();
+    key = list->getMinKey();
+    key = list->getMaxKey();
+    list->lock(key);
+    list->unlock(key);
+    key = node->key;
+    value = node->value;
+  }
+
+private:
+  LIST *list;
+  K key;
+  V value;
+  NodeType *node;
+  const NodeType *const_node;
+  std::vector<NodeType *> nodes;
+  std::vector<V> values;
+  std::vector<std::pair<K, V> > pairs;
+  long size;
+  bool flag;
+};
+}
+
+#endif /* LEVELPOLICIES_HPP */
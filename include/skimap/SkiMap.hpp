@@ -10,10 +10,12 @@
 #ifndef SKIMAP_HPP
 #define SKIMAP_HPP
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <skimap/SkipListMapV2.hpp>
+#include <skimap/utils/OccupancyRaster.hpp>
 #include <skimap/voxels/GenericTile2D.hpp>
 #include <vector>
 
@@ -27,14 +29,38 @@ namespace skimap {
      * @param max_index
      */
 template <class V, class K, class D, int X_DEPTH = 8, int Y_DEPTH = 8,
-          int Z_DEPTH = 8>
-class SkiMap : public SkipListMapV2<V, K, D, X_DEPTH, Y_DEPTH, Z_DEPTH> {
+          int Z_DEPTH = 8, class X_LEVEL = DenseLevel,
+          class Y_LEVEL = SkipListLevel, class Z_LEVEL = SkipListLevel>
+class SkiMap : public SkipListMapV2<V, K, D, X_DEPTH, Y_DEPTH, Z_DEPTH,
+                                   X_LEVEL, Y_LEVEL, Z_LEVEL> {
 public:
   typedef GenericTile2D<V, D> Tiles2D;
-  typedef SkipListMapV2<V, K, D, X_DEPTH, Y_DEPTH, Z_DEPTH> ParentMap;
+  typedef SkipListMapV2<V, K, D, X_DEPTH, Y_DEPTH, Z_DEPTH, X_LEVEL, Y_LEVEL,
+                        Z_LEVEL>
+      ParentMap;
   typedef typename ParentMap::X_NODE X_NODE;
   typedef typename ParentMap::Y_NODE Y_NODE;
   typedef typename ParentMap::Z_NODE Z_NODE;
+  typedef OccupancyRaster<K> Raster;
+
+  /**
+       * Summary of a (X,Y) column, kept up to date during integration.
+       */
+  struct ColumnRecord {
+    K ix, iy;
+    // Occupied Z range, empty while min_z > max_z
+    K min_z, max_z;
+    // Lowest occupied Z at or above the zero level, if ground != NULL. The
+    // node is kept rather than its value, which snapshot reads may swap
+    K ground_z;
+    const typename Z_NODE::NodeType *ground;
+    Z_NODE *branch;
+
+    ColumnRecord(K ix, K iy, Z_NODE *branch)
+        : ix(ix), iy(iy), min_z(std::numeric_limits<K>::max()),
+          max_z(std::numeric_limits<K>::min()), ground_z(0), ground(NULL),
+          branch(branch) {}
+  };
 
   /**
        *
@@ -47,24 +73,319 @@ public:
   SkiMap(K min_index, K max_index, D resolution_x, D resolution_y,
          D resolution_z, D zero_level = D(0.0))
       : ParentMap(min_index, max_index, resolution_x, resolution_y,
-                  resolution_z) {
+                  resolution_z),
+        _frozen(false) {
     setZeroLevel(zero_level);
   }
 
   /**
        */
-  SkiMap(D resolution, D zero_level = D(0.0)) : ParentMap(resolution) {
+  SkiMap(D resolution, D zero_level = D(0.0))
+      : ParentMap(resolution), _frozen(false) {
     setZeroLevel(D(zero_level));
   }
 
   /**
        */
-  SkiMap() : ParentMap() { setZeroLevel(D(0.0)); }
+  SkiMap() : ParentMap(), _frozen(false) { setZeroLevel(D(0.0)); }
 
   /**
        *
        */
-  virtual ~SkiMap() {}
+  virtual ~SkiMap() { setLevelsOfDetail(0); }
+
+  /**
+       * Enables the levels of detail pyramid. Level l (1..levels) is a map
+       * whose voxels are 2^l times larger than the ones of this map; it is
+       * fed incrementally by integrateVoxel, so each coarse voxel aggregates
+       * (V operator+) every measurement falling inside it. Level 0 is the map
+       * itself. Previous levels are dropped and the new ones are built from
+       * the current content. Old levels are deleted at once, so no snapshot
+       * reader must be active; snapshots of the map keep their own frozen
+       * levels (see snapshot).
+       * @param levels number of coarse levels, 0 disables the pyramid
+       */
+  void setLevelsOfDetail(int levels) {
+    _levels.clear();
+
+    for (int l = 1; l <= levels; l++) {
+      D scale = D(1 << l);
+      ParentMap *level = new ParentMap(
+          this->_min_index_value, this->_max_index_value,
+          this->_resolution_x * scale, this->_resolution_y * scale,
+          this->_resolution_z * scale);
+      level->enableConcurrencyAccess(this->hasConcurrencyAccess());
+      level->enableSnapshotReads(this->hasSnapshotReads());
+      level->shareEpochManager(this->sharedEpochManager());
+      level->setDeintegrationFilter(this->_deintegration_filter);
+      _levels.push_back(boost::shared_ptr<ParentMap>(level));
+    }
+
+    if (levels > 0) {
+      std::vector<typename ParentMap::Voxel3D> voxels;
+      ParentMap::fetchVoxels(voxels);
+      for (int i = 0; i < voxels.size(); i++) {
+        K ix, iy, iz;
+        this->coordinatesToIndex(voxels[i].x, voxels[i].y, voxels[i].z, ix,
+                                 iy, iz);
+        _integrateLevels(ix, iy, iz, voxels[i].data);
+      }
+    }
+  }
+
+  /**
+       * Copy-on-write snapshot of the map as of now, see
+       * ParentMap::snapshot. Levels of detail are snapshotted too and the
+       * column cache is copied, so tiles, rasterization and column queries
+       * work on the snapshot while integration continues. The live map keeps
+       * using the column slots, the snapshot looks its columns up by index.
+       * Must not run concurrently with writers of the map.
+       * @return read-only view of the current map
+       */
+  boost::shared_ptr<SkiMap> snapshot() {
+    boost::shared_ptr<SkiMap> frozen(new SkiMap());
+    this->_snapshotInto(*frozen);
+    frozen->_zero_level = _zero_level;
+    frozen->_zero_level_key = _zero_level_key;
+    for (int i = 0; i < _levels.size(); i++) {
+      frozen->_levels.push_back(_levels[i]->snapshot());
+    }
+    {
+      boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
+      frozen->_columns = _columns;
+    }
+    std::sort(frozen->_columns.begin(), frozen->_columns.end(),
+              _columnLess);
+    frozen->_frozen = true;
+    return frozen;
+  }
+
+  /**
+       * @return number of coarse levels
+       */
+  int levelsOfDetail() { return _levels.size(); }
+
+  /**
+       * Map of a level of detail.
+       * @param level 0 for this map, 1..levelsOfDetail() for coarse ones
+       * @return level map, NULL if level does not exist
+       */
+  ParentMap *getLevel(int level) {
+    if (level == 0)
+      return this;
+    if (level < 0 || level > _levels.size())
+      return NULL;
+    return _levels[level - 1].get();
+  }
+
+  using ParentMap::integrateVoxel;
+
+  /**
+       * Integrates a voxel in the map and in every level of detail.
+       * @param ix
+       * @param iy
+       * @param iz
+       * @param data
+       * @return
+       */
+  virtual bool integrateVoxel(K ix, K iy, K iz, V *data) {
+    if (!ParentMap::integrateVoxel(ix, iy, iz, data))
+      return false;
+    _integrateLevels(ix, iy, iz, data);
+    return true;
+  }
+
+  using ParentMap::deintegrateVoxels;
+
+  /**
+       * Deintegrates a batch of voxels from the map and from every level of
+       * detail, see ParentMap::deintegrateVoxels.
+       * @param voxels voxels to deintegrate
+       * @return number of erased voxels of this map
+       */
+  virtual long deintegrateVoxels(
+      const std::vector<typename ParentMap::IndexedVoxel> &voxels) {
+    long removed = ParentMap::deintegrateVoxels(voxels);
+    std::vector<typename ParentMap::IndexedVoxel> coarse(voxels.size());
+    for (int l = 1; l <= _levels.size(); l++) {
+      for (long i = 0; i < long(voxels.size()); i++) {
+        coarse[i] = typename ParentMap::IndexedVoxel(
+            _coarseIndex(voxels[i].ix, l), _coarseIndex(voxels[i].iy, l),
+            _coarseIndex(voxels[i].iz, l), voxels[i].data);
+      }
+      _levels[l - 1]->deintegrateVoxels(coarse);
+    }
+    return removed;
+  }
+
+  virtual void
+  setDeintegrationFilter(const std::function<bool(const V *)> &keep) {
+    ParentMap::setDeintegrationFilter(keep);
+    for (int i = 0; i < _levels.size(); i++) {
+      _levels[i]->setDeintegrationFilter(keep);
+    }
+  }
+
+  /**
+       * Removes every voxel inside an index box, from the map and from the
+       * levels of detail. Coarse voxels straddling the box border are
+       * rebuilt from the full resolution voxels left around it.
+       * @param box index box, bounds included
+       * @return number of removed voxels
+       */
+  virtual long eraseRegion(const typename ParentMap::IndexBox &box) {
+    long removed = ParentMap::eraseRegion(box);
+    if (removed == 0)
+      return removed;
+
+    for (int l = 1; l <= _levels.size(); l++) {
+      typename ParentMap::IndexBox coarse(
+          _coarseIndex(box.min_x, l), _coarseIndex(box.max_x, l),
+          _coarseIndex(box.min_y, l), _coarseIndex(box.max_y, l),
+          _coarseIndex(box.min_z, l), _coarseIndex(box.max_z, l));
+      _levels[l - 1]->eraseRegion(coarse);
+
+      long factor = 1L << l;
+      typename ParentMap::IndexBox fine(
+          _fineIndex(coarse.min_x * factor), _fineIndex((coarse.max_x + 1) * factor - 1),
+          _fineIndex(coarse.min_y * factor), _fineIndex((coarse.max_y + 1) * factor - 1),
+          _fineIndex(coarse.min_z * factor), _fineIndex((coarse.max_z + 1) * factor - 1));
+      std::vector<typename ParentMap::IndexedVoxel> voxels;
+      this->boxSearch(fine, voxels);
+      for (int i = 0; i < voxels.size(); i++) {
+        _levels[l - 1]->integrateVoxel(_coarseIndex(voxels[i].ix, l),
+                                       _coarseIndex(voxels[i].iy, l),
+                                       _coarseIndex(voxels[i].iz, l),
+                                       voxels[i].data);
+      }
+    }
+    return removed;
+  }
+
+  /**
+       * Merges another map into this one (see ParentMap::merge). Summing
+       * fusion commutes with the level aggregation, so levels of detail are
+       * merged pairwise when the other map has them; any other policy, or
+       * missing levels, rebuilds them from the merged voxels.
+       * @param other map to merge, left untouched
+       * @param fusion voxel fusion policy
+       * @return FALSE if the resolutions differ
+       */
+  template <class FUSION> bool merge(SkiMap &other, FUSION fusion) {
+    if (!ParentMap::merge(other, fusion))
+      return false;
+    setLevelsOfDetail(levelsOfDetail());
+    return true;
+  }
+
+  bool merge(SkiMap &other, SumFusion<V> fusion) {
+    if (!ParentMap::merge(other, fusion))
+      return false;
+    if (other.levelsOfDetail() < levelsOfDetail()) {
+      setLevelsOfDetail(levelsOfDetail());
+      return true;
+    }
+    for (int l = 0; l < _levels.size(); l++) {
+      _levels[l]->merge(*other._levels[l], fusion);
+    }
+    return true;
+  }
+
+  bool merge(SkiMap &other) { return merge(other, SumFusion<V>()); }
+
+  virtual void enableConcurrencyAccess(bool status = true) {
+    ParentMap::enableConcurrencyAccess(status);
+    for (int i = 0; i < _levels.size(); i++) {
+      _levels[i]->enableConcurrencyAccess(status);
+    }
+  }
+
+  /**
+       * Enables snapshot reads on the map and its levels of detail, which
+       * share its epoch manager: one ReadGuard covers them all.
+       * @param status
+       */
+  virtual void enableSnapshotReads(bool status = true) {
+    ParentMap::enableSnapshotReads(status);
+    for (int i = 0; i < _levels.size(); i++) {
+      _levels[i]->enableSnapshotReads(status);
+    }
+  }
+
+  /**
+       * Fetches voxels of a level of detail. Coordinates are the centers of
+       * the level voxels.
+       * @param voxels OUTPUT voxels
+       * @param level 0 for full resolution, 1..levelsOfDetail() for coarse
+       * ones; out of range levels are clamped
+       * @return fetched level
+       */
+  int fetchVoxelsAtLevel(std::vector<typename ParentMap::Voxel3D> &voxels,
+                         int level) {
+    level = std::max(0, std::min(level, levelsOfDetail()));
+    if (level == 0) {
+      this->fetchVoxels(voxels);
+    } else {
+      _levels[level - 1]->fetchVoxels(voxels);
+    }
+    return level;
+  }
+
+  /**
+       * Fetches the finest level of detail having at most max_voxels voxels,
+       * the coarsest one if none fits the budget.
+       * @param voxels OUTPUT voxels
+       * @param max_voxels voxel budget
+       * @return fetched level
+       */
+  int fetchVoxelsWithBudget(std::vector<typename ParentMap::Voxel3D> &voxels,
+                            long max_voxels) {
+    int level = 0;
+    while (level < levelsOfDetail() &&
+           getLevel(level)->voxelsCount() > max_voxels) {
+      level++;
+    }
+    return fetchVoxelsAtLevel(voxels, level);
+  }
+
+  /**
+       * Fetches the voxels of a level of detail matching a predicate, see
+       * SkipListMapV2::fetchVoxels.
+       * @param voxels OUTPUT voxels
+       * @param level level of detail, clamped
+       * @param predicate functor bool(const V *)
+       * @return fetched level
+       */
+  template <class PREDICATE>
+  int fetchVoxelsAtLevel(std::vector<typename ParentMap::Voxel3D> &voxels,
+                         int level, PREDICATE predicate) {
+    level = std::max(0, std::min(level, levelsOfDetail()));
+    getLevel(level)->fetchVoxels(voxels, predicate);
+    return level;
+  }
+
+  /**
+       * Fetches the finest level of detail having at most max_voxels voxels
+       * matching a predicate, the coarsest one if none fits the budget.
+       * Rejected voxels do not count against the budget. Levels with at most
+       * max_voxels voxels fit without counting, the others are counted up
+       * to the budget (see countVoxels); only the chosen level is fetched.
+       * @param voxels OUTPUT voxels
+       * @param max_voxels voxel budget
+       * @param predicate functor bool(const V *)
+       * @return fetched level
+       */
+  template <class PREDICATE>
+  int fetchVoxelsWithBudget(std::vector<typename ParentMap::Voxel3D> &voxels,
+                            long max_voxels, PREDICATE predicate) {
+    int level = 0;
+    while (level < levelsOfDetail() &&
+           getLevel(level)->voxelsCount() > max_voxels &&
+           getLevel(level)->countVoxels(predicate, max_voxels) > max_voxels) {
+      level++;
+    }
+    return fetchVoxelsAtLevel(voxels, level, predicate);
+  }
 
   /**
        *
@@ -96,20 +417,11 @@ public:
         this->_current_integration_map.addEntry(ix, iy, iz, NULL, 2);
         printf("Batched\n");
       } else {
-        const typename X_NODE::NodeType *ylist = this->_root_list->find(ix);
-        if (ylist == NULL) {
-          ylist = this->_root_list->insert(
-              ix, new Y_NODE(this->_min_index_value, this->_max_index_value));
-          this->_bytes_counter +=
-              sizeof(typename X_NODE::NodeType) + sizeof(Y_NODE);
-        }
-        const typename Y_NODE::NodeType *zlist = ylist->value->find(iy);
-        if (zlist == NULL) {
-          zlist = ylist->value->insert(
-              iy, new Z_NODE(this->_min_index_value, this->_max_index_value));
-          this->_bytes_counter +=
-              sizeof(typename Y_NODE::NodeType) + sizeof(Z_NODE);
-        }
+        this->_ownRoot();
+        Y_NODE *ylist;
+        Z_NODE *zlist = this->_writableColumn(ix, iy, ylist);
+        this->_touchColumn(ylist, zlist);
+        _columnSlot(ix, iy, zlist);
       }
       return true;
     }
@@ -117,57 +429,135 @@ public:
   }
 
   /**
-       *
-       * @param voxels
+       * Fetches 2D tiles with a flat parallel scan of the column cache: no
+       * list is walked. Capacity of 'voxels' is reused across calls.
+       * @param voxels OUTPUT tiles
+       * @param min_voxel_height
        */
   virtual void fetchTiles(std::vector<Tiles2D> &voxels, D min_voxel_height) {
+    // new columns and record updates wait for the scan
+    boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
+    voxels.resize(_columns.size());
+
+#pragma omp parallel for
+    for (long i = 0; i < long(_columns.size()); i++) {
+      voxels[i] = _columnTile(_columns[i], min_voxel_height);
+    }
+  }
+
+  using ParentMap::fetchChangedSince;
+
+  /**
+       * Fetches the tiles of the (X,Y) columns modified after target version
+       * (see ParentMap::fetchChangedSince). A dirty column always produces
+       * its tile, with NULL data if it has no voxel below min_voxel_height.
+       * @param version last version seen by the consumer
+       * @param voxels OUTPUT tiles of the dirty columns
+       * @param min_voxel_height
+       */
+  virtual void fetchChangedSince(typename ParentMap::Version version,
+                                 std::vector<Tiles2D> &voxels,
+                                 D min_voxel_height) {
+    boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
     voxels.clear();
-    std::vector<typename X_NODE::NodeType *> xnodes;
-    this->_root_list->retrieveNodes(xnodes);
+    for (long i = 0; i < long(_columns.size()); i++) {
+      if (_columns[i].branch->version > version)
+        voxels.push_back(_columnTile(_columns[i], min_voxel_height));
+    }
+  }
 
-#pragma omp parallel
-    {
-      std::vector<Tiles2D> voxels_private;
+  /**
+       * Rasterizes the 2D grid into an occupancy raster straight from the
+       * column cache, without building a tile list. Columns whose tile
+       * (see fetchTiles) holds a voxel accepted by 'occupied' are OCCUPIED,
+       * the other columns FREE and missing ones UNKNOWN. The window grows to
+       * the map bounds if raster.auto_grow is set.
+       * @param raster INPUT/OUTPUT raster, fully rewritten
+       * @param min_voxel_height
+       * @param occupied functor bool(const V *)
+       */
+  template <class F>
+  void rasterizeTiles(Raster &raster, D min_voxel_height, F occupied) {
+    _rasterizeColumns(raster, min_voxel_height, occupied, 0, true);
+  }
 
-#pragma omp for nowait
-      for (int i = 0; i < xnodes.size(); i++) {
-        K ix, iy, iz;
-        D x, y, z;
-        std::vector<typename Y_NODE::NodeType *> ynodes;
-        xnodes[i]->value->retrieveNodes(ynodes);
-
-        for (int j = 0; j < ynodes.size(); j++) {
-          std::vector<typename Z_NODE::NodeType *> znodes;
-
-          ix = xnodes[i]->key;
-          iy = ynodes[j]->key;
-          iz = _zero_level_key;
-          this->indexToCoordinates(ix, iy, iz, x, y, z);
-
-          if (ynodes[j]->value->empty()) {
-            voxels_private.push_back(Tiles2D(x, y, z, NULL));
-          } else {
-            typename Z_NODE::NodeType *first_voxel =
-                ynodes[j]->value->findNearest(_zero_level_key);
-            if (first_voxel == NULL) {
-              voxels_private.push_back(Tiles2D(x, y, z, NULL));
-            } else {
-              D vh;
-              this->singleIndexToCoordinate(first_voxel->key, vh,
-                                            this->_resolution_z);
-              if (vh > min_voxel_height) {
-                voxels_private.push_back(Tiles2D(x, y, z, NULL));
-              } else {
-                voxels_private.push_back(Tiles2D(x, y, z, first_voxel->value));
-              }
-            }
-          }
-        }
-      }
+  /**
+       * Partial rasterization: rewrites only the cells of the columns
+       * modified after target version. Cells of other columns are left
+       * untouched, raster dirty fields bound the rewritten area.
+       * @param version last version rasterized
+       * @param raster INPUT/OUTPUT raster
+       * @param min_voxel_height
+       * @param occupied functor bool(const V *)
+       */
+  template <class F>
+  void rasterizeChangedSince(typename ParentMap::Version version,
+                             Raster &raster, D min_voxel_height, F occupied) {
+    _rasterizeColumns(raster, min_voxel_height, occupied, version, false);
+  }
 
-#pragma omp critical
-      voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
+  /**
+       * Cached summary of a (X,Y) column.
+       * @param x
+       * @param y
+       * @return column record, NULL if the column does not exist
+       */
+  const ColumnRecord *findColumn(D x, D y) {
+    K ix, iy, iz;
+    if (!this->coordinatesToIndex(x, y, _zero_level, ix, iy, iz))
+      return NULL;
+    if (_frozen) {
+      typename std::vector<ColumnRecord>::const_iterator column =
+          std::lower_bound(_columns.begin(), _columns.end(),
+                           ColumnRecord(ix, iy, NULL), _columnLess);
+      return column != _columns.end() && column->ix == ix && column->iy == iy
+                 ? &(*column)
+                 : NULL;
     }
+    const typename X_NODE::NodeType *ylist = this->_root_list->find(ix);
+    if (ylist == NULL)
+      return NULL;
+    const typename Y_NODE::NodeType *zlist = ylist->value->find(iy);
+    if (zlist == NULL || zlist->value->slot < 0)
+      return NULL;
+    return &_columns[zlist->value->slot];
+  }
+
+  /**
+       * Height of the lowest occupied voxel at or above the zero level.
+       * @param x
+       * @param y
+       * @param height OUTPUT voxel height
+       * @return FALSE if the column has no such voxel
+       */
+  bool groundHeight(D x, D y, D &height) {
+    boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
+    const ColumnRecord *column = findColumn(x, y);
+    if (column == NULL || column->ground == NULL)
+      return false;
+    this->singleIndexToCoordinate(column->ground_z, height,
+                                  this->_resolution_z);
+    return true;
+  }
+
+  /**
+       * Heights of the lowest and highest occupied voxels of a column.
+       * @param x
+       * @param y
+       * @param min_height OUTPUT lowest voxel height
+       * @param max_height OUTPUT highest voxel height
+       * @return FALSE if the column has no voxel
+       */
+  bool heightRange(D x, D y, D &min_height, D &max_height) {
+    boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
+    const ColumnRecord *column = findColumn(x, y);
+    if (column == NULL || column->min_z > column->max_z)
+      return false;
+    this->singleIndexToCoordinate(column->min_z, min_height,
+                                  this->_resolution_z);
+    this->singleIndexToCoordinate(column->max_z, max_height,
+                                  this->_resolution_z);
+    return true;
   }
 
   /**
@@ -177,11 +567,246 @@ public:
   void setZeroLevel(D zero_level) {
     _zero_level = zero_level;
     _zero_level_key = K(floor(_zero_level / this->_resolution_z));
+
+    for (long i = 0; i < long(_columns.size()); i++) {
+      typename Z_NODE::NodeType *ground =
+          _columns[i].branch->lowerBound(_zero_level_key);
+      _columns[i].ground = ground;
+      _columns[i].ground_z = ground != NULL ? ground->key : K(0);
+    }
   }
 
 protected:
+  static bool _columnLess(const ColumnRecord &a, const ColumnRecord &b) {
+    return a.ix < b.ix || (a.ix == b.ix && a.iy < b.iy);
+  }
+
+  /**
+       * Builds the tile of a column: its ground voxel, if it is below
+       * min_voxel_height.
+       * @param column column record
+       * @param min_voxel_height
+       * @return column tile
+       */
+  Tiles2D _columnTile(const ColumnRecord &column, D min_voxel_height) {
+    D x, y, z;
+    this->indexToCoordinates(column.ix, column.iy, _zero_level_key, x, y, z);
+
+    if (column.ground == NULL) {
+      return Tiles2D(x, y, z, NULL);
+    }
+    D vh;
+    this->singleIndexToCoordinate(column.ground_z, vh, this->_resolution_z);
+    if (vh > min_voxel_height) {
+      return Tiles2D(x, y, z, NULL);
+    }
+    return Tiles2D(x, y, z, column.ground->value);
+  }
+
+  /**
+       * Writes the raster cells of the columns modified after target version.
+       * @param full TRUE to reset the whole raster first
+       */
+  template <class F>
+  void _rasterizeColumns(Raster &raster, D min_voxel_height, F &occupied,
+                         typename ParentMap::Version version, bool full) {
+    boost::shared_lock<boost::shared_mutex> lock(_columns_mutex);
+    // columns removed since version become UNKNOWN again, if removals
+    // since version were pruned the raster is rebuilt
+    std::vector<typename ParentMap::ErasedColumn> erased;
+    if (!full && !this->fetchErasedSince(version, erased)) {
+      full = true;
+      version = 0;
+    }
+
+    std::vector<long> slots;
+    K min_x = std::numeric_limits<K>::max();
+    K max_x = std::numeric_limits<K>::min();
+    K min_y = min_x, max_y = max_x;
+    for (long i = 0; i < long(_columns.size()); i++) {
+      if (_columns[i].branch->version <= version)
+        continue;
+      slots.push_back(i);
+      min_x = std::min(min_x, _columns[i].ix);
+      max_x = std::max(max_x, _columns[i].ix);
+      min_y = std::min(min_y, _columns[i].iy);
+      max_y = std::max(max_y, _columns[i].iy);
+    }
+
+    raster.resized = false;
+    raster.clearDirty();
+    raster.include(min_x, max_x, min_y, max_y);
+
+    if (full) {
+      std::fill(raster.data.begin(), raster.data.end(), Raster::UNKNOWN);
+    }
+    for (int i = 0; i < erased.size(); i++) {
+      long cell = raster.cellIndex(erased[i].ix, erased[i].iy);
+      if (cell < 0)
+        continue;
+      raster.data[cell] = Raster::UNKNOWN;
+      min_x = std::min(min_x, erased[i].ix);
+      max_x = std::max(max_x, erased[i].ix);
+      min_y = std::min(min_y, erased[i].iy);
+      max_y = std::max(max_y, erased[i].iy);
+    }
+    if (full || raster.resized) {
+      raster.markDirty(0, raster.width - 1, 0, raster.height - 1);
+    } else if (min_x <= max_x) {
+      raster.markDirty(
+          std::max(0L, long(min_x) - raster.min_x),
+          std::min(long(raster.width) - 1, long(max_x) - raster.min_x),
+          std::max(0L, long(min_y) - raster.min_y),
+          std::min(long(raster.height) - 1, long(max_y) - raster.min_y));
+    }
+
+#pragma omp parallel for
+    for (long i = 0; i < long(slots.size()); i++) {
+      const ColumnRecord &column = _columns[slots[i]];
+      long cell = raster.cellIndex(column.ix, column.iy);
+      if (cell < 0)
+        continue;
+      Tiles2D tile = _columnTile(column, min_voxel_height);
+      raster.data[cell] = tile.data != NULL && occupied(tile.data)
+                              ? Raster::OCCUPIED
+                              : Raster::FREE;
+    }
+  }
+
+  /**
+       * Slot of a column in the column cache, created if missing. Creation
+       * is exclusive with respect to concurrent record updates.
+       * @return slot index
+       */
+  long _columnSlot(K ix, K iy, Z_NODE *zlist) {
+    if (zlist->slot < 0) {
+      boost::unique_lock<boost::shared_mutex> lock(_columns_mutex);
+      zlist->slot = _columns.size();
+      _columns.push_back(ColumnRecord(ix, iy, zlist));
+    }
+    return zlist->slot;
+  }
+
+  /**
+       * Keeps the column cache up to date on integration. Records are read
+       * by concurrent scans, so they change under the exclusive lock; the
+       * slot is read under it too, since erasing another column may move
+       * this record.
+       */
+  virtual void _voxelIntegrated(K ix, K iy, Z_NODE *zlist, K iz,
+                                bool inserted) {
+    _columnSlot(ix, iy, zlist);
+    if (!inserted)
+      return;
+
+    boost::unique_lock<boost::shared_mutex> lock(_columns_mutex);
+    ColumnRecord &column = _columns[zlist->slot];
+    column.min_z = std::min(column.min_z, iz);
+    column.max_z = std::max(column.max_z, iz);
+    if (iz >= _zero_level_key &&
+        (column.ground == NULL || iz < column.ground_z)) {
+      column.ground_z = iz;
+      column.ground = zlist->find(iz);
+    }
+  }
+
+  /**
+       * Drops the record of an erased column, the last record takes its slot.
+       */
+  virtual void _columnErased(K ix, K iy, Z_NODE *zlist) {
+    if (zlist->slot < 0)
+      return;
+    boost::unique_lock<boost::shared_mutex> lock(_columns_mutex);
+    long slot = zlist->slot;
+    if (slot != long(_columns.size()) - 1) {
+      _columns[slot] = _columns.back();
+      _columns[slot].branch->slot = slot;
+    }
+    _columns.pop_back();
+    zlist->slot = -1;
+  }
+
+  /**
+       * Moves the record of a column to its private clone, see
+       * ParentMap::snapshot.
+       */
+  virtual void _columnCloned(K ix, K iy, Z_NODE *shared, Z_NODE *clone) {
+    boost::unique_lock<boost::shared_mutex> lock(_columns_mutex);
+    if (shared->slot < 0 || shared->slot >= long(_columns.size()) ||
+        _columns[shared->slot].branch != shared)
+      return;
+    ColumnRecord &column = _columns[shared->slot];
+    column.branch = clone;
+    if (column.ground != NULL)
+      column.ground = clone->find(column.ground_z);
+    clone->slot = shared->slot;
+    shared->slot = -1;
+  }
+
+  /**
+       * Recomputes the record of a column which lost voxels. The record is
+       * rebuilt aside and replaced at once, readers never see it partial.
+       */
+  virtual void _columnTrimmed(K ix, K iy, Z_NODE *zlist) {
+    ColumnRecord column(ix, iy, zlist);
+    if (!zlist->empty()) {
+      column.min_z = zlist->first()->key;
+      column.max_z = zlist->last()->key;
+      typename Z_NODE::NodeType *ground = zlist->lowerBound(_zero_level_key);
+      if (ground != NULL) {
+        column.ground_z = ground->key;
+        column.ground = ground;
+      }
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(_columns_mutex);
+    if (zlist->slot >= 0)
+      _columns[zlist->slot] = column;
+  }
+
+  /**
+       * Registers a column created or extended by merge.
+       */
+  virtual void _columnMerged(K ix, K iy, Z_NODE *zlist) {
+    _columnSlot(ix, iy, zlist);
+    _columnTrimmed(ix, iy, zlist);
+  }
+
+  /**
+       * Integrates a voxel of this map in the coarse levels.
+       */
+  void _integrateLevels(K ix, K iy, K iz, V *data) {
+    for (int l = 1; l <= _levels.size(); l++) {
+      _levels[l - 1]->integrateVoxel(_coarseIndex(ix, l), _coarseIndex(iy, l),
+                                     _coarseIndex(iz, l), data);
+    }
+  }
+
+  /**
+       * Index of the level voxel containing a full resolution index, i.e.
+       * floor(index / 2^level).
+       */
+  static K _coarseIndex(K index, int level) {
+    long factor = 1L << level;
+    long value = index;
+    return K(value >= 0 ? value / factor : -((-value + factor - 1) / factor));
+  }
+
+  /**
+       * Full resolution index clamped to the K range.
+       */
+  static K _fineIndex(long index) {
+    return K(std::max(long(std::numeric_limits<K>::min()),
+                      std::min(long(std::numeric_limits<K>::max()), index)));
+  }
+
   D _zero_level;
   K _zero_level_key;
+  std::vector<boost::shared_ptr<ParentMap> > _levels;
+  std::vector<ColumnRecord> _columns;
+  boost::shared_mutex _columns_mutex;
+  // snapshot: columns sorted by index, their slots belong to the live map
+  bool _frozen;
 };
 }
 
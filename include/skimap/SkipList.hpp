@@ -10,8 +10,10 @@
 #define SKIPLIST_HPP
 
 #include <stdlib.h>
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <utility>
 #include <vector>
 
 namespace skimap
@@ -104,6 +106,7 @@ class SkipList
         {
             header_node_->forwards[i] = tail_node_;
         }
+        lock_.clear();
     }
 
     /**
@@ -143,6 +146,8 @@ class SkipList
         curr_node = curr_node->forwards[1];
         if (curr_node->key == search_key)
         {
+            // value is fully built before concurrent readers can see it
+            std::atomic_thread_fence(std::memory_order_release);
             curr_node->value = new_value;
         }
         else
@@ -161,6 +166,12 @@ class SkipList
             for (int lv = 1; lv <= new_level; lv++)
             {
                 curr_node->forwards[lv] = update[lv]->forwards[lv];
+            }
+            // the node is linked bottom-up only once complete, so concurrent
+            // readers always walk a valid list
+            std::atomic_thread_fence(std::memory_order_release);
+            for (int lv = 1; lv <= new_level; lv++)
+            {
                 update[lv]->forwards[lv] = curr_node;
             }
             if (getSize() <= 1)
@@ -178,13 +189,70 @@ class SkipList
         return curr_node;
     }
 
+    /**
+     * Appends KEY,VALUE pairs sorted by strictly increasing Key, all
+     * greater than the Keys already in the list. The rightmost node of each
+     * level is found once, then every pair is linked after them, so the
+     * whole run costs linear time instead of one search per pair.
+     * @param pairs sorted pairs
+     */
+    void appendSorted(const std::vector<std::pair<K, V> > &pairs)
+    {
+        if (pairs.empty())
+            return;
+        SkipListNode<K, V, MAXLEVEL> *update[MAXLEVEL + 1];
+        NodeType *curr_node = header_node_;
+        for (int level = MAXLEVEL; level >= 1; level--)
+        {
+            while (curr_node->forwards[level] != tail_node_)
+            {
+                curr_node = curr_node->forwards[level];
+            }
+            update[level] = curr_node;
+        }
+        for (int i = 0; i < pairs.size(); i++)
+        {
+            int new_level = randomLevel();
+            if (new_level > max_current_level_)
+            {
+                max_current_level_ = new_level;
+            }
+            NodeType *node = new NodeType(pairs[i].first, pairs[i].second);
+            for (int lv = 1; lv <= new_level; lv++)
+            {
+                node->forwards[lv] = tail_node_;
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            for (int lv = 1; lv <= new_level; lv++)
+            {
+                update[lv]->forwards[lv] = node;
+                update[lv] = node;
+            }
+        }
+        size_ += pairs.size();
+        last_ = pairs.back().first;
+    }
+
     /**
      * Removes node with target Key.
      * @param search_key target Key
      */
     void erase(K search_key)
     {
-        SkipListNode<K, V, MAXLEVEL> *update[MAXLEVEL];
+        delete unlink(search_key);
+    }
+
+    /**
+     * Unlinks node with target Key without freeing it. The forward pointers
+     * of the node are left untouched, so a reader standing on it can still
+     * walk to the end of the list; the caller frees it when no reader can
+     * reach it anymore.
+     * @param search_key target Key
+     * @return unlinked node, NULL if missing
+     */
+    NodeType *unlink(K search_key)
+    {
+        SkipListNode<K, V, MAXLEVEL> *update[MAXLEVEL + 1];
         NodeType *curr_node = header_node_;
         for (int level = max_current_level_; level >= 1; level--)
         {
@@ -205,14 +273,75 @@ class SkipList
                 }
                 update[lv]->forwards[lv] = curr_node->forwards[lv];
             }
-            delete curr_node;
             size_--;
             // update the max level
-            while (max_current_level_ > 1 && header_node_->forwards[max_current_level_] == NULL)
+            while (max_current_level_ > 1 && header_node_->forwards[max_current_level_] == tail_node_)
             {
                 max_current_level_--;
             }
+            return curr_node;
+        }
+        return NULL;
+    }
+
+    /**
+     * Removes all nodes with min_key <= Key <= max_key. The run of nodes is
+     * unlinked from every level at once and then freed, values are not
+     * deleted.
+     * @param min_key min Key
+     * @param max_key max Key
+     * @param removed OUTPUT optional values of the removed nodes
+     * @param unlinked OUTPUT optional, if given nodes are not freed but
+     * appended here (see unlink)
+     * @return number of removed nodes
+     */
+    int eraseRange(K min_key, K max_key, std::vector<V> *removed = NULL,
+                   std::vector<NodeType *> *unlinked = NULL)
+    {
+        SkipListNode<K, V, MAXLEVEL> *update[MAXLEVEL + 1];
+        NodeType *curr_node = header_node_;
+        for (int level = max_current_level_; level >= 1; level--)
+        {
+            while (curr_node->forwards[level]->key < min_key)
+            {
+                curr_node = curr_node->forwards[level];
+            }
+            update[level] = curr_node;
+        }
+        NodeType *first_node = curr_node->forwards[1];
+        if (first_node == tail_node_ || first_node->key > max_key)
+            return 0;
+
+        for (int lv = 1; lv <= max_current_level_; lv++)
+        {
+            NodeType *next_node = update[lv]->forwards[lv];
+            while (next_node != tail_node_ && next_node->key <= max_key)
+            {
+                next_node = next_node->forwards[lv];
+            }
+            update[lv]->forwards[lv] = next_node;
         }
+
+        int count = 0;
+        curr_node = first_node;
+        while (curr_node != tail_node_ && curr_node->key <= max_key)
+        {
+            NodeType *next_node = curr_node->forwards[1];
+            if (removed != NULL)
+                removed->push_back(curr_node->value);
+            if (unlinked != NULL)
+                unlinked->push_back(curr_node);
+            else
+                delete curr_node;
+            curr_node = next_node;
+            count++;
+        }
+        size_ -= count;
+        while (max_current_level_ > 1 && header_node_->forwards[max_current_level_] == tail_node_)
+        {
+            max_current_level_--;
+        }
+        return count;
     }
 
     /**
@@ -269,6 +398,74 @@ class SkipList
         }
     }
 
+    /**
+     * Search for the first node with Key greater or equal than target Key.
+     * @param search_key target Key
+     * @return first node with key >= search_key, NULL if there is none.
+     */
+    NodeType *lowerBound(K search_key)
+    {
+        NodeType *curr_node = header_node_;
+        for (int level = max_current_level_; level >= 1; level--)
+        {
+            while (curr_node->forwards[level]->key < search_key)
+            {
+                curr_node = curr_node->forwards[level];
+            }
+        }
+        curr_node = curr_node->forwards[1];
+        return curr_node == tail_node_ ? NULL : curr_node;
+    }
+
+    /**
+     * Search for the first node with Key strictly greater than target Key.
+     * @param search_key target Key
+     * @return first node with key > search_key, NULL if there is none.
+     */
+    NodeType *successor(K search_key)
+    {
+        NodeType *curr_node = header_node_;
+        for (int level = max_current_level_; level >= 1; level--)
+        {
+            while (curr_node->forwards[level] != tail_node_ &&
+                   curr_node->forwards[level]->key <= search_key)
+            {
+                curr_node = curr_node->forwards[level];
+            }
+        }
+        curr_node = curr_node->forwards[1];
+        return curr_node == tail_node_ ? NULL : curr_node;
+    }
+
+    /**
+     * Search for the last node with Key strictly lower than target Key.
+     * @param search_key target Key
+     * @return last node with key < search_key, NULL if there is none.
+     */
+    NodeType *predecessor(K search_key)
+    {
+        NodeType *curr_node = header_node_;
+        for (int level = max_current_level_; level >= 1; level--)
+        {
+            while (curr_node->forwards[level]->key < search_key)
+            {
+                curr_node = curr_node->forwards[level];
+            }
+        }
+        return curr_node == header_node_ ? NULL : curr_node;
+    }
+
+    /**
+     * Next node in list order.
+     * @param node current node
+     * @return next node, NULL if current node is the last one.
+     */
+    NodeType *next(const NodeType *node)
+    {
+        NodeType *next_node = node->forwards[1];
+        return next_node == tail_node_ ? NULL : next_node;
+    }
+
     /**
      * @return TRUE if list is empty.
      */
@@ -310,36 +507,29 @@ class SkipList
     /**
      * Iterates list and return an ordered Vector of Nodes. Search is bounded.
      * @param nodes OUTPUT vector of Nodes
-     * @param start start node
-     * @param end_key end target Key
+     * @param start start node, NULL for none
+     * @param end_key end target Key, included
      */
     void retrieveNodes(std::vector<NodeType *> &nodes, NodeType *start, K end_key)
     {
         nodes.clear();
         NodeType *curr_node = start;
-        while (curr_node != tail_node_)
+        while (curr_node != NULL && curr_node != tail_node_ && curr_node->key <= end_key)
         {
             nodes.push_back(curr_node);
-            if (curr_node->key >= end_key)
-                return;
             curr_node = curr_node->forwards[1];
         }
     }
 
     /**
      * Iterates list between two Keys and return an ordered Vector of Nodes
-     * @param min_key min Key
-     * @param max_key max Key
+     * @param min_key min Key, included
+     * @param max_key max Key, included
      * @param nodes OUTPUT vector of Nodes
      */
     void retrieveNodesByRange(K min_key, K max_key, std::vector<NodeType *> &nodes)
     {
-        NodeType *start = findNearest(min_key, true);
-        if (start != NULL && start->key == min_key_)
-        {
-            start = start->forwards[1];
-        }
-        retrieveNodes(nodes, start, max_key);
+        retrieveNodes(nodes, lowerBound(min_key), max_key);
     }
 
     /**
@@ -383,6 +573,44 @@ class SkipList
         return size_;
     }
 
+    /**
+     * @return min Key value given at construction.
+     */
+    K getMinKey() const
+    {
+        return min_key_;
+    }
+
+    /**
+     * @return max Key value given at construction.
+     */
+    K getMaxKey() const
+    {
+        return max_value_;
+    }
+
+    /**
+     * Locks the list for a writer of target Key. Nodes are linked in place,
+     * so unlike SkipListDense::lock the whole list is locked, not the Key.
+     * @param key target Key
+     */
+    void lock(K key)
+    {
+        while (lock_.test_and_set(std::memory_order_acquire))
+        {
+            /* busy-wait */
+        }
+    }
+
+    /**
+     * Unlocks the list (see lock).
+     * @param key target Key
+     */
+    void unlock(K key)
+    {
+        lock_.clear(std::memory_order_release);
+    }
+
     const int max_level;
 
   protected:
@@ -421,6 +649,7 @@ class SkipList
     int size_;
     SkipListNode<K, V, MAXLEVEL> *header_node_;
     SkipListNode<K, V, MAXLEVEL> *tail_node_;
+    std::atomic_flag lock_;
 };
 }
 
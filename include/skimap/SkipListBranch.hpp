@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef SKIPLISTBRANCH_HPP
+#define SKIPLISTBRANCH_HPP
+
+#include <boost/atomic.hpp>
+#include <skimap/SkipList.hpp>
+
+namespace skimap
+{
+
+/**
+ * SkipListBranch is a level container used as inner branch of a map (Y and
+ * Z levels), a SkipList unless another one is given (see LevelPolicies).
+ * Besides the nodes it carries the map version of its last modification,
+ * so changed columns can be found without visiting the untouched ones.
+ * Branches may be shared between a map and its copy-on-write snapshots,
+ * 'references' counts the parents pointing to it.
+ * K template represents datatype for Keys.
+ * V template represents datatype for Values.
+ * MAXLEVEL template represent max depth of the SkipList.
+ * LIST template represents the level container.
+ */
+template <class K, class V, int MAXLEVEL = 16,
+          class LIST = SkipList<K, V, MAXLEVEL> >
+class SkipListBranch : public LIST
+{
+  public:
+    /**
+     * Constructor with MIN/MAX values for keys.
+     * @param min_key min Key value.
+     * @param max_key max Key value.
+     */
+    SkipListBranch(K min_key, K max_key) : LIST(min_key, max_key), version(0), slot(-1), references(1)
+    {
+    }
+
+    /**
+     * Marks the branch as modified in target version. Versions only grow.
+     * @param new_version map version of the modification
+     */
+    void touch(unsigned long new_version)
+    {
+        if (new_version > version)
+            version = new_version;
+    }
+
+    /**
+     * Map version of the last modification.
+     */
+    unsigned long version;
+
+    /**
+     * Index of the branch in per-branch tables kept by the owner map, -1 if
+     * it has none.
+     */
+    long slot;
+
+    /**
+     * Number of parent lists pointing to the branch. A branch referenced
+     * more than once is frozen and must be cloned before being modified.
+     */
+    boost::atomic<int> references;
+};
+}
+
+#endif /* SKIPLISTBRANCH_HPP */
@@ -9,9 +9,11 @@
 #ifndef SKIPLISTDENSE_HPP
 #define SKIPLISTDENSE_HPP
 
+#include <algorithm>
 #include <stdlib.h>
 #include <iostream>
 #include <sstream>
+#include <utility>
 #include <vector>
 #include <boost/thread.hpp>
 #include <boost/atomic.hpp>
@@ -115,11 +117,8 @@ class SkipListDense
         this->key_sizes = long(max_key) - long(min_key);
         //printf("Create Dense List: %d,%d =  %ld\n", min_key, max_key, this->key_sizes);
         this->_dense_nodes = new NodeType *[this->key_sizes];
-        if (prepare_locks)
-        {
-            this->_mutex_array = new Lock[this->key_sizes];
-        }
-        this->empty();
+        this->_mutex_array = prepare_locks ? new Lock[this->key_sizes] : NULL;
+        this->_clearNodes();
         // header_node_ = new NodeType(min_key_);
         // tail_node_ = new NodeType(max_value_);
         // for (int i = 1; i <= MAXLEVEL; i++)
@@ -137,6 +136,8 @@ class SkipListDense
         {
             delete this->_dense_nodes[i];
         }
+        delete[] this->_dense_nodes;
+        delete[] this->_mutex_array;
 
         // NodeType *curr_node = header_node_->forwards[1];
         // while (curr_node != tail_node_)
@@ -190,28 +191,95 @@ class SkipListDense
 
         if (_dense_nodes[inner_key] == NULL)
         {
-            _dense_nodes[inner_key] = new NodeType(search_key, new_value);
+            NodeType *node = new NodeType(search_key, new_value);
+            // published only once complete, for concurrent readers
+            boost::atomic_thread_fence(boost::memory_order_release);
+            _dense_nodes[inner_key] = node;
+            size_++;
         }
         else
         {
+            boost::atomic_thread_fence(boost::memory_order_release);
             _dense_nodes[inner_key]->value = new_value;
         }
         return _dense_nodes[inner_key];
     }
 
+    /**
+     * Inserts KEY,VALUE pairs sorted by strictly increasing Key, all
+     * greater than the Keys already in the list (see
+     * SkipList::appendSorted). Every insertion is already O(1) here.
+     * @param pairs sorted pairs
+     */
+    void appendSorted(const std::vector<std::pair<K, V> > &pairs)
+    {
+        for (long i = 0; i < long(pairs.size()); i++)
+        {
+            insert(pairs[i].first, pairs[i].second);
+        }
+    }
+
     /**
      * Removes node with target Key.
      * @param search_key target Key
      */
     void erase(K search_key)
+    {
+        delete unlink(search_key);
+    }
+
+    /**
+     * Removes node with target Key without freeing it, the caller frees it
+     * when no reader can reach it anymore.
+     * @param search_key target Key
+     * @return unlinked node, NULL if missing
+     */
+    NodeType *unlink(K search_key)
     {
         long inner_key = _convertKey(search_key);
         if (!checkInnerKey(inner_key))
-            return;
-        if (_dense_nodes[inner_key] != NULL)
+            return NULL;
+        NodeType *node = _dense_nodes[inner_key];
+        if (node != NULL)
+        {
+            _dense_nodes[inner_key] = NULL;
+            size_--;
+        }
+        return node;
+    }
+
+    /**
+     * Removes all nodes with min_key <= Key <= max_key, values are not
+     * deleted.
+     * @param min_key min Key
+     * @param max_key max Key
+     * @param removed OUTPUT optional values of the removed nodes
+     * @param unlinked OUTPUT optional, if given nodes are not freed but
+     * appended here (see unlink)
+     * @return number of removed nodes
+     */
+    int eraseRange(K min_key, K max_key, std::vector<V> *removed = NULL,
+                   std::vector<NodeType *> *unlinked = NULL)
+    {
+        long first = std::max(_convertKey(min_key), 0L);
+        long last = std::min(_convertKey(max_key), this->key_sizes - 1);
+        int count = 0;
+        for (long inner_key = first; inner_key <= last; inner_key++)
         {
-            delete _dense_nodes[inner_key];
+            if (_dense_nodes[inner_key] != NULL)
+            {
+                if (removed != NULL)
+                    removed->push_back(_dense_nodes[inner_key]->value);
+                if (unlinked != NULL)
+                    unlinked->push_back(_dense_nodes[inner_key]);
+                else
+                    delete _dense_nodes[inner_key];
+                _dense_nodes[inner_key] = NULL;
+                count++;
+            }
         }
+        size_ -= count;
+        return count;
     }
 
     /**
@@ -255,14 +323,75 @@ class SkipListDense
     }
 
     /**
-     * @return TRUE if list is empty.
+     * Search for the first node with Key greater or equal than target Key.
+     * @param search_key target Key
+     * @return first node with key >= search_key, NULL if there is none.
      */
-    bool empty() const
+    NodeType *lowerBound(K search_key)
     {
-        for (int i = 0; i < this->key_sizes; i++)
+        long inner_key = _convertKey(search_key);
+        if (inner_key < 0)
+            inner_key = 0;
+        for (; inner_key < this->key_sizes; inner_key++)
         {
-            this->_dense_nodes[i] = NULL;
+            if (_dense_nodes[inner_key] != NULL)
+                return _dense_nodes[inner_key];
         }
+        return NULL;
+    }
+
+    /**
+     * Search for the first node with Key strictly greater than target Key.
+     * @param search_key target Key
+     * @return first node with key > search_key, NULL if there is none.
+     */
+    NodeType *successor(K search_key)
+    {
+        long inner_key = _convertKey(search_key) + 1;
+        if (inner_key < 0)
+            inner_key = 0;
+        for (; inner_key < this->key_sizes; inner_key++)
+        {
+            if (_dense_nodes[inner_key] != NULL)
+                return _dense_nodes[inner_key];
+        }
+        return NULL;
+    }
+
+    /**
+     * Search for the last node with Key strictly lower than target Key.
+     * @param search_key target Key
+     * @return last node with key < search_key, NULL if there is none.
+     */
+    NodeType *predecessor(K search_key)
+    {
+        long inner_key = _convertKey(search_key) - 1;
+        if (inner_key >= this->key_sizes)
+            inner_key = this->key_sizes - 1;
+        for (; inner_key >= 0; inner_key--)
+        {
+            if (_dense_nodes[inner_key] != NULL)
+                return _dense_nodes[inner_key];
+        }
+        return NULL;
+    }
+
+    /**
+     * Next node in list order.
+     * @param node current node
+     * @return next node, NULL if current node is the last one.
+     */
+    NodeType *next(const NodeType *node)
+    {
+        return successor(node->key);
+    }
+
+    /**
+     * @return TRUE if list is empty.
+     */
+    bool empty() const
+    {
+        return size_ == 0;
     }
 
     /**
@@ -301,12 +430,23 @@ class SkipListDense
     /**
      * Iterates list and return an ordered Vector of Nodes. Search is bounded.
      * @param nodes OUTPUT vector of Nodes
-     * @param start start node
-     * @param end_key end target Key
+     * @param start start node, NULL for none
+     * @param end_key end target Key, included
      */
     void retrieveNodes(std::vector<NodeType *> &nodes, NodeType *start, K end_key)
     {
-        printf("NOt implemented!!\n");
+        nodes.clear();
+        if (start == NULL)
+            return;
+        long inner_key = _convertKey(start->key);
+        long end = std::min(_convertKey(end_key), this->key_sizes - 1);
+        for (; inner_key <= end; inner_key++)
+        {
+            if (this->_dense_nodes[inner_key] != NULL)
+            {
+                nodes.push_back(this->_dense_nodes[inner_key]);
+            }
+        }
     }
 
     /**
@@ -380,9 +520,37 @@ class SkipListDense
         return size_;
     }
 
+    /**
+     * @return min Key value given at construction.
+     */
+    K getMinKey() const
+    {
+        return min_key_;
+    }
+
+    /**
+     * @return max Key value given at construction.
+     */
+    K getMaxKey() const
+    {
+        return max_value_;
+    }
+
     const int max_level;
 
   protected:
+    /**
+     * Sets all dense slots as empty.
+     */
+    void _clearNodes()
+    {
+        for (long i = 0; i < this->key_sizes; i++)
+        {
+            this->_dense_nodes[i] = NULL;
+        }
+        size_ = 0;
+    }
+
     /**
      * 
      * @return uniform random value
@@ -411,7 +579,8 @@ class SkipListDense
     long key_sizes;
     K last_;
     int max_current_level_;
-    int size_;
+    // concurrent insertions on different keys update it
+    boost::atomic<int> size_;
     SkipListDenseNode<K, V, MAXLEVEL> *header_node_;
     SkipListDenseNode<K, V, MAXLEVEL> *tail_node_;
     NodeType **_dense_nodes;
@@ -16,6 +16,8 @@
 #include <limits>
 #include <map>
 #include <skimap/SkipList.hpp>
+#include <skimap/utils/OccupancyRaster.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
 #include <skimap/voxels/GenericVoxel3D.hpp>
 #include <vector>
 
@@ -109,7 +111,7 @@ public:
        * @param iy
        * @return
        */
-  virtual bool isValidIndex(K ix, K iy)
+  bool isValidIndex(K ix, K iy)
   {
     bool result = true;
     result &= ix <= _max_index_value && ix >= _min_index_value;
@@ -125,7 +127,7 @@ public:
        * @param iy
        * @return
        */
-  virtual bool coordinatesToIndex(D x, D y, K &ix, K &iy)
+  bool coordinatesToIndex(D x, D y, K &ix, K &iy)
   {
     ix = K(floor(x / _resolution_x));
     iy = K(floor(y / _resolution_y));
@@ -139,9 +141,10 @@ public:
        * @param resolution
        * @return
        */
-  virtual bool singleIndexToCoordinate(K index, D &coordinate, D resolution)
+  bool singleIndexToCoordinate(K index, D &coordinate, D resolution)
   {
     coordinate = index * resolution + resolution * 0.5;
+    return true;
   }
 
   /**
@@ -152,7 +155,7 @@ public:
        * @param y
        * @return
        */
-  virtual bool indexToCoordinates(K ix, K iy, D &x, D &y)
+  bool indexToCoordinates(K ix, K iy, D &x, D &y)
   {
     x = ix * _resolution_x + _resolution_x * 0.5;
     y = iy * _resolution_y + _resolution_y * 0.5;
@@ -200,7 +203,7 @@ public:
   * @param key x index
   * @return
   */
-  virtual void lockMap(K key)
+  void lockMap(K key)
   {
     this->mutex_map_mutex.lock();
     if (this->mutex_map.count(key) == 0)
@@ -216,7 +219,7 @@ public:
   * @param key x index
   * @return
   */
-  virtual void unlockMap(K key)
+  void unlockMap(K key)
   {
     this->mutex_map_mutex.lock();
     if (this->mutex_map.count(key) > 0)
@@ -285,42 +288,88 @@ public:
   }
 
   /**
-       *
-       * @param voxels
+       * Fetches all tiles with a two-pass parallel gather (see
+       * parallelGather). Capacity of 'voxels' is reused across calls.
+       * @param voxels OUTPUT tiles
        */
   virtual void fetchVoxels(std::vector<Voxel2D> &voxels)
   {
-    voxels.clear();
     std::vector<typename X_NODE::NodeType *> xnodes;
     _root_list->retrieveNodes(xnodes);
 
-#pragma omp parallel
-    {
-      std::vector<Voxel2D> voxels_private;
+    parallelGather(
+        int(xnodes.size()),
+        [&](int i) { return long(xnodes[i]->value->getSize()); },
+        [&](int i, Voxel2D *output) {
+          K ix, iy;
+          D x, y;
+          std::vector<typename Y_NODE::NodeType *> ynodes;
+          xnodes[i]->value->retrieveNodes(ynodes);
+          for (int j = 0; j < ynodes.size(); j++)
+          {
+            ix = xnodes[i]->key;
+            iy = ynodes[j]->key;
+            indexToCoordinates(ix, iy, x, y);
+            *output++ = Voxel2D(x, y, ynodes[j]->value);
+          }
+        },
+        voxels);
+  }
 
-#pragma omp for nowait
+  /**
+       * Rasterizes the grid into an occupancy raster, without building a
+       * voxel list. Cells holding a voxel accepted by 'occupied' are
+       * OCCUPIED, the other stored cells FREE and missing ones UNKNOWN. The
+       * window grows to the grid bounds if raster.auto_grow is set.
+       * @param raster INPUT/OUTPUT raster, fully rewritten
+       * @param occupied functor bool(const V *)
+       */
+  template <class F> void rasterize(OccupancyRaster<K> &raster, F occupied)
+  {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _root_list->retrieveNodes(xnodes);
+
+    raster.resized = false;
+    raster.clearDirty();
+    if (!xnodes.empty())
+    {
+      K min_y = std::numeric_limits<K>::max();
+      K max_y = std::numeric_limits<K>::min();
       for (int i = 0; i < xnodes.size(); i++)
       {
-        K ix, iy;
-        D x, y;
+        if (xnodes[i]->value->empty())
+          continue;
         std::vector<typename Y_NODE::NodeType *> ynodes;
         xnodes[i]->value->retrieveNodes(ynodes);
-        for (int j = 0; j < ynodes.size(); j++)
-        {
-          ix = xnodes[i]->key;
-          iy = ynodes[j]->key;
-          indexToCoordinates(ix, iy, x, y);
-          voxels_private.push_back(Voxel2D(x, y, ynodes[j]->value));
-        }
+        min_y = std::min(min_y, ynodes.front()->key);
+        max_y = std::max(max_y, ynodes.back()->key);
       }
+      raster.include(xnodes.front()->key, xnodes.back()->key, min_y, max_y);
+    }
 
-#pragma omp critical
-      voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
+    std::fill(raster.data.begin(), raster.data.end(),
+              OccupancyRaster<K>::UNKNOWN);
+    raster.markDirty(0, raster.width - 1, 0, raster.height - 1);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < xnodes.size(); i++)
+    {
+      std::vector<typename Y_NODE::NodeType *> ynodes;
+      xnodes[i]->value->retrieveNodes(ynodes);
+      for (int j = 0; j < ynodes.size(); j++)
+      {
+        long cell = raster.cellIndex(xnodes[i]->key, ynodes[j]->key);
+        if (cell >= 0)
+          raster.data[cell] = occupied(ynodes[j]->value)
+                                  ? OccupancyRaster<K>::OCCUPIED
+                                  : OccupancyRaster<K>::FREE;
+      }
     }
   }
 
   /**
-       * Radius search
+       * Radius search. Results are gathered with a two-pass parallel gather
+       * (see parallelGather), capacity of 'voxels' is reused across calls.
        * @param cx
        * @param cy
        * @param radiusx
@@ -331,7 +380,6 @@ public:
   virtual void radiusSearch(K cx, K cy, K radiusx, K radiusy,
                             std::vector<Voxel2D> &voxels, bool boxed = false)
   {
-    voxels.clear();
     std::vector<typename X_NODE::NodeType *> xnodes;
 
     K ix_min = cx - radiusx;
@@ -348,37 +396,37 @@ public:
     indexToCoordinates(cx, cy, centerx, centery);
     radius = (rx + ry) / 2.0;
 
-#pragma omp parallel
-    {
-      std::vector<Voxel2D> voxels_private;
-
-#pragma omp for nowait
-      for (int i = 0; i < xnodes.size(); i++)
+    // Visits tiles of a X column inside the search area
+    auto visit_column = [&](int i, Voxel2D *output) {
+      long count = 0;
+      K ix, iy;
+      D x, y;
+      D distance;
+      std::vector<typename Y_NODE::NodeType *> ynodes;
+      xnodes[i]->value->retrieveNodesByRange(iy_min, iy_max, ynodes);
+      for (int j = 0; j < ynodes.size(); j++)
       {
-        K ix, iy;
-        D x, y;
-        D distance;
-        std::vector<typename Y_NODE::NodeType *> ynodes;
-        xnodes[i]->value->retrieveNodesByRange(iy_min, iy_max, ynodes);
-        for (int j = 0; j < ynodes.size(); j++)
-        {
-          ix = xnodes[i]->key;
-          iy = ynodes[j]->key;
+        ix = xnodes[i]->key;
+        iy = ynodes[j]->key;
 
-          indexToCoordinates(ix, iy, x, y);
-          if (!boxed)
-          {
-            distance = sqrt(pow(centerx - x, 2) + pow(centery - y, 2));
-            if (distance > radius)
-              continue;
-          }
-          voxels_private.push_back(Voxel2D(x, y, ynodes[j]->value));
+        indexToCoordinates(ix, iy, x, y);
+        if (!boxed)
+        {
+          distance = sqrt(pow(centerx - x, 2) + pow(centery - y, 2));
+          if (distance > radius)
+            continue;
         }
+        if (output != NULL)
+          output[count] = Voxel2D(x, y, ynodes[j]->value);
+        count++;
       }
+      return count;
+    };
 
-#pragma omp critical
-      voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
-    }
+    parallelGather(int(xnodes.size()),
+                   [&](int i) { return visit_column(i, NULL); },
+                   [&](int i, Voxel2D *output) { visit_column(i, output); },
+                   voxels);
   }
 
   /**
@@ -482,7 +530,7 @@ public:
     this->_self_concurrency_management = status;
   }
 
-  virtual bool hasConcurrencyAccess()
+  bool hasConcurrencyAccess()
   {
     return this->_self_concurrency_management;
   }
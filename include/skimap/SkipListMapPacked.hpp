@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef SKIPLISTMAPPACKED_HPP
+#define SKIPLISTMAPPACKED_HPP
+
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <omp.h>
+#include <skimap/SkipList.hpp>
+#include <skimap/utils/PackedKey.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
+#include <skimap/voxels/GenericTile2D.hpp>
+#include <skimap/voxels/GenericVoxel3D.hpp>
+#include <vector>
+
+namespace skimap {
+
+/**
+     * Voxel map on a single skip list keyed by the packed index
+     * (ix, iy, iz): a lookup is one descent instead of the three nested
+     * ones of SkipListMapV2. Keys are column-major (X, then Y, then Z), so
+     * an (X,Y) column is a contiguous run of the list and box queries
+     * skip-scan it, seeking past the runs outside the box.
+     * Each index uses at most 21 bits (see PackedKey): with wider K types
+     * the valid range is clamped to [-2^20, 2^20 - 1].
+     * With concurrency access integration is serialized by a single mutex,
+     * queries must not run concurrently with integration.
+     * V template represents datatype for user data.
+     * K template represents datatype for indices.
+     * D template represents datatype for coordinates.
+     * DEPTH template represents max depth of the skip list.
+     */
+template <class V, class K, class D, int DEPTH = 24>
+class SkipListMapPacked {
+public:
+  typedef V Value;
+  typedef K Index;
+  typedef D Coordinate;
+  typedef GenericVoxel3D<V, D> Voxel3D;
+  typedef GenericTile2D<V, D> Tiles2D;
+  typedef PackedKey<K> PACKING;
+  typedef typename PACKING::Key Key;
+  typedef SkipList<Key, V *, DEPTH> LIST;
+
+  static const int INDEX_BITS = PACKING::BITS;
+
+  /**
+       *
+       * @param min_index
+       * @param max_index
+       * @param resolution_x
+       * @param resolution_y
+       * @param resolution_z
+       * @param zero_level ground height used by fetchTiles
+       */
+  SkipListMapPacked(K min_index, K max_index, D resolution_x, D resolution_y,
+                    D resolution_z, D zero_level = D(0.0))
+      : _min_index_value(std::max(long(min_index), -_bias())),
+        _max_index_value(std::min(long(max_index), _bias() - 1)),
+        _resolution_x(resolution_x), _resolution_y(resolution_y),
+        _resolution_z(resolution_z),
+        _list(new LIST(0, std::numeric_limits<Key>::max())),
+        _self_concurrency_management(false) {
+    setZeroLevel(zero_level);
+  }
+
+  /**
+       */
+  SkipListMapPacked(D resolution, D zero_level = D(0.0))
+      : _min_index_value(
+            std::max(long(std::numeric_limits<K>::min()), -_bias())),
+        _max_index_value(
+            std::min(long(std::numeric_limits<K>::max()), _bias() - 1)),
+        _resolution_x(resolution), _resolution_y(resolution),
+        _resolution_z(resolution),
+        _list(new LIST(0, std::numeric_limits<Key>::max())),
+        _self_concurrency_management(false) {
+    setZeroLevel(zero_level);
+  }
+
+  virtual ~SkipListMapPacked() {
+    std::vector<typename LIST::NodeType *> nodes;
+    _list->retrieveNodes(nodes);
+    for (long i = 0; i < long(nodes.size()); i++)
+      delete nodes[i]->value;
+    delete _list;
+  }
+
+  /**
+       * Sets the ground height used by fetchTiles.
+       */
+  void setZeroLevel(D zero_level) {
+    _zero_level = zero_level;
+    _zero_level_key = K(floor(_zero_level / _resolution_z));
+  }
+
+  bool isValidIndex(K ix, K iy, K iz) {
+    return ix >= _min_index_value && ix <= _max_index_value &&
+           iy >= _min_index_value && iy <= _max_index_value &&
+           iz >= _min_index_value && iz <= _max_index_value;
+  }
+
+  bool coordinatesToIndex(D x, D y, D z, K &ix, K &iy, K &iz) {
+    ix = K(floor(x / _resolution_x));
+    iy = K(floor(y / _resolution_y));
+    iz = K(floor(z / _resolution_z));
+    return isValidIndex(ix, iy, iz);
+  }
+
+  bool indexToCoordinates(K ix, K iy, K iz, D &x, D &y, D &z) {
+    x = ix * _resolution_x + _resolution_x * 0.5;
+    y = iy * _resolution_y + _resolution_y * 0.5;
+    z = iz * _resolution_z + _resolution_z * 0.5;
+    return true;
+  }
+
+  /**
+       * Packed key of an index, see the class description.
+       */
+  static Key packKey(K ix, K iy, K iz) {
+    return PACKING::packIndex(ix, iy, iz);
+  }
+
+  /**
+       * Index of a packed key.
+       */
+  static void unpackKey(Key key, K &ix, K &iy, K &iz) {
+    PACKING::unpackIndex(key, ix, iy, iz);
+  }
+
+  virtual bool integrateVoxel(D x, D y, D z, V *data) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return integrateVoxel(ix, iy, iz, data);
+    }
+    return false;
+  }
+
+  /**
+       * Integrates a voxel (V operator+ with the existing one).
+       */
+  virtual bool integrateVoxel(K ix, K iy, K iz, V *data) {
+    if (!isValidIndex(ix, iy, iz))
+      return false;
+
+    Key key = packKey(ix, iy, iz);
+    if (this->hasConcurrencyAccess())
+      _mutex.lock();
+    const typename LIST::NodeType *voxel = _list->find(key);
+    if (voxel == NULL) {
+      _list->insert(key, new V(data));
+    } else {
+      *(voxel->value) = *(voxel->value) + *data;
+    }
+    if (this->hasConcurrencyAccess())
+      _mutex.unlock();
+    return true;
+  }
+
+  virtual V *find(K ix, K iy, K iz) {
+    if (!isValidIndex(ix, iy, iz))
+      return NULL;
+    const typename LIST::NodeType *voxel = _list->find(packKey(ix, iy, iz));
+    return voxel != NULL ? voxel->value : NULL;
+  }
+
+  virtual V *find(D x, D y, D z) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return find(ix, iy, iz);
+    }
+    return NULL;
+  }
+
+  virtual long voxelsCount() { return _list->getSize(); }
+
+  /**
+       * Fetches all voxels, converted in parallel from a single list walk.
+       * @param voxels OUTPUT voxels
+       */
+  virtual void fetchVoxels(std::vector<Voxel3D> &voxels) {
+    std::vector<typename LIST::NodeType *> nodes;
+    _list->retrieveNodes(nodes);
+    voxels.resize(nodes.size());
+
+#pragma omp parallel for
+    for (long i = 0; i < long(nodes.size()); i++) {
+      K ix, iy, iz;
+      unpackKey(nodes[i]->key, ix, iy, iz);
+      indexToCoordinates(ix, iy, iz, voxels[i].x, voxels[i].y, voxels[i].z);
+      voxels[i].data = nodes[i]->value;
+    }
+  }
+
+  /**
+       * Radius search, same semantics of SkipListMapV2::radiusSearch. Each X
+       * slice of the box is skip-scanned in parallel.
+       */
+  virtual void radiusSearch(K cx, K cy, K cz, K radiusx, K radiusy, K radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    long min_x = std::max(long(cx) - radiusx, _min_index_value);
+    long max_x = std::min(long(cx) + radiusx, _max_index_value);
+    long min_y = std::max(long(cy) - radiusy, _min_index_value);
+    long max_y = std::min(long(cy) + radiusy, _max_index_value);
+    long min_z = std::max(long(cz) - radiusz, _min_index_value);
+    long max_z = std::min(long(cz) + radiusz, _max_index_value);
+    if (min_x > max_x || min_y > max_y || min_z > max_z) {
+      voxels.clear();
+      return;
+    }
+
+    D rx, ry, rz, radius;
+    D centerx, centery, centerz;
+    indexToCoordinates(radiusx, radiusy, radiusz, rx, ry, rz);
+    indexToCoordinates(cx, cy, cz, centerx, centery, centerz);
+    radius = (rx + ry + rz) / 3.0;
+
+    // Visits voxels of a X slice inside the search volume, writing at most
+    // 'capacity' of them if output is given
+    auto visit_slice = [&](int i, Voxel3D *output, long capacity) {
+      long count = 0;
+      Key ux = _unbias(K(min_x + i));
+      Key uy = _unbias(K(min_y)), max_uy = _unbias(K(max_y));
+      Key min_uz = _unbias(K(min_z)), max_uz = _unbias(K(max_z));
+      typename LIST::NodeType *node = _list->lowerBound(_pack(ux, uy, min_uz));
+      while (node != NULL) {
+        Key nx, ny, nz;
+        _unpack(node->key, nx, ny, nz);
+        if (nx != ux || ny > max_uy)
+          break;
+        if (nz < min_uz) {
+          node = _list->lowerBound(_pack(ux, ny, min_uz));
+          continue;
+        }
+        if (nz > max_uz) {
+          node = _list->lowerBound(_pack(ux, ny + 1, min_uz));
+          continue;
+        }
+        K ix, iy, iz;
+        D x, y, z;
+        unpackKey(node->key, ix, iy, iz);
+        indexToCoordinates(ix, iy, iz, x, y, z);
+        V *data = node->value;
+        node = _list->next(node);
+        if (!boxed && sqrt(pow(centerx - x, 2) + pow(centery - y, 2) +
+                           pow(centerz - z, 2)) > radius)
+          continue;
+        if (output != NULL) {
+          if (count == capacity)
+            return count;
+          output[count] = Voxel3D(x, y, z, data);
+        }
+        count++;
+      }
+      return count;
+    };
+
+    parallelGatherBounded(
+        int(max_x - min_x + 1),
+        [&](int i) { return visit_slice(i, NULL, 0); },
+        [&](int i, Voxel3D *output, long capacity) {
+          return visit_slice(i, output, capacity);
+        },
+        voxels);
+  }
+
+  virtual void radiusSearch(D cx, D cy, D cz, D radiusx, D radiusy, D radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(cx, cy, cz, ix, iy, iz)) {
+      K iradiusx, iradiusy, iradiusz;
+      iradiusx = K(floor(radiusx / _resolution_x));
+      iradiusy = K(floor(radiusy / _resolution_y));
+      iradiusz = K(floor(radiusz / _resolution_z));
+      radiusSearch(ix, iy, iz, iradiusx, iradiusy, iradiusz, voxels, boxed);
+    }
+  }
+
+  /**
+       * Fetches one tile per (X,Y) column, same semantics of
+       * SkiMap::fetchTiles: the tile holds the lowest voxel at or above the
+       * zero level, if it is below min_voxel_height. The ground of each
+       * column is a single seek, X slices are scanned in parallel.
+       * @param voxels OUTPUT tiles
+       * @param min_voxel_height
+       */
+  virtual void fetchTiles(std::vector<Tiles2D> &voxels, D min_voxel_height) {
+    std::vector<Key> slices;
+    typename LIST::NodeType *node = _list->lowerBound(1);
+    while (node != NULL) {
+      Key ux, uy, uz;
+      _unpack(node->key, ux, uy, uz);
+      slices.push_back(ux);
+      node = _list->lowerBound(_pack(ux + 1, 0, 0));
+    }
+    Key zero_uz = _unbias(std::max(
+        K(_min_index_value), std::min(K(_max_index_value), _zero_level_key)));
+
+    auto visit_slice = [&](int i, Tiles2D *output, long capacity) {
+      long count = 0;
+      typename LIST::NodeType *column =
+          _list->lowerBound(_pack(slices[i], 0, 0));
+      while (column != NULL) {
+        Key ux, uy, uz;
+        _unpack(column->key, ux, uy, uz);
+        if (ux != slices[i])
+          break;
+        if (output != NULL) {
+          if (count == capacity)
+            return count;
+          K ix, iy, iz;
+          D x, y, z;
+          unpackKey(column->key, ix, iy, iz);
+          indexToCoordinates(ix, iy, _zero_level_key, x, y, z);
+          output[count] = Tiles2D(x, y, z, NULL);
+
+          typename LIST::NodeType *ground =
+              _list->lowerBound(_pack(ux, uy, zero_uz));
+          Key gx, gy, gz;
+          if (ground != NULL) {
+            _unpack(ground->key, gx, gy, gz);
+            D height =
+                (long(gz) - _bias()) * _resolution_z + _resolution_z * 0.5;
+            if (gx == ux && gy == uy && height <= min_voxel_height)
+              output[count].data = ground->value;
+          }
+        }
+        count++;
+        column = _list->lowerBound(_pack(ux, uy + 1, 0));
+      }
+      return count;
+    };
+
+    parallelGatherBounded(
+        int(slices.size()), [&](int i) { return visit_slice(i, NULL, 0); },
+        [&](int i, Tiles2D *output, long capacity) {
+          return visit_slice(i, output, capacity);
+        },
+        voxels);
+  }
+
+  virtual void enableConcurrencyAccess(bool status = true) {
+    _self_concurrency_management = status;
+  }
+
+  bool hasConcurrencyAccess() { return _self_concurrency_management; }
+
+protected:
+  static long _bias() { return PACKING::bias(); }
+
+  static Key _unbias(K index) { return PACKING::unbias(index); }
+
+  static Key _pack(Key ux, Key uy, Key uz) {
+    return PACKING::pack(ux, uy, uz);
+  }
+
+  static void _unpack(Key key, Key &ux, Key &uy, Key &uz) {
+    PACKING::unpack(key, ux, uy, uz);
+  }
+
+  long _min_index_value;
+  long _max_index_value;
+  D _resolution_x;
+  D _resolution_y;
+  D _resolution_z;
+  D _zero_level;
+  K _zero_level_key;
+  LIST *_list;
+  bool _self_concurrency_management;
+  boost::mutex _mutex;
+};
+}
+
+#endif /* SKIPLISTMAPPACKED_HPP */
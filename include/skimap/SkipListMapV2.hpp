@@ -10,15 +10,30 @@
 #ifndef SkipListMapV2_HPP
 #define SkipListMapV2_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <omp.h>
+#include <queue>
+#include <skimap/LevelPolicies.hpp>
 #include <skimap/SkipList.hpp>
+#include <skimap/SkipListBranch.hpp>
 #include <skimap/SkipListDense.hpp>
+#include <skimap/utils/EpochManager.hpp>
+#include <skimap/utils/Frustum.hpp>
+#include <skimap/utils/PackedKey.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
+#include <skimap/utils/VoxelFilters.hpp>
+#include <skimap/utils/VoxelFootprint.hpp>
+#include <skimap/utils/VoxelFusion.hpp>
 #include <skimap/voxels/GenericVoxel3D.hpp>
+#include <string>
 #include <vector>
 
 #define SkipListMapV2_MAX_DEPTH 16
@@ -26,12 +41,20 @@
 namespace skimap {
 
 /**
-     *
-     * @param min_index
-     * @param max_index
+     * Three level voxel map: X keys lead to Y branches, Y keys to Z
+     * branches holding the voxels. The container of each level is a policy
+     * (see LevelPolicies): by default a dense X level and skip list Y/Z
+     * levels. SkipListMap is the same map with skip lists at every level.
+     * V template represents datatype for user data.
+     * K template represents datatype for indices.
+     * D template represents datatype for coordinates.
+     * X_DEPTH, Y_DEPTH, Z_DEPTH templates represent max depth of the levels.
+     * X_LEVEL, Y_LEVEL, Z_LEVEL templates represent container policies of
+     * the levels.
      */
 template <class V, class K, class D, int X_DEPTH = 8, int Y_DEPTH = 8,
-          int Z_DEPTH = 8>
+          int Z_DEPTH = 8, class X_LEVEL = DenseLevel,
+          class Y_LEVEL = SkipListLevel, class Z_LEVEL = SkipListLevel>
 class SkipListMapV2 {
 public:
   typedef GenericVoxel3D<V, D> Voxel3D;
@@ -72,10 +95,121 @@ public:
     }
   };
 
+  /**
+       * Voxel addressed by integer indices, no coordinate conversion.
+       */
+  struct IndexedVoxel {
+    K ix, iy, iz;
+    V *data;
+
+    IndexedVoxel() : ix(0), iy(0), iz(0), data(NULL) {}
+    IndexedVoxel(K ix, K iy, K iz, V *data)
+        : ix(ix), iy(iy), iz(iz), data(data) {}
+  };
+
+  /**
+       * Contribution of a source (e.g. a keyframe) to a voxel, i.e. the
+       * fusion of the source data integrated in it.
+       */
+  struct SourceVoxel {
+    K ix, iy, iz;
+    V data;
+
+    SourceVoxel() : ix(0), iy(0), iz(0) {}
+    SourceVoxel(K ix, K iy, K iz, const V &data)
+        : ix(ix), iy(iy), iz(iz), data(data) {}
+
+    bool operator<(const SourceVoxel &other) const {
+      if (ix != other.ix)
+        return ix < other.ix;
+      if (iy != other.iy)
+        return iy < other.iy;
+      return iz < other.iz;
+    }
+
+    bool sameVoxel(const SourceVoxel &other) const {
+      return ix == other.ix && iy == other.iy && iz == other.iz;
+    }
+  };
+
+  /**
+       * (X,Y) column removed from the map, with the version of the removal.
+       */
+  struct ErasedColumn {
+    K ix, iy;
+    unsigned long version;
+
+    ErasedColumn(K ix, K iy, unsigned long version)
+        : ix(ix), iy(iy), version(version) {}
+  };
+
+  /**
+       * Ray for batched ray casting. Direction needs not to be normalized.
+       */
+  struct Ray {
+    D ox, oy, oz;
+    D dx, dy, dz;
+
+    Ray(D ox, D oy, D oz, D dx, D dy, D dz)
+        : ox(ox), oy(oy), oz(oz), dx(dx), dy(dy), dz(dz) {}
+  };
+
+  /**
+       * Result of a ray cast: first hit voxel and its distance from the ray
+       * origin along the ray. voxel.data is NULL if nothing was hit.
+       */
+  struct RayHit {
+    Voxel3D voxel;
+    D distance;
+
+    RayHit() : distance(D(0)) {}
+  };
+
+  /**
+       * Axis aligned box of indices. Bounds are inclusive, the void
+       * constructor covers the whole index space.
+       */
+  struct IndexBox {
+    K min_x, max_x, min_y, max_y, min_z, max_z;
+
+    IndexBox()
+        : min_x(std::numeric_limits<K>::min()),
+          max_x(std::numeric_limits<K>::max()),
+          min_y(std::numeric_limits<K>::min()),
+          max_y(std::numeric_limits<K>::max()),
+          min_z(std::numeric_limits<K>::min()),
+          max_z(std::numeric_limits<K>::max()) {}
+
+    IndexBox(K min_x, K max_x, K min_y, K max_y, K min_z, K max_z)
+        : min_x(min_x), max_x(max_x), min_y(min_y), max_y(max_y),
+          min_z(min_z), max_z(max_z) {}
+
+    bool contains(K ix, K iy, K iz) const {
+      return ix >= min_x && ix <= max_x && iy >= min_y && iy <= max_y &&
+             iz >= min_z && iz <= max_z;
+    }
+  };
+
+  typedef V Value;
   typedef K Index;
-  typedef SkipList<Index, V *, Z_DEPTH> Z_NODE;
-  typedef SkipList<Index, Z_NODE *, Y_DEPTH> Y_NODE;
-  typedef SkipListDense<Index, Y_NODE *, X_DEPTH> X_NODE;
+  typedef D Coordinate;
+  typedef PackedKey<K> PACKING;
+  typedef typename PACKING::Key Key;
+  typedef unsigned long Version;
+  typedef SkipListBranch<
+      Index, V *, Z_DEPTH,
+      typename Z_LEVEL::template Container<Index, V *, Z_DEPTH>::type>
+      Z_NODE;
+  typedef SkipListBranch<
+      Index, Z_NODE *, Y_DEPTH,
+      typename Y_LEVEL::template Container<Index, Z_NODE *, Y_DEPTH>::type>
+      Y_NODE;
+  typedef typename X_LEVEL::template Container<Index, Y_NODE *, X_DEPTH>::type
+      X_NODE;
+  BOOST_CONCEPT_ASSERT((LevelContainer<Z_NODE>));
+  BOOST_CONCEPT_ASSERT((LevelContainer<Y_NODE>));
+  BOOST_CONCEPT_ASSERT((LevelContainer<X_NODE>));
+  typedef EpochManager::ReadGuard ReadGuard;
 
   /**
        *
@@ -91,7 +225,9 @@ public:
         _resolution_x(resolution_x), _resolution_y(resolution_y),
         _resolution_z(resolution_z), _voxel_counter(0), _xlist_counter(0),
         _ylist_counter(0), _bytes_counter(0), _batch_integration(false),
-        _initialized(false), _self_concurrency_management(false) {
+        _initialized(false), _self_concurrency_management(false), _version(1),
+        _erased_horizon(0), _snapshot_reads(false),
+        _epochs(new EpochManager()), _root_shared(false) {
     initialize(_min_index_value, _max_index_value);
   }
 
@@ -103,7 +239,9 @@ public:
         _resolution_x(resolution), _resolution_y(resolution),
         _resolution_z(resolution), _voxel_counter(0), _xlist_counter(0),
         _ylist_counter(0), _bytes_counter(0), _batch_integration(false),
-        _initialized(false), _self_concurrency_management(false) {
+        _initialized(false), _self_concurrency_management(false), _version(1),
+        _erased_horizon(0), _snapshot_reads(false),
+        _epochs(new EpochManager()), _root_shared(false) {
     initialize(_min_index_value, _max_index_value);
   }
 
@@ -115,7 +253,9 @@ public:
         _resolution_y(0.01), _resolution_z(0.1), _voxel_counter(0),
         _xlist_counter(0), _ylist_counter(0), _bytes_counter(0),
         _batch_integration(false), _initialized(false),
-        _self_concurrency_management(false) {}
+        _self_concurrency_management(false), _version(1),
+        _erased_horizon(0), _snapshot_reads(false),
+        _epochs(new EpochManager()), _root_shared(false) {}
 
   /**
        *
@@ -131,13 +271,31 @@ public:
   /**
        */
   void initialize(K min_index, K max_index) {
-    if (_initialized) {
-      delete _root_list;
-    }
+    // the previous root, if any, is released with its branches
     _root_list = new X_NODE(min_index, max_index);
+    _root_owner.reset(_root_list, _RootRelease(_epochs));
+    _root_shared = false;
     _bytes_counter += sizeof(X_NODE);
   }
 
+  /**
+       * Copy-on-write snapshot of the map as of now, in O(1): the snapshot
+       * shares every list with the map. Afterwards the map clones the root
+       * and the X/Y/Z branches on the path of each modification the first
+       * time it touches them (path copying), never the untouched ones; so
+       * the snapshot can be read (fetchVoxels, queries, saveToFile) while
+       * integration continues. Memory of the frozen branches is released,
+       * through the epoch manager shared with the map, when the last
+       * snapshot using them is destroyed.
+       * Must not run concurrently with writers of the map.
+       * @return read-only view of the current map
+       */
+  boost::shared_ptr<SkipListMapV2> snapshot() {
+    boost::shared_ptr<SkipListMapV2> frozen(new SkipListMapV2());
+    _snapshotInto(*frozen);
+    return frozen;
+  }
+
   /**
        *
        * @param ix
@@ -145,7 +303,7 @@ public:
        * @param iz
        * @return
        */
-  virtual bool isValidIndex(K ix, K iy, K iz) {
+  bool isValidIndex(K ix, K iy, K iz) {
     bool result = true;
     result &= ix <= _max_index_value && ix >= _min_index_value;
     result &= iy <= _max_index_value && iy >= _min_index_value;
@@ -163,7 +321,7 @@ public:
        * @param iz
        * @return
        */
-  virtual bool coordinatesToIndex(D x, D y, D z, K &ix, K &iy, K &iz) {
+  bool coordinatesToIndex(D x, D y, D z, K &ix, K &iy, K &iz) {
     ix = K(floor(x / _resolution_x));
     iy = K(floor(y / _resolution_y));
     iz = K(floor(z / _resolution_z));
@@ -177,8 +335,9 @@ public:
        * @param resolution
        * @return
        */
-  virtual bool singleIndexToCoordinate(K index, D &coordinate, D resolution) {
+  bool singleIndexToCoordinate(K index, D &coordinate, D resolution) {
     coordinate = index * resolution + resolution * 0.5;
+    return true;
   }
 
   /**
@@ -191,7 +350,7 @@ public:
        * @param z
        * @return
        */
-  virtual bool indexToCoordinates(K ix, K iy, K iz, D &x, D &y, D &z) {
+  bool indexToCoordinates(K ix, K iy, K iz, D &x, D &y, D &z) {
     x = ix * _resolution_x + _resolution_x * 0.5;
     y = iy * _resolution_y + _resolution_y * 0.5;
     z = iz * _resolution_z + _resolution_z * 0.5;
@@ -239,7 +398,7 @@ public:
   * @param key x index
   * @return
   */
-  virtual void lockMap(K key) {
+  void lockMap(K key) {
     this->mutex_map_mutex.lock();
     if (this->mutex_map.count(key) == 0) {
       mutex_map[key] = new boost::mutex();
@@ -253,7 +412,7 @@ public:
   * @param key x index
   * @return
   */
-  virtual void unlockMap(K key) {
+  void unlockMap(K key) {
     this->mutex_map_mutex.lock();
     if (this->mutex_map.count(key) > 0) {
       mutex_map[key]->unlock();
@@ -288,29 +447,24 @@ public:
   virtual bool integrateVoxel(K ix, K iy, K iz, V *data) {
     if (isValidIndex(ix, iy, iz)) {
 
+      _ownRoot();
       if (this->hasConcurrencyAccess())
         this->_root_list->lock(ix);
 
-      const typename X_NODE::NodeType *ylist = _root_list->find(ix);
-      if (ylist == NULL) {
-        ylist = _root_list->insert(
-            ix, new Y_NODE(_min_index_value, _max_index_value));
-        //_bytes_counter += sizeof(typename X_NODE::NodeType) + sizeof(Y_NODE);
-      }
-
-      const typename Y_NODE::NodeType *zlist = ylist->value->find(iy);
-      if (zlist == NULL) {
-        zlist = ylist->value->insert(
-            iy, new Z_NODE(_min_index_value, _max_index_value));
-        //_bytes_counter += sizeof(typename Y_NODE::NodeType) + sizeof(Z_NODE);
-      }
-      const typename Z_NODE::NodeType *voxel = zlist->value->find(iz);
-      if (voxel == NULL) {
-        voxel = zlist->value->insert(iz, new V(data));
+      Y_NODE *ylist;
+      Z_NODE *zlist = _writableColumn(ix, iy, ylist);
+      const typename Z_NODE::NodeType *voxel = zlist->find(iz);
+      bool inserted = voxel == NULL;
+      if (inserted) {
+        voxel = zlist->insert(iz, new V(data));
         // _bytes_counter += sizeof(typename Y_NODE::NodeType) + sizeof(V);
+#pragma omp atomic
+        _voxel_counter++;
       } else {
-        *(voxel->value) = *(voxel->value) + *data;
+        _fuseVoxel(zlist, voxel, data);
       }
+      _touchColumn(ylist, zlist);
+      _voxelIntegrated(ix, iy, zlist, iz, inserted);
 
       if (this->hasConcurrencyAccess())
         this->_root_list->unlock(ix);
@@ -319,6 +473,164 @@ public:
     return false;
   }
 
+  /**
+       * Packed voxel keys (see PackedKey) of a batch of points, converted
+       * with SIMD, for integrateKeys. Points out of the map range, or out
+       * of the packable one (21 bits per index), get key 0.
+       * @param x, y, z coordinates of the points
+       * @param size number of points
+       * @param keys OUTPUT 'size' keys
+       * @param transform rigid transform applied to the points, 4x4
+       * row-major, or NULL
+       */
+  void coordinatesToKeys(const D *x, const D *y, const D *z, long size,
+                         Key *keys, const D *transform = NULL) {
+    D inverse_resolution[3] = {D(1) / _resolution_x, D(1) / _resolution_y,
+                               D(1) / _resolution_z};
+    PACKING::fromCoordinates(x, y, z, size, inverse_resolution,
+                             long(_min_index_value), long(_max_index_value),
+                             transform, keys);
+  }
+
+  /**
+       * Integrates a batch of voxels by packed key: the batch is sorted by
+       * key and the data falling in the same voxel is fused (V operator+)
+       * first, then each X branch is integrated in parallel with
+       * concurrency access (see integrateSource). Keys 0 are skipped.
+       * @param keys voxel keys, see coordinatesToKeys
+       * @param data data of each key
+       * @param size number of keys
+       * @return number of voxels touched
+       */
+  long integrateKeys(const Key *keys, const V *data, long size) {
+    std::vector<std::pair<Key, long>> order;
+    order.reserve(size);
+    for (long i = 0; i < size; i++) {
+      if (keys[i] != 0)
+        order.push_back(std::make_pair(keys[i], i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<SourceVoxel> voxels;
+    voxels.reserve(order.size());
+    for (long i = 0; i < long(order.size()); i++) {
+      if (i > 0 && order[i].first == order[i - 1].first) {
+        voxels.back().data = voxels.back().data + data[order[i].second];
+      } else {
+        K ix, iy, iz;
+        PACKING::unpackIndex(order[i].first, ix, iy, iz);
+        voxels.push_back(SourceVoxel(ix, iy, iz, data[order[i].second]));
+      }
+    }
+    _scatterFootprint(voxels);
+    return voxels.size();
+  }
+
+  /**
+       * Integrates a batch of points given as arrays of coordinates,
+       * optionally moved by a rigid transform (e.g. camera to map):
+       * coordinatesToKeys followed by integrateKeys.
+       * @param x, y, z coordinates of the points
+       * @param data data of each point
+       * @param size number of points
+       * @param transform rigid transform, 4x4 row-major, or NULL
+       * @return number of voxels touched
+       */
+  long integrateVoxels(const D *x, const D *y, const D *z, const V *data,
+                       long size, const D *transform = NULL) {
+    std::vector<Key> keys(size);
+    coordinatesToKeys(x, y, z, size, keys.data(), transform);
+    return integrateKeys(keys.data(), data, size);
+  }
+
+  /**
+       *
+       * @param x
+       * @param y
+       * @param z
+       * @param data
+       * @return
+       */
+  virtual bool deintegrateVoxel(D x, D y, D z, V *data) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(x, y, z, ix, iy, iz)) {
+      return deintegrateVoxel(ix, iy, iz, data);
+    }
+    return false;
+  }
+
+  /**
+       * Removes data previously integrated in an existing voxel
+       * (V operator-), see deintegrateVoxels. Missing voxels are left
+       * missing.
+       * @param ix
+       * @param iy
+       * @param iz
+       * @param data
+       * @return FALSE if the voxel does not exist
+       */
+  virtual bool deintegrateVoxel(K ix, K iy, K iz, V *data) {
+    if (find(ix, iy, iz) == NULL)
+      return false;
+    deintegrateVoxels(
+        std::vector<IndexedVoxel>(1, IndexedVoxel(ix, iy, iz, data)));
+    return true;
+  }
+
+  /**
+       * Deintegrates a batch of voxels, e.g. a whole frame. Data falling in
+       * the same voxel are fused first, then each X branch is processed in
+       * parallel (with concurrency access) under a single lock: payloads are
+       * subtracted in place (V operator-) and voxels rejected by the
+       * deintegration filter are erased, pruning the columns and X branches
+       * left empty. Missing voxels are skipped.
+       * @param voxels voxels to deintegrate
+       * @return number of erased voxels
+       */
+  virtual long deintegrateVoxels(const std::vector<IndexedVoxel> &voxels) {
+    std::vector<SourceVoxel> footprint(voxels.size());
+    std::vector<char> valid(voxels.size());
+#pragma omp parallel for
+    for (long i = 0; i < long(voxels.size()); i++) {
+      footprint[i] = SourceVoxel(voxels[i].ix, voxels[i].iy, voxels[i].iz,
+                                 *voxels[i].data);
+      valid[i] = isValidIndex(voxels[i].ix, voxels[i].iy, voxels[i].iz);
+    }
+    _foldFootprint(footprint, valid);
+    return _deintegrateFootprint(footprint);
+  }
+
+  /**
+       * Deintegrates a batch of voxels given in coordinates, see
+       * deintegrateVoxels.
+       * @return number of erased voxels
+       */
+  long deintegrateVoxels(const std::vector<Voxel3D> &voxels) {
+    std::vector<IndexedVoxel> indexed(voxels.size());
+    long size = 0;
+    for (long i = 0; i < long(voxels.size()); i++) {
+      IndexedVoxel &voxel = indexed[size];
+      if (coordinatesToIndex(voxels[i].x, voxels[i].y, voxels[i].z, voxel.ix,
+                             voxel.iy, voxel.iz)) {
+        voxel.data = voxels[i].data;
+        size++;
+      }
+    }
+    indexed.resize(size);
+    return deintegrateVoxels(indexed);
+  }
+
+  /**
+       * Sets the filter deciding which voxels survive a deintegration, the
+       * rejected ones are erased (e.g. PositiveWeightFilter erases voxels
+       * whose weight reached zero). Without filter no voxel is erased.
+       * @param keep functor bool(const V *) applied to the deintegrated data
+       */
+  virtual void
+  setDeintegrationFilter(const std::function<bool(const V *)> &keep) {
+    _deintegration_filter = keep;
+  }
+
   /**
        *
        * @return
@@ -330,235 +642,2002 @@ public:
   }
 
   /**
-       *
-       * @param voxels
+       * Fetches all voxels with a two-pass parallel gather (see
+       * parallelGatherBounded). Capacity of 'voxels' is reused across calls.
+       * @param voxels OUTPUT voxels
        */
   virtual void fetchVoxels(std::vector<Voxel3D> &voxels) {
-    voxels.clear();
     std::vector<typename X_NODE::NodeType *> xnodes;
     _root_list->retrieveNodes(xnodes);
 
-#pragma omp parallel
-    {
-      std::vector<Voxel3D> voxels_private;
-
-#pragma omp for nowait
-      for (int i = 0; i < xnodes.size(); i++) {
-        K ix, iy, iz;
-        D x, y, z;
-        std::vector<typename Y_NODE::NodeType *> ynodes;
-        xnodes[i]->value->retrieveNodes(ynodes);
-        for (int j = 0; j < ynodes.size(); j++) {
+    parallelGatherBounded(
+        int(xnodes.size()),
+        [&](int i) {
+          long count = 0;
+          std::vector<typename Y_NODE::NodeType *> ynodes;
+          xnodes[i]->value->retrieveNodes(ynodes);
+          for (int j = 0; j < ynodes.size(); j++) {
+            count += ynodes[j]->value->getSize();
+          }
+          return count;
+        },
+        [&](int i, Voxel3D *output, long capacity) {
+          long written = 0;
+          K ix, iy, iz;
+          D x, y, z;
+          std::vector<typename Y_NODE::NodeType *> ynodes;
           std::vector<typename Z_NODE::NodeType *> znodes;
-          ynodes[j]->value->retrieveNodes(znodes);
+          xnodes[i]->value->retrieveNodes(ynodes);
+          for (int j = 0; j < ynodes.size(); j++) {
+            ynodes[j]->value->retrieveNodes(znodes);
 
-          for (int k = 0; k < znodes.size(); k++) {
-            ix = xnodes[i]->key;
-            iy = ynodes[j]->key;
-            iz = znodes[k]->key;
-            indexToCoordinates(ix, iy, iz, x, y, z);
+            for (int k = 0; k < znodes.size(); k++) {
+              ix = xnodes[i]->key;
+              iy = ynodes[j]->key;
+              iz = znodes[k]->key;
+              indexToCoordinates(ix, iy, iz, x, y, z);
 
-            voxels_private.push_back(Voxel3D(x, y, z, znodes[k]->value));
+              if (written < capacity)
+                output[written++] = Voxel3D(x, y, z, znodes[k]->value);
+            }
           }
-        }
-      }
+          return written;
+        },
+        voxels);
+  }
+
+  /**
+       * Visits in parallel the voxels whose center lies inside a camera
+       * frustum. X range comes from the frustum bounds, then each X column
+       * clips its Y range and each (X,Y) column its Z range against the
+       * frustum before descending, so lists outside the frustum are never
+       * walked. The visitor is called concurrently and must be thread safe.
+       * @param frustum camera frustum in map frame
+       * @param visitor functor void(const Voxel3D &)
+       * @param predicate functor bool(const V *)
+       */
+  template <class VISITOR, class PREDICATE>
+  void forEachVoxelInFrustum(const Frustum<D> &frustum, VISITOR visitor,
+                             PREDICATE predicate) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveFrustumRange(frustum, xnodes);
 
-#pragma omp critical
-      voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < xnodes.size(); i++) {
+      _visitFrustumColumn(xnodes[i], frustum, predicate,
+                          [&](const Voxel3D &voxel) { visitor(voxel); });
     }
   }
 
   /**
-       * Radius search
-       * @param cx
-       * @param cy
-       * @param cz
-       * @param radiusx
-       * @param radiusy
-       * @param radiusz
-       * @param voxels
-       * @param boxed
+       * Frustum search, see forEachVoxelInFrustum. Results are gathered with
+       * a two-pass parallel gather.
+       * @param frustum camera frustum in map frame
+       * @param voxels OUTPUT visible voxels
+       * @param predicate functor bool(const V *)
        */
-  virtual void radiusSearch(K cx, K cy, K cz, K radiusx, K radiusy, K radiusz,
-                            std::vector<Voxel3D> &voxels, bool boxed = false) {
-    voxels.clear();
+  template <class PREDICATE>
+  void frustumSearch(const Frustum<D> &frustum, std::vector<Voxel3D> &voxels,
+                     PREDICATE predicate) {
     std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveFrustumRange(frustum, xnodes);
 
-    K ix_min = cx - radiusx;
-    K ix_max = cx + radiusx;
-    K iy_min = cy - radiusy;
-    K iy_max = cy + radiusy;
-    K iz_min = cz - radiusz;
-    K iz_max = cz + radiusz;
+    parallelGatherBounded(
+        int(xnodes.size()),
+        [&](int i) {
+          long count = 0;
+          _visitFrustumColumn(xnodes[i], frustum, predicate,
+                              [&](const Voxel3D &) { count++; });
+          return count;
+        },
+        [&](int i, Voxel3D *output, long capacity) {
+          long written = 0;
+          _visitFrustumColumn(xnodes[i], frustum, predicate,
+                              [&](const Voxel3D &voxel) {
+                                if (written < capacity)
+                                  output[written++] = voxel;
+                              });
+          return written;
+        },
+        voxels);
+  }
 
-    _root_list->retrieveNodesByRange(ix_min, ix_max, xnodes);
+  /**
+       * Frustum search of a pinhole camera.
+       * @param fx focal length x
+       * @param fy focal length y
+       * @param cx principal point x
+       * @param cy principal point y
+       * @param width image width
+       * @param height image height
+       * @param pose camera to map rigid transform, 4x4 row-major
+       * @param near_plane near plane depth
+       * @param far_plane far plane depth
+       * @param voxels OUTPUT visible voxels
+       */
+  virtual void frustumSearch(D fx, D fy, D cx, D cy, int width, int height,
+                             const D pose[16], D near_plane, D far_plane,
+                             std::vector<Voxel3D> &voxels) {
+    frustumSearch(Frustum<D>(fx, fy, cx, cy, width, height, pose, near_plane,
+                             far_plane),
+                  voxels, AllVoxelsFilter<V>());
+  }
 
-    D rx, ry, rz, radius;
-    D centerx, centery, centerz;
+  /**
+       * Casts a ray and returns the first voxel accepted by the predicate.
+       * Cells are stepped by 3D DDA, but lists are looked up only once per
+       * X branch and per (X,Y) column crossed: missing X branches and
+       * columns are crossed without lookups and, inside a column, the Z list
+       * is searched once for the first voxel of the crossed Z range.
+       * @param ox ray origin x
+       * @param oy ray origin y
+       * @param oz ray origin z
+       * @param dx ray direction x
+       * @param dy ray direction y
+       * @param dz ray direction z
+       * @param max_range max distance from the origin
+       * @param hit OUTPUT first hit, if any
+       * @param predicate functor bool(const V *)
+       * @return TRUE if a voxel was hit
+       */
+  template <class PREDICATE>
+  bool castRayIf(D ox, D oy, D oz, D dx, D dy, D dz, D max_range,
+                 RayHit &hit, PREDICATE predicate) {
+    hit = RayHit();
+    double norm =
+        std::sqrt(double(dx) * dx + double(dy) * dy + double(dz) * dz);
+    if (norm <= 0)
+      return false;
 
-    indexToCoordinates(radiusx, radiusy, radiusz, rx, ry, rz);
-    indexToCoordinates(cx, cy, cz, centerx, centery, centerz);
-    radius = (rx + ry + rz) / 3.0;
+    const D origin[3] = {ox, oy, oz};
+    const double direction[3] = {dx / norm, dy / norm, dz / norm};
+    const D resolution[3] = {_resolution_x, _resolution_y, _resolution_z};
+    long index[3];
+    int step[3];
+    double t_max[3], t_delta[3];
+    const double inf = std::numeric_limits<double>::infinity();
+    for (int a = 0; a < 3; a++) {
+      // same rounding as coordinatesToIndex
+      index[a] = long(floor(origin[a] / resolution[a]));
+      step[a] = direction[a] > 0 ? 1 : (direction[a] < 0 ? -1 : 0);
+      if (step[a] == 0) {
+        t_max[a] = t_delta[a] = inf;
+      } else {
+        double boundary = (index[a] + (step[a] > 0 ? 1 : 0)) * resolution[a];
+        t_max[a] = (boundary - origin[a]) / direction[a];
+        t_delta[a] = resolution[a] / std::fabs(direction[a]);
+      }
+    }
 
-#pragma omp parallel
-    {
-      std::vector<Voxel3D> voxels_private;
+    double t = 0;
+    while (t <= max_range && _validIndex(index[0]) && _validIndex(index[1]) &&
+           _validIndex(index[2])) {
+      const typename X_NODE::NodeType *xnode = _root_list->find(K(index[0]));
+      const typename Y_NODE::NodeType *ynode =
+          xnode != NULL ? xnode->value->find(K(index[1])) : NULL;
 
-#pragma omp for nowait
-      for (int i = 0; i < xnodes.size(); i++) {
-        K ix, iy, iz;
-        D x, y, z;
-        D distance;
-        std::vector<typename Y_NODE::NodeType *> ynodes;
-        xnodes[i]->value->retrieveNodesByRange(iy_min, iy_max, ynodes);
-        for (int j = 0; j < ynodes.size(); j++) {
-          std::vector<typename Z_NODE::NodeType *> znodes;
-          ynodes[j]->value->retrieveNodesByRange(iz_min, iz_max, znodes);
-          ix = xnodes[i]->key;
-          iy = ynodes[j]->key;
-
-          for (int k = 0; k < znodes.size(); k++) {
-            iz = znodes[k]->key;
-            indexToCoordinates(ix, iy, iz, x, y, z);
-            if (!boxed) {
-              distance = sqrt(pow(centerx - x, 2) + pow(centery - y, 2) +
-                              pow(centerz - z, 2));
-              if (distance > radius)
-                continue;
-            }
-            voxels_private.push_back(Voxel3D(x, y, z, znodes[k]->value));
+      // leaves the current column (or X branch, if missing) at t_exit
+      int exit_axis = xnode == NULL || t_max[0] <= t_max[1] ? 0 : 1;
+      double t_exit = std::min(t_max[exit_axis], double(max_range));
+
+      // Z cells crossed inside the column
+      long z_first = index[2];
+      double z_entry = t;
+      while (t_max[2] < t_exit) {
+        index[2] += step[2];
+        t_max[2] += t_delta[2];
+      }
+
+      if (ynode != NULL) {
+        typename Z_NODE::NodeType *znode =
+            _firstInRange(ynode->value, K(z_first), K(index[2]), step[2],
+                          predicate);
+        if (znode != NULL) {
+          if (znode->key != z_first) {
+            z_entry = t_max[2] - (std::labs(long(index[2]) - znode->key) + 1) *
+                                     t_delta[2];
           }
+          if (z_entry > max_range)
+            return false;
+          D x, y, z;
+          indexToCoordinates(K(index[0]), K(index[1]), znode->key, x, y, z);
+          hit.voxel = Voxel3D(x, y, z, znode->value);
+          hit.distance = D(z_entry);
+          return true;
         }
       }
 
-#pragma omp critical
-      voxels.insert(voxels.end(), voxels_private.begin(), voxels_private.end());
+      if (xnode == NULL) {
+        // crosses Y cells without lookups up to the next X branch, or up to
+        // max_range if the ray never leaves this one (no X component)
+        double y_exit = std::min(t_max[0], double(max_range));
+        while (t_max[1] < y_exit) {
+          index[1] += step[1];
+          t_max[1] += t_delta[1];
+        }
+      }
+      t = t_max[exit_axis];
+      if (t > max_range)
+        return false;
+      index[exit_axis] += step[exit_axis];
+      t_max[exit_axis] += t_delta[exit_axis];
     }
+    return false;
   }
 
   /**
-       *
-       * @param cx
-       * @param cy
-       * @param cz
-       * @param radiusx
-       * @param radiusy
-       * @param radiusz
-       * @param voxels
-       * @param boxed
+       * Casts a ray against voxels with weight >= min_weight.
+       * @return TRUE if a voxel was hit
        */
-  virtual void radiusSearch(D cx, D cy, D cz, D radiusx, D radiusy, D radiusz,
-                            std::vector<Voxel3D> &voxels, bool boxed = false) {
-    K ix, iy, iz;
-    if (coordinatesToIndex(cx, cy, cz, ix, iy, iz)) {
-      K iradiusx, iradiusy, iradiusz;
-      iradiusx = K(floor(radiusx / _resolution_x));
-      iradiusy = K(floor(radiusy / _resolution_y));
-      iradiusz = K(floor(radiusz / _resolution_z));
-      radiusSearch(ix, iy, iz, iradiusx, iradiusy, iradiusz, voxels, boxed);
+  bool castRay(D ox, D oy, D oz, D dx, D dy, D dz, D max_range, RayHit &hit,
+               D min_weight = D(0)) {
+    return castRayIf(ox, oy, oz, dx, dy, dz, max_range, hit,
+                     MinWeightFilter<V>(min_weight));
+  }
+
+  /**
+       * Batched ray casting, rays are cast in parallel.
+       * @param rays rays to cast
+       * @param max_range max distance from ray origins
+       * @param hits OUTPUT one result per ray
+       * @param predicate functor bool(const V *)
+       */
+  template <class PREDICATE>
+  void castRaysIf(const std::vector<Ray> &rays, D max_range,
+                  std::vector<RayHit> &hits, PREDICATE predicate) {
+    hits.resize(rays.size());
+
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < rays.size(); i++) {
+      const Ray &ray = rays[i];
+      castRayIf(ray.ox, ray.oy, ray.oz, ray.dx, ray.dy, ray.dz, max_range,
+                hits[i], predicate);
     }
   }
 
   /**
-       *
-       * @return
+       * Batched ray casting against voxels with weight >= min_weight.
        */
-  virtual long sizeInBytes() { return _bytes_counter; }
+  void castRays(const std::vector<Ray> &rays, D max_range,
+                std::vector<RayHit> &hits, D min_weight = D(0)) {
+    castRaysIf(rays, max_range, hits, MinWeightFilter<V>(min_weight));
+  }
 
   /**
-       *
-       * @param filename
+       * Integer axis aligned box query. Voxels are returned with their
+       * indices, no coordinates are computed.
+       * @param box index box, bounds included
+       * @param voxels OUTPUT voxels
        */
-  virtual void saveToFile(std::string filename) {
-    std::vector<Voxel3D> voxels;
-    fetchVoxels(voxels);
+  void boxSearch(const IndexBox &box, std::vector<IndexedVoxel> &voxels) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveRange(_root_list, box.min_x, box.max_x, xnodes);
+    AllVoxelsFilter<V> all;
 
-    std::ofstream f;
-    f.open(filename);
-    V a1;
-    K a2;
-    D a3;
-    f << "# SkipListMapV2<" << typeid(a1).name() << "," << typeid(a2).name()
-      << "," << typeid(a3).name() << ">" << std::endl;
-    f << _min_index_value << " " << _max_index_value << " ";
-    f << _resolution_x << " ";
-    f << _resolution_y << " ";
-    f << _resolution_z << std::endl;
-    for (int i = 0; i < voxels.size(); i++) {
-      f << voxels[i] << std::endl;
-    }
-    f.close();
+    parallelGatherBounded(
+        int(xnodes.size()),
+        [&](int i) {
+          long count = 0;
+          _visitColumn(xnodes[i], box, all,
+                       [&](K ix, K iy, K iz, V *data) { count++; });
+          return count;
+        },
+        [&](int i, IndexedVoxel *output, long capacity) {
+          long written = 0;
+          _visitColumn(xnodes[i], box, all, [&](K ix, K iy, K iz, V *data) {
+            if (written < capacity)
+              output[written++] = IndexedVoxel(ix, iy, iz, data);
+          });
+          return written;
+        },
+        voxels);
   }
 
   /**
+       * Axis aligned box query in coordinates, box is converted once to
+       * indices (see boxSearch).
+       * @param voxels OUTPUT voxels
        */
-  virtual void loadFromFile(std::string filename) {
-    std::ifstream input_file(filename.c_str());
-    if (input_file.is_open()) {
-    }
-    // Load Files
-    std::string line;
-
-    bool header_found = false;
+  virtual void boxSearch(D min_x, D min_y, D min_z, D max_x, D max_y, D max_z,
+                         std::vector<Voxel3D> &voxels) {
+    fetchVoxels(voxels, AllVoxelsFilter<V>(),
+                _coordinatesBox(min_x, min_y, min_z, max_x, max_y, max_z));
+  }
 
-    while (std::getline(input_file, line)) {
-      std::istringstream iss(line);
-      if (line.length() > 0 && line.at(0) == '#')
-        continue;
+  /**
+       * Removes every voxel inside an index box. Columns and X branches
+       * falling entirely inside the box are unlinked as whole sublists
+       * (SkipList::eraseRange) and freed with their content, partially
+       * covered columns lose only the Z range of the box. X branches are
+       * processed in parallel.
+       * @param box index box, bounds included
+       * @return number of removed voxels
+       */
+  virtual long eraseRegion(const IndexBox &box) {
+    _ownRoot();
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveRange(_root_list, box.min_x, box.max_x, xnodes);
+    std::vector<K> emptied(xnodes.size());
+    std::vector<char> is_emptied(xnodes.size(), 0);
+    long removed = 0;
 
-      if (!header_found) {
-        K min, max;
-        iss >> min;
-        iss >> max;
-        iss >> _resolution_x;
-        iss >> _resolution_y;
-        iss >> _resolution_z;
-        initialize(min, max);
-        header_found = true;
-        continue;
+#pragma omp parallel for schedule(dynamic) reduction(+ : removed)
+    for (int i = 0; i < xnodes.size(); i++) {
+      K ix = xnodes[i]->key;
+      if (this->hasConcurrencyAccess())
+        this->_root_list->lock(ix);
+      removed += _eraseBranchRegion(ix, _writableBranch(ix, xnodes[i]->value),
+                                    box);
+      if (xnodes[i]->value->empty()) {
+        emptied[i] = ix;
+        is_emptied[i] = 1;
       }
+      if (this->hasConcurrencyAccess())
+        this->_root_list->unlock(ix);
+    }
 
-      if (header_found) {
-        Voxel3D voxel;
-        iss >> voxel;
-        this->integrateVoxel(voxel.x, voxel.y, voxel.z, voxel.data);
+    for (int i = 0; i < xnodes.size(); i++) {
+      if (is_emptied[i]) {
+        Y_NODE *ylist = xnodes[i]->value;
+        _epochs->retire(_root_list->unlink(emptied[i]));
+        _releaseBranch(*_epochs, ylist);
       }
     }
-  }
 
-  virtual void enableConcurrencyAccess(bool status = true) {
-    this->_self_concurrency_management = status;
+#pragma omp atomic
+    _voxel_counter -= int(removed);
+    _epochs->reclaim();
+    return removed;
   }
 
-  virtual bool hasConcurrencyAccess() {
-    return this->_self_concurrency_management;
+  /**
+       * Removes every voxel inside a box given in coordinates.
+       * @return number of removed voxels
+       */
+  virtual long clearBox(D min_x, D min_y, D min_z, D max_x, D max_y,
+                        D max_z) {
+    return eraseRegion(
+        _coordinatesBox(min_x, min_y, min_z, max_x, max_y, max_z));
   }
 
-protected:
   /**
-       *
-       * @param ylist
+       * Merges another map with the same resolution into this one, e.g. maps
+       * of several sessions or robots. Each X branch of the other map is
+       * handled in parallel: branches missing here are copied whole, the
+       * others are merged walking both Y lists and then both Z lists once in
+       * key order, so no voxel costs a descent from the root. Voxels present
+       * in both maps are combined by the fusion policy, the other ones
+       * copied. Branches shared with snapshots are cloned first.
+       * @param other map to merge, left untouched. It must not be written
+       * meanwhile: merge other.snapshot() if it is still being integrated
+       * @param fusion functor V(const V &mine, const V &theirs), see
+       * VoxelFusion.hpp
+       * @return FALSE if the resolutions differ
+       */
+  template <class FUSION> bool merge(SkipListMapV2 &other, FUSION fusion) {
+    if (&other == this || other._resolution_x != _resolution_x ||
+        other._resolution_y != _resolution_y ||
+        other._resolution_z != _resolution_z)
+      return false;
+
+    _ownRoot();
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    other._root_list->retrieveNodes(xnodes);
+    long added = 0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : added)
+    for (int i = 0; i < xnodes.size(); i++) {
+      K ix = xnodes[i]->key;
+      bool concurrency = this->hasConcurrencyAccess();
+      if (concurrency)
+        this->_root_list->lock(ix);
+      const typename X_NODE::NodeType *xnode = _root_list->find(ix);
+      if (xnode == NULL) {
+        Y_NODE *ylist = new Y_NODE(_min_index_value, _max_index_value);
+        added += _mergeBranch(ix, ylist, xnodes[i]->value, fusion);
+        // the threads of the merge link branches concurrently: the root is
+        // locked for the insert even without concurrency access
+        if (!concurrency)
+          this->_root_list->lock(ix);
+        _root_list->insert(ix, ylist);
+        if (!concurrency)
+          this->_root_list->unlock(ix);
+      } else {
+        added += _mergeBranch(ix, _writableBranch(ix, xnode->value),
+                              xnodes[i]->value, fusion);
+      }
+      if (this->hasConcurrencyAccess())
+        this->_root_list->unlock(ix);
+    }
+
+#pragma omp atomic
+    _voxel_counter += int(added);
+    return true;
+  }
+
+  /**
+       * Merges another map summing common voxels (SumFusion).
+       */
+  bool merge(SkipListMapV2 &other) { return merge(other, SumFusion<V>()); }
+
+  /**
+       * Integrates the voxels of a source (e.g. a keyframe cloud already in
+       * map frame) remembering what the source added to each voxel, so that
+       * it can be moved later (transformSource) without its raw data. The
+       * footprint of each source is kept compressed (VoxelFootprint).
+       * Voxels falling in the same cell are fused first, then each X branch
+       * is integrated in parallel, with concurrency access enabled.
+       * @param source source name, integrating twice accumulates
+       * @param voxels voxels in map coordinates
+       * @return number of voxels touched
+       */
+  long integrateSource(const std::string &source,
+                       const std::vector<Voxel3D> &voxels) {
+    std::vector<SourceVoxel> footprint(voxels.size());
+    std::vector<char> valid(voxels.size());
+#pragma omp parallel for
+    for (long i = 0; i < long(voxels.size()); i++) {
+      SourceVoxel &entry = footprint[i];
+      valid[i] = coordinatesToIndex(voxels[i].x, voxels[i].y, voxels[i].z,
+                                    entry.ix, entry.iy, entry.iz);
+      entry.data = *voxels[i].data;
+    }
+    _foldFootprint(footprint, valid);
+    _scatterFootprint(footprint);
+
+    _storeSource(source, footprint);
+    return footprint.size();
+  }
+
+  /**
+       * Replaces the contribution of a source, e.g. a keyframe cloud
+       * integrated again under its corrected pose after a loop closure:
+       * what the source added is removed and 'voxels' becomes its whole
+       * contribution. Unknown sources are just integrated.
+       * @param source source name
+       * @param voxels voxels in map coordinates
+       * @return number of voxels touched
+       */
+  long replaceSource(const std::string &source,
+                     const std::vector<Voxel3D> &voxels) {
+    std::vector<SourceVoxel> footprint;
+    if (_takeSource(source, footprint))
+      deintegrateVoxels(_indexedFootprint(footprint));
+    return integrateSource(source, voxels);
+  }
+
+  /**
+       * Moves a source by a rigid transform, e.g. a keyframe after a loop
+       * closure: its contribution is removed from the voxels it was in and
+       * integrated in the transformed ones, each resampled to the voxel
+       * containing its transformed center. Only the stored contributions
+       * are used, no raw data is needed, but every call quantizes the
+       * centers again: errors add up over repeated corrections and moves
+       * under half a voxel are lost. Sources whose raw data is still
+       * available should be moved with replaceSource.
+       * @param source source name
+       * @param transform rigid transform, 4x4 row-major, from the current
+       * source placement to the new one (new_pose * old_pose^-1)
+       * @return FALSE if the source is unknown
+       */
+  bool transformSource(const std::string &source, const D transform[16]) {
+    std::vector<SourceVoxel> footprint;
+    if (!_takeSource(source, footprint))
+      return false;
+    deintegrateVoxels(_indexedFootprint(footprint));
+
+    std::vector<char> valid(footprint.size());
+#pragma omp parallel for
+    for (long i = 0; i < long(footprint.size()); i++) {
+      SourceVoxel &entry = footprint[i];
+      D p[3], q[3];
+      indexToCoordinates(entry.ix, entry.iy, entry.iz, p[0], p[1], p[2]);
+      for (int r = 0; r < 3; r++) {
+        q[r] = transform[r * 4] * p[0] + transform[r * 4 + 1] * p[1] +
+               transform[r * 4 + 2] * p[2] + transform[r * 4 + 3];
+      }
+      valid[i] =
+          coordinatesToIndex(q[0], q[1], q[2], entry.ix, entry.iy, entry.iz);
+    }
+    _foldFootprint(footprint, valid);
+    _scatterFootprint(footprint);
+
+    _storeSource(source, footprint);
+    return true;
+  }
+
+  /**
+       * Removes the contribution of a source from the map and forgets it.
+       * @param source source name
+       * @return FALSE if the source is unknown
+       */
+  bool deintegrateSource(const std::string &source) {
+    std::vector<SourceVoxel> footprint;
+    if (!_takeSource(source, footprint))
+      return false;
+    deintegrateVoxels(_indexedFootprint(footprint));
+    return true;
+  }
+
+  /**
+       * @return TRUE if the source has been integrated with integrateSource
+       */
+  bool hasSource(const std::string &source) {
+    boost::mutex::scoped_lock lock(_sources_mutex);
+    return _sources.count(source) > 0;
+  }
+
+  /**
+       * Decodes the footprint of a source: its voxels sorted by key, each
+       * with the contribution of the source.
+       * @param source source name
+       * @param footprint OUTPUT footprint
+       * @return FALSE if the source is unknown
+       */
+  bool fetchSource(const std::string &source,
+                   std::vector<SourceVoxel> &footprint) {
+    boost::mutex::scoped_lock lock(_sources_mutex);
+    typename std::map<std::string, VoxelFootprint<K, V> >::iterator it =
+        _sources.find(source);
+    if (it == _sources.end())
+      return false;
+    it->second.decode(footprint);
+    return true;
+  }
+
+  /**
+       * @return bytes used by the compressed footprints of all sources
+       */
+  long sourcesBytes() {
+    boost::mutex::scoped_lock lock(_sources_mutex);
+    long bytes = 0;
+    typename std::map<std::string, VoxelFootprint<K, V> >::iterator it;
+    for (it = _sources.begin(); it != _sources.end(); ++it)
+      bytes += it->second.bytes();
+    return bytes;
+  }
+
+  /**
+       * Columns removed after target version, for delta consumers of
+       * fetchChangedSince.
+       * @param version last version seen by the consumer
+       * @param columns OUTPUT erased columns
+       * @return FALSE if removals after version were already pruned (see
+       * pruneErasedUpTo): the consumer must rebuild its state from scratch
+       */
+  bool fetchErasedSince(Version version, std::vector<ErasedColumn> &columns) {
+    boost::mutex::scoped_lock lock(_erased_mutex);
+    columns.clear();
+    if (version < _erased_horizon)
+      return false;
+    for (size_t i = 0; i < _erased_columns.size(); i++) {
+      if (_erased_columns[i].version > version)
+        columns.push_back(_erased_columns[i]);
+    }
+    return true;
+  }
+
+  /**
+       * Forgets the removals up to target version, which grow with every
+       * erased column otherwise. Consumers that already got past version
+       * are unaffected, older ones get FALSE from fetchErasedSince.
+       * @param version oldest version still needed by the consumers
+       */
+  void pruneErasedUpTo(Version version) {
+    boost::mutex::scoped_lock lock(_erased_mutex);
+    size_t kept = 0;
+    for (size_t i = 0; i < _erased_columns.size(); i++) {
+      if (_erased_columns[i].version > version)
+        _erased_columns[kept++] = _erased_columns[i];
+    }
+    _erased_columns.erase(_erased_columns.begin() + kept,
+                          _erased_columns.end());
+    _erased_horizon = std::max(_erased_horizon, version);
+  }
+
+  /**
+       * Current map version. Every modification is stamped with it on the
+       * touched (X,Y) column, until commitVersion closes it.
+       * @return current version
+       */
+  Version getVersion() { return _version.load(); }
+
+  /**
+       * Closes the current version: later modifications get a greater one.
+       * A consumer stores the returned value and passes it to
+       * fetchChangedSince on its next update.
+       * @return the version just closed
+       */
+  Version commitVersion() { return _version.fetch_add(1); }
+
+  /**
+       * Version of the most recent modification of the map, 0 if empty.
+       */
+  Version lastModifiedVersion() {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _root_list->retrieveNodes(xnodes);
+    Version last = 0;
+    for (int i = 0; i < xnodes.size(); i++) {
+      last = std::max(last, xnodes[i]->value->version);
+    }
+    return last;
+  }
+
+  /**
+       * Fetches the voxels of the (X,Y) columns modified after target version.
+       * Columns are the unit of change: every voxel of a dirty column is
+       * returned, so a consumer replaces the whole column content. X branches
+       * and columns not modified since 'version' are skipped without being
+       * visited.
+       * @param version last version seen by the consumer
+       * @param voxels OUTPUT voxels of the dirty columns
+       */
+  virtual void fetchChangedSince(Version version,
+                                 std::vector<Voxel3D> &voxels) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveChangedBranches(version, xnodes);
+
+    parallelGatherBounded(
+        int(xnodes.size()),
+        [&](int i) {
+          long count = 0;
+          std::vector<typename Y_NODE::NodeType *> ynodes;
+          xnodes[i]->value->retrieveNodes(ynodes);
+          for (int j = 0; j < ynodes.size(); j++) {
+            if (ynodes[j]->value->version > version)
+              count += ynodes[j]->value->getSize();
+          }
+          return count;
+        },
+        [&](int i, Voxel3D *output, long capacity) {
+          long written = 0;
+          D x, y, z;
+          std::vector<typename Y_NODE::NodeType *> ynodes;
+          std::vector<typename Z_NODE::NodeType *> znodes;
+          xnodes[i]->value->retrieveNodes(ynodes);
+          for (int j = 0; j < ynodes.size(); j++) {
+            if (ynodes[j]->value->version <= version)
+              continue;
+            ynodes[j]->value->retrieveNodes(znodes);
+            for (int k = 0; k < znodes.size(); k++) {
+              indexToCoordinates(xnodes[i]->key, ynodes[j]->key,
+                                 znodes[k]->key, x, y, z);
+              if (written < capacity)
+                output[written++] = Voxel3D(x, y, z, znodes[k]->value);
+            }
+          }
+          return written;
+        },
+        voxels);
+  }
+
+  /**
+       * Visits voxels in parallel, X columns being distributed among threads.
+       * No intermediate voxel list is built: the predicate is evaluated on
+       * each voxel of the region and the visitor is called only for the
+       * matching ones. Both are template functors, so they are inlined in
+       * the traversal.
+       * The visitor is called concurrently and must be thread safe.
+       * @param visitor functor void(const Voxel3D &)
+       * @param predicate functor bool(const V *)
+       * @param region index box to visit
+       */
+  template <class VISITOR, class PREDICATE>
+  void forEachVoxel(VISITOR visitor, PREDICATE predicate,
+                    const IndexBox &region = IndexBox()) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveRange(_root_list, region.min_x, region.max_x, xnodes);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < xnodes.size(); i++) {
+      _visitColumn(xnodes[i], region, predicate,
+                   [&](K ix, K iy, K iz, V *data) {
+                     D x, y, z;
+                     indexToCoordinates(ix, iy, iz, x, y, z);
+                     visitor(Voxel3D(x, y, z, data));
+                   });
+    }
+  }
+
+  /**
+       * Visits all voxels in parallel.
+       * @param visitor functor void(const Voxel3D &)
+       */
+  template <class VISITOR> void forEachVoxel(VISITOR visitor) {
+    forEachVoxel(visitor, AllVoxelsFilter<V>());
+  }
+
+  /**
+       * Counts voxels matching a predicate, nothing is materialized. X
+       * branches are visited in parallel; once the count exceeds 'limit' the
+       * remaining ones are skipped, so checking a budget costs about the
+       * budget, not the whole map.
+       * @param predicate functor bool(const V *)
+       * @param limit count past which the traversal stops
+       * @return matching voxels, a value greater than limit if it stopped
+       */
+  template <class PREDICATE>
+  long countVoxels(PREDICATE predicate,
+                   long limit = std::numeric_limits<long>::max()) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _root_list->retrieveNodes(xnodes);
+    IndexBox region;
+    std::atomic<long> count(0);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < int(xnodes.size()); i++) {
+      if (count.load(std::memory_order_relaxed) > limit)
+        continue;
+      long branch_count = 0;
+      _visitColumn(xnodes[i], region, predicate,
+                   [&](K ix, K iy, K iz, V *data) { branch_count++; });
+      count += branch_count;
+    }
+    return count.load();
+  }
+
+  /**
+       * Fetches voxels matching a predicate inside a region. The predicate is
+       * pushed down into the traversal, so only matching voxels are
+       * materialized (see forEachVoxel and parallelGatherBounded).
+       * @param voxels OUTPUT voxels
+       * @param predicate functor bool(const V *)
+       * @param region index box to fetch
+       */
+  template <class PREDICATE>
+  void fetchVoxels(std::vector<Voxel3D> &voxels, PREDICATE predicate,
+                   const IndexBox &region = IndexBox()) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+    _retrieveRange(_root_list, region.min_x, region.max_x, xnodes);
+
+    parallelGatherBounded(
+        int(xnodes.size()),
+        [&](int i) {
+          long count = 0;
+          _visitColumn(xnodes[i], region, predicate,
+                       [&](K ix, K iy, K iz, V *data) { count++; });
+          return count;
+        },
+        [&](int i, Voxel3D *output, long capacity) {
+          long written = 0;
+          _visitColumn(xnodes[i], region, predicate,
+                       [&](K ix, K iy, K iz, V *data) {
+                         D x, y, z;
+                         indexToCoordinates(ix, iy, iz, x, y, z);
+                         if (written < capacity)
+                           output[written++] = Voxel3D(x, y, z, data);
+                       });
+          return written;
+        },
+        voxels);
+  }
+
+  /**
+       * Radius search. Results are gathered with a two-pass parallel gather
+       * (see parallelGatherBounded), capacity of 'voxels' is reused across
+       * calls.
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param radiusx
+       * @param radiusy
+       * @param radiusz
+       * @param voxels
+       * @param boxed
+       */
+  virtual void radiusSearch(K cx, K cy, K cz, K radiusx, K radiusy, K radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    std::vector<typename X_NODE::NodeType *> xnodes;
+
+    K ix_min = cx - radiusx;
+    K ix_max = cx + radiusx;
+    K iy_min = cy - radiusy;
+    K iy_max = cy + radiusy;
+    K iz_min = cz - radiusz;
+    K iz_max = cz + radiusz;
+
+    _root_list->retrieveNodesByRange(ix_min, ix_max, xnodes);
+
+    D rx, ry, rz, radius;
+    D centerx, centery, centerz;
+
+    indexToCoordinates(radiusx, radiusy, radiusz, rx, ry, rz);
+    indexToCoordinates(cx, cy, cz, centerx, centery, centerz);
+    radius = (rx + ry + rz) / 3.0;
+
+    // Visits voxels of a X column inside the search volume, writing at most
+    // 'capacity' of them if output is given
+    auto visit_column = [&](int i, Voxel3D *output, long capacity) {
+      long count = 0;
+      K ix, iy, iz;
+      D x, y, z;
+      D distance;
+      std::vector<typename Y_NODE::NodeType *> ynodes;
+      std::vector<typename Z_NODE::NodeType *> znodes;
+      xnodes[i]->value->retrieveNodesByRange(iy_min, iy_max, ynodes);
+      for (int j = 0; j < ynodes.size(); j++) {
+        ynodes[j]->value->retrieveNodesByRange(iz_min, iz_max, znodes);
+        ix = xnodes[i]->key;
+        iy = ynodes[j]->key;
+
+        for (int k = 0; k < znodes.size(); k++) {
+          iz = znodes[k]->key;
+          indexToCoordinates(ix, iy, iz, x, y, z);
+          if (!boxed) {
+            distance = sqrt(pow(centerx - x, 2) + pow(centery - y, 2) +
+                            pow(centerz - z, 2));
+            if (distance > radius)
+              continue;
+          }
+          if (output != NULL) {
+            if (count == capacity)
+              return count;
+            output[count] = Voxel3D(x, y, z, znodes[k]->value);
+          }
+          count++;
+        }
+      }
+      return count;
+    };
+
+    parallelGatherBounded(
+        int(xnodes.size()), [&](int i) { return visit_column(i, NULL, 0); },
+        [&](int i, Voxel3D *output, long capacity) {
+          return visit_column(i, output, capacity);
+        },
+        voxels);
+  }
+
+  /**
+       *
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param radiusx
+       * @param radiusy
+       * @param radiusz
+       * @param voxels
+       * @param boxed
+       */
+  virtual void radiusSearch(D cx, D cy, D cz, D radiusx, D radiusy, D radiusz,
+                            std::vector<Voxel3D> &voxels, bool boxed = false) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(cx, cy, cz, ix, iy, iz)) {
+      K iradiusx, iradiusy, iradiusz;
+      iradiusx = K(floor(radiusx / _resolution_x));
+      iradiusy = K(floor(radiusy / _resolution_y));
+      iradiusz = K(floor(radiusz / _resolution_z));
+      radiusSearch(ix, iy, iz, iradiusx, iradiusy, iradiusz, voxels, boxed);
+    }
+  }
+
+  /**
+       * K-Nearest Neighbours search. Each level of the hierarchy (X columns,
+       * Y rows, Z cells) is visited outward from the query index in
+       * increasing distance order, keeping the best K voxels in a bounded
+       * max-heap. A branch is abandoned as soon as its partial distance
+       * exceeds the current K-th best distance.
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param k number of neighbours
+       * @param voxels OUTPUT neighbours sorted by increasing distance
+       * @param distances OUTPUT euclidean distances of the neighbours
+       * @param filter functor bool(const V*) discarding unwanted voxels
+       * @param max_distance max euclidean distance of a neighbour
+       */
+  template <class F>
+  void nearestSearch(K cx, K cy, K cz, int k, std::vector<Voxel3D> &voxels,
+                     std::vector<D> &distances, F filter,
+                     D max_distance = std::numeric_limits<D>::max()) {
+    voxels.clear();
+    distances.clear();
+    if (k <= 0)
+      return;
+
+    std::priority_queue<NeighbourCandidate> heap;
+    D max_squared = max_distance < std::sqrt(std::numeric_limits<D>::max())
+                        ? max_distance * max_distance
+                        : std::numeric_limits<D>::max();
+
+    _visitOutward(
+        _root_list, cx, _resolution_x, D(0), heap, k, max_squared,
+        [&](typename X_NODE::NodeType *xnode, D dx2) {
+          _visitOutward(
+              xnode->value, cy, _resolution_y, dx2, heap, k, max_squared,
+              [&](typename Y_NODE::NodeType *ynode, D dxy2) {
+                _visitOutward(
+                    ynode->value, cz, _resolution_z, dxy2, heap, k,
+                    max_squared,
+                    [&](typename Z_NODE::NodeType *znode, D d2) {
+                      if (!filter(znode->value))
+                        return;
+                      heap.push(NeighbourCandidate(d2, xnode->key, ynode->key,
+                                                   znode->key, znode->value));
+                      if (long(heap.size()) > k)
+                        heap.pop();
+                    });
+              });
+        });
+
+    voxels.resize(heap.size());
+    distances.resize(heap.size());
+    for (int i = int(heap.size()) - 1; i >= 0; i--) {
+      const NeighbourCandidate &c = heap.top();
+      D x, y, z;
+      indexToCoordinates(c.ix, c.iy, c.iz, x, y, z);
+      voxels[i] = Voxel3D(x, y, z, c.data);
+      distances[i] = std::sqrt(c.squared_distance);
+      heap.pop();
+    }
+  }
+
+  /**
+       * K-Nearest Neighbours search without filtering.
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param k number of neighbours
+       * @param voxels OUTPUT neighbours sorted by increasing distance
+       */
+  virtual void nearestSearch(K cx, K cy, K cz, int k,
+                             std::vector<Voxel3D> &voxels) {
+    std::vector<D> distances;
+    nearestSearch(cx, cy, cz, k, voxels, distances, AllVoxelsFilter<V>());
+  }
+
+  /**
+       * K-Nearest Neighbours search by coordinates.
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param k number of neighbours
+       * @param voxels OUTPUT neighbours sorted by increasing distance
+       * @param distances OUTPUT euclidean distances of the neighbours
+       * @param filter functor bool(const V*) discarding unwanted voxels
+       * @param max_distance max euclidean distance of a neighbour
+       */
+  template <class F>
+  void nearestSearch(D cx, D cy, D cz, int k, std::vector<Voxel3D> &voxels,
+                     std::vector<D> &distances, F filter,
+                     D max_distance = std::numeric_limits<D>::max()) {
+    K ix, iy, iz;
+    if (coordinatesToIndex(cx, cy, cz, ix, iy, iz)) {
+      nearestSearch(ix, iy, iz, k, voxels, distances, filter, max_distance);
+    } else {
+      voxels.clear();
+      distances.clear();
+    }
+  }
+
+  /**
+       * K-Nearest Neighbours search by coordinates without filtering.
+       * @param cx
+       * @param cy
+       * @param cz
+       * @param k number of neighbours
+       * @param voxels OUTPUT neighbours sorted by increasing distance
+       */
+  virtual void nearestSearch(D cx, D cy, D cz, int k,
+                             std::vector<Voxel3D> &voxels) {
+    std::vector<D> distances;
+    nearestSearch(cx, cy, cz, k, voxels, distances, AllVoxelsFilter<V>());
+  }
+
+  /**
+       *
+       * @return
+       */
+  virtual long sizeInBytes() { return _bytes_counter; }
+
+  /**
+       * Number of voxels stored in the map.
+       */
+  virtual long voxelsCount() { return _voxel_counter; }
+
+  /**
+       *
+       * @param filename
+       */
+  virtual void saveToFile(std::string filename) {
+    std::vector<Voxel3D> voxels;
+    fetchVoxels(voxels);
+
+    std::ofstream f;
+    f.open(filename);
+    V a1;
+    K a2;
+    D a3;
+    f << "# SkipListMapV2<" << typeid(a1).name() << "," << typeid(a2).name()
+      << "," << typeid(a3).name() << ">" << std::endl;
+    f << _min_index_value << " " << _max_index_value << " ";
+    f << _resolution_x << " ";
+    f << _resolution_y << " ";
+    f << _resolution_z << std::endl;
+    for (int i = 0; i < voxels.size(); i++) {
+      f << voxels[i] << std::endl;
+    }
+    f.close();
+  }
+
+  /**
+       */
+  virtual void loadFromFile(std::string filename) {
+    std::ifstream input_file(filename.c_str());
+    if (input_file.is_open()) {
+    }
+    // Load Files
+    std::string line;
+
+    bool header_found = false;
+
+    while (std::getline(input_file, line)) {
+      std::istringstream iss(line);
+      if (line.length() > 0 && line.at(0) == '#')
+        continue;
+
+      if (!header_found) {
+        K min, max;
+        iss >> min;
+        iss >> max;
+        iss >> _resolution_x;
+        iss >> _resolution_y;
+        iss >> _resolution_z;
+        initialize(min, max);
+        header_found = true;
+        continue;
+      }
+
+      if (header_found) {
+        Voxel3D voxel;
+        iss >> voxel;
+        this->integrateVoxel(voxel.x, voxel.y, voxel.z, voxel.data);
+      }
+    }
+  }
+
+  virtual void enableConcurrencyAccess(bool status = true) {
+    this->_self_concurrency_management = status;
+  }
+
+  bool hasConcurrencyAccess() {
+    return this->_self_concurrency_management;
+  }
+
+  /**
+       * Enables reads concurrent with integration. Readers hold a ReadGuard
+       * on epochManager() while querying and see every voxel either before
+       * or after an update, never half written: updates of existing voxels
+       * build a new value and swap it in (read-copy-update), old values and
+       * erased nodes are retired and deleted by reclaim once no reader can
+       * reach them. Writers must still be serialized as usual
+       * (enableConcurrencyAccess).
+       * @param status
+       */
+  virtual void enableSnapshotReads(bool status = true) {
+    this->_snapshot_reads = status;
+  }
+
+  virtual bool hasSnapshotReads() { return this->_snapshot_reads; }
+
+  /**
+       * Epoch manager guarding readers of this map, e.g.
+       * ReadGuard guard(map->epochManager());
+       */
+  EpochManager &epochManager() { return *_epochs; }
+
+  /**
+       * Makes this map use another epoch manager, so that one ReadGuard
+       * covers several maps read together. Must be called before the map is
+       * shared with readers.
+       * @param epochs shared epoch manager
+       */
+  void shareEpochManager(const boost::shared_ptr<EpochManager> &epochs) {
+    _epochs->reclaim();
+    _epochs = epochs;
+  }
+
+  /**
+       * @return epoch manager of this map, to be shared with shareEpochManager
+       */
+  boost::shared_ptr<EpochManager> sharedEpochManager() { return _epochs; }
+
+  /**
+       * Deletes retired values and nodes no reader can reach anymore. To be
+       * called periodically by the writer (e.g. after each integration).
+       * @return number of deleted objects
+       */
+  int reclaim() { return _epochs->reclaim(); }
+
+protected:
+  /**
+       *
+       * @param ylist
        * @param iy
        * @param iz
        * @param data
        * @return
        */
-  bool _integrateXNode(const typename X_NODE::NodeType *ylist, K &iy, K &iz,
-                       V *data) {
-    const typename Y_NODE::NodeType *zlist = ylist->value->find(iy);
-    if (zlist == NULL) {
-      zlist = ylist->value->insert(
-          iy, new Z_NODE(_min_index_value, _max_index_value));
+  bool _integrateXNode(const typename X_NODE::NodeType *ylist, K &iy, K &iz,
+                       V *data) {
+    const typename Y_NODE::NodeType *zlist = ylist->value->find(iy);
+    if (zlist == NULL) {
+      zlist = ylist->value->insert(
+          iy, new Z_NODE(_min_index_value, _max_index_value));
+    }
+    const typename Z_NODE::NodeType *voxel = zlist->value->find(iz);
+    if (voxel == NULL) {
+      voxel = zlist->value->insert(iz, new V(data));
+    } else {
+      _fuseVoxel(zlist->value, voxel, data);
+    }
+    return true;
+  }
+
+  /**
+       * Collects X branches modified after target version.
+       * @param version
+       * @param xnodes OUTPUT X nodes
+       */
+  void _retrieveChangedBranches(
+      Version version, std::vector<typename X_NODE::NodeType *> &xnodes) {
+    std::vector<typename X_NODE::NodeType *> all;
+    _root_list->retrieveNodes(all);
+    xnodes.clear();
+    for (int i = 0; i < all.size(); i++) {
+      if (all[i]->value->version > version)
+        xnodes.push_back(all[i]);
+    }
+  }
+
+  /**
+       * Index range [min_index, max_index] of the cells overlapping the
+       * coordinate range [min_value, max_value], clamped to valid indices.
+       * @return FALSE if the range is empty
+       */
+  bool _indexRange(D min_value, D max_value, D resolution, K &min_index,
+                   K &max_index) {
+    double lo = std::floor(double(min_value) / resolution);
+    double hi = std::floor(double(max_value) / resolution);
+    lo = std::max(lo, double(_min_index_value));
+    hi = std::min(hi, double(_max_index_value));
+    if (lo > hi)
+      return false;
+    min_index = K(lo);
+    max_index = K(hi);
+    return true;
+  }
+
+  /**
+       * Collects X branches overlapping the frustum bounds.
+       */
+  void _retrieveFrustumRange(const Frustum<D> &frustum,
+                             std::vector<typename X_NODE::NodeType *> &xnodes) {
+    D min_point[3], max_point[3];
+    K min_x, max_x;
+    frustum.bounds(min_point, max_point);
+    xnodes.clear();
+    if (_indexRange(min_point[0], max_point[0], _resolution_x, min_x, max_x))
+      _retrieveRange(_root_list, min_x, max_x, xnodes);
+  }
+
+  /**
+       * Visits voxels of a X column inside a frustum, clipping Y and Z ranges
+       * with the frustum before descending.
+       */
+  template <class PREDICATE, class CALLBACK>
+  void _visitFrustumColumn(typename X_NODE::NodeType *xnode,
+                           const Frustum<D> &frustum, PREDICATE &predicate,
+                           CALLBACK callback) {
+    D inf = std::numeric_limits<D>::infinity();
+    D x0 = xnode->key * _resolution_x;
+    D x1 = x0 + _resolution_x;
+    D min_point[3], max_point[3];
+    K min_y, max_y, min_z, max_z;
+    if (!frustum.clippedBounds(x0, x1, -inf, inf, min_point, max_point) ||
+        !_indexRange(min_point[1], max_point[1], _resolution_y, min_y, max_y))
+      return;
+
+    Y_NODE *ylist = xnode->value;
+    typename Y_NODE::NodeType *ynode = ylist->lowerBound(min_y);
+    for (; ynode != NULL && ynode->key <= max_y; ynode = ylist->next(ynode)) {
+      D y0 = ynode->key * _resolution_y;
+      if (!frustum.clippedBounds(x0, x1, y0, y0 + _resolution_y, min_point,
+                                 max_point) ||
+          !_indexRange(min_point[2], max_point[2], _resolution_z, min_z,
+                       max_z))
+        continue;
+
+      Z_NODE *zlist = ynode->value;
+      typename Z_NODE::NodeType *znode = zlist->lowerBound(min_z);
+      for (; znode != NULL && znode->key <= max_z; znode = zlist->next(znode)) {
+        D x, y, z;
+        indexToCoordinates(xnode->key, ynode->key, znode->key, x, y, z);
+        if (frustum.contains(x, y, z) && predicate(znode->value)) {
+          callback(Voxel3D(x, y, z, znode->value));
+        }
+      }
     }
-    const typename Z_NODE::NodeType *voxel = zlist->value->find(iz);
-    if (voxel == NULL) {
-      voxel = zlist->value->insert(iz, new V(data));
+  }
+
+  /**
+       * @return TRUE if index is in the map index range
+       */
+  bool _validIndex(long index) {
+    return index >= _min_index_value && index <= _max_index_value;
+  }
+
+  /**
+       * First node, walking from 'from' to 'to' in the given direction,
+       * accepted by the predicate.
+       * @return node, NULL if there is none
+       */
+  template <class PREDICATE>
+  typename Z_NODE::NodeType *_firstInRange(Z_NODE *zlist, K from, K to,
+                                           int direction,
+                                           PREDICATE &predicate) {
+    if (direction >= 0) {
+      typename Z_NODE::NodeType *node = zlist->lowerBound(from);
+      for (; node != NULL && node->key <= to; node = zlist->next(node)) {
+        if (predicate(node->value))
+          return node;
+      }
+      return NULL;
+    }
+    typename Z_NODE::NodeType *node = zlist->lowerBound(from);
+    if (node == NULL || node->key != from)
+      node = zlist->predecessor(from);
+    for (; node != NULL && node->key >= to;
+         node = zlist->predecessor(node->key)) {
+      if (predicate(node->value))
+        return node;
+    }
+    return NULL;
+  }
+
+  /**
+       * Collects nodes of a list with keys in [min_key, max_key].
+       * @param list target list
+       * @param min_key
+       * @param max_key
+       * @param nodes OUTPUT nodes
+       */
+  template <class LIST>
+  void _retrieveRange(LIST *list, K min_key, K max_key,
+                      std::vector<typename LIST::NodeType *> &nodes) {
+    nodes.clear();
+    typename LIST::NodeType *node = list->lowerBound(min_key);
+    while (node != NULL && node->key <= max_key) {
+      nodes.push_back(node);
+      node = list->next(node);
+    }
+  }
+
+  /**
+       * Visits voxels of a X column inside a region, calling the callback
+       * with (ix, iy, iz, data) for those matching the predicate.
+       */
+  template <class PREDICATE, class CALLBACK>
+  void _visitColumn(typename X_NODE::NodeType *xnode, const IndexBox &region,
+                    PREDICATE &predicate, CALLBACK callback) {
+    Y_NODE *ylist = xnode->value;
+    typename Y_NODE::NodeType *ynode = ylist->lowerBound(region.min_y);
+    while (ynode != NULL && ynode->key <= region.max_y) {
+      Z_NODE *zlist = ynode->value;
+      typename Z_NODE::NodeType *znode = zlist->lowerBound(region.min_z);
+      while (znode != NULL && znode->key <= region.max_z) {
+        if (predicate(znode->value)) {
+          callback(xnode->key, ynode->key, znode->key, znode->value);
+        }
+        znode = zlist->next(znode);
+      }
+      ynode = ylist->next(ynode);
+    }
+  }
+
+  /**
+       * Candidate of the K-Nearest Neighbours heap, ordered by distance
+       */
+  struct NeighbourCandidate {
+    D squared_distance;
+    K ix, iy, iz;
+    V *data;
+
+    NeighbourCandidate(D squared_distance, K ix, K iy, K iz, V *data)
+        : squared_distance(squared_distance), ix(ix), iy(iy), iz(iz),
+          data(data) {}
+
+    bool operator<(const NeighbourCandidate &other) const {
+      return squared_distance < other.squared_distance;
+    }
+  };
+
+  /**
+       * Visits nodes of a single list outward from the center key, nearest
+       * first, stopping when the partial squared distance can not improve
+       * the current K-th best candidate. Lists link forward only: the
+       * forward cursor steps with next, the nodes below the center are
+       * collected in key ranges twice as wide each time and visited from
+       * their last one, so no step searches the list from its head.
+       * @param list target list
+       * @param center center key
+       * @param resolution resolution of the list dimension
+       * @param base_squared squared distance accumulated on upper levels
+       * @param heap current candidates
+       * @param k number of neighbours
+       * @param max_squared max squared distance allowed
+       * @param visitor functor called with (node, squared distance)
+       */
+  template <class LIST, class HEAP, class VISITOR>
+  void _visitOutward(LIST *list, K center, D resolution, D base_squared,
+                     HEAP &heap, int k, D max_squared, VISITOR visitor) {
+    typename LIST::NodeType *forward = list->lowerBound(center);
+    std::vector<typename LIST::NodeType *> backward;
+    long min_key = long(list->getMinKey());
+    long below = long(center) - 1;
+    long width = 8;
+    for (;;) {
+      D worst = long(heap.size()) < k ? max_squared : heap.top().squared_distance;
+      while (backward.empty() && below >= min_key) {
+        D d = D(long(center) - below) * resolution;
+        if (base_squared + d * d > worst) {
+          below = min_key - 1;
+          break;
+        }
+        long from = std::max(min_key, below - width + 1);
+        list->retrieveNodesByRange(K(from), K(below), backward);
+        below = from - 1;
+        width *= 2;
+      }
+      if (forward == NULL && backward.empty())
+        break;
+
+      D forward_d2 = std::numeric_limits<D>::max();
+      D backward_d2 = std::numeric_limits<D>::max();
+      if (forward != NULL) {
+        D d = D(long(forward->key) - long(center)) * resolution;
+        forward_d2 = base_squared + d * d;
+      }
+      if (!backward.empty()) {
+        D d = D(long(center) - long(backward.back()->key)) * resolution;
+        backward_d2 = base_squared + d * d;
+      }
+
+      bool use_forward = forward_d2 <= backward_d2;
+      D d2 = use_forward ? forward_d2 : backward_d2;
+      if (d2 > worst)
+        break;
+
+      if (use_forward) {
+        visitor(forward, d2);
+        forward = list->next(forward);
+      } else {
+        visitor(backward.back(), d2);
+        backward.pop_back();
+      }
+    }
+  }
+
+  /**
+       * Called after a voxel has been integrated, while its X branch is
+       * locked. Derived maps override it to maintain per-column caches.
+       * @param ix X index of the column
+       * @param iy Y index of the column
+       * @param zlist the column
+       * @param iz Z index of the voxel
+       * @param inserted TRUE if the voxel has been created
+       */
+  virtual void _voxelIntegrated(K ix, K iy, Z_NODE *zlist, K iz,
+                                bool inserted) {}
+
+  /**
+       * Called before a column is unlinked and freed.
+       */
+  virtual void _columnErased(K ix, K iy, Z_NODE *zlist) {}
+
+  /**
+       * Called after voxels have been removed from a column still in the map.
+       */
+  virtual void _columnTrimmed(K ix, K iy, Z_NODE *zlist) {}
+
+  /**
+       * Called for each column created or modified by merge.
+       */
+  virtual void _columnMerged(K ix, K iy, Z_NODE *zlist) {}
+
+  /**
+       * Makes 'frozen', an empty map, a copy-on-write snapshot of this one
+       * (see snapshot). Derived maps extend their snapshot with it.
+       */
+  void _snapshotInto(SkipListMapV2 &frozen) {
+    frozen._min_index_value = _min_index_value;
+    frozen._max_index_value = _max_index_value;
+    frozen._resolution_x = _resolution_x;
+    frozen._resolution_y = _resolution_y;
+    frozen._resolution_z = _resolution_z;
+    frozen._voxel_counter = _voxel_counter;
+    frozen._version = _version.load();
+    // removals are not copied: delta consumers of the snapshot start over
+    frozen._erased_horizon = frozen._version.load();
+    frozen._epochs = _epochs;
+    frozen._root_list = _root_list;
+    frozen._root_owner = _root_owner;
+    frozen._root_shared = true;
+    _root_shared = true;
+  }
+
+  /**
+       * Called when a column shared with a snapshot is replaced by its
+       * private clone.
+       */
+  virtual void _columnCloned(K ix, K iy, Z_NODE *shared, Z_NODE *clone) {}
+
+  /**
+       * Index box of a coordinates box.
+       */
+  IndexBox _coordinatesBox(D min_x, D min_y, D min_z, D max_x, D max_y,
+                           D max_z) {
+    IndexBox box;
+    if (!_indexRange(min_x, max_x, _resolution_x, box.min_x, box.max_x) ||
+        !_indexRange(min_y, max_y, _resolution_y, box.min_y, box.max_y) ||
+        !_indexRange(min_z, max_z, _resolution_z, box.min_z, box.max_z)) {
+      // empty box
+      return IndexBox(K(1), K(0), K(1), K(0), K(1), K(0));
+    }
+    return box;
+  }
+
+  /**
+       * Removes the voxels of a X branch inside a box, see eraseRegion.
+       * @return number of removed voxels
+       */
+  long _eraseBranchRegion(K ix, Y_NODE *ylist, const IndexBox &box) {
+    Version version = _version.load(std::memory_order_relaxed);
+    long removed = 0;
+    bool whole_columns = true;
+    std::vector<K> emptied_keys;
+
+    typename Y_NODE::NodeType *ynode = ylist->lowerBound(box.min_y);
+    for (; ynode != NULL && ynode->key <= box.max_y;
+         ynode = ylist->next(ynode)) {
+      Z_NODE *zlist = ynode->value;
+      bool whole = zlist->empty() || (zlist->first()->key >= box.min_z &&
+                                      zlist->last()->key <= box.max_z);
+      if (whole) {
+        emptied_keys.push_back(ynode->key);
+        continue;
+      }
+      if (zlist->lowerBound(box.min_z) == NULL ||
+          zlist->lowerBound(box.min_z)->key > box.max_z) {
+        whole_columns = false;
+        continue;
+      }
+      zlist = _writableBranch(ix, ynode->key, ylist, zlist);
+      std::vector<V *> voxels;
+      std::vector<typename Z_NODE::NodeType *> znodes;
+      if (zlist->eraseRange(box.min_z, box.max_z, &voxels, &znodes) > 0) {
+        for (int k = 0; k < voxels.size(); k++) {
+          _epochs->retire(voxels[k]);
+          _epochs->retire(znodes[k]);
+        }
+        removed += voxels.size();
+        zlist->touch(version);
+        ylist->touch(version);
+        _columnTrimmed(ix, ynode->key, zlist);
+      }
+      whole_columns = false;
+    }
+    if (emptied_keys.empty())
+      return removed;
+
+    // whole columns: a single unlink of the Y run when nothing is left in
+    // between, one erase per column otherwise
+    std::vector<Z_NODE *> zlists;
+    std::vector<typename Y_NODE::NodeType *> ynodes;
+    if (whole_columns) {
+      ylist->eraseRange(box.min_y, box.max_y, &zlists, &ynodes);
+    } else {
+      for (int j = 0; j < emptied_keys.size(); j++) {
+        ynodes.push_back(ylist->unlink(emptied_keys[j]));
+        zlists.push_back(ynodes.back()->value);
+      }
+    }
+    ylist->touch(version);
+    for (int j = 0; j < ynodes.size(); j++)
+      _epochs->retire(ynodes[j]);
+
+    boost::mutex::scoped_lock lock(_erased_mutex);
+    for (int j = 0; j < zlists.size(); j++) {
+      _columnErased(ix, emptied_keys[j], zlists[j]);
+      _erased_columns.push_back(ErasedColumn(ix, emptied_keys[j], version));
+      removed += zlists[j]->getSize();
+      _releaseBranch(*_epochs, zlists[j]);
+    }
+    return removed;
+  }
+
+  /**
+       * Drops a reference to a Z branch unlinked from its parent. The last
+       * reference retires the branch with its voxels.
+       */
+  static void _releaseBranch(EpochManager &epochs, Z_NODE *zlist) {
+    if (zlist->references.fetch_sub(1) != 1)
+      return;
+    std::vector<typename Z_NODE::NodeType *> znodes;
+    zlist->retrieveNodes(znodes);
+    for (int k = 0; k < znodes.size(); k++)
+      epochs.retire(znodes[k]->value);
+    epochs.retire(zlist);
+  }
+
+  /**
+       * Drops a reference to a Y branch unlinked from its parent. The last
+       * reference retires the branch and releases its columns.
+       */
+  static void _releaseBranch(EpochManager &epochs, Y_NODE *ylist) {
+    if (ylist->references.fetch_sub(1) != 1)
+      return;
+    std::vector<typename Y_NODE::NodeType *> ynodes;
+    ylist->retrieveNodes(ynodes);
+    for (int j = 0; j < ynodes.size(); j++)
+      _releaseBranch(epochs, ynodes[j]->value);
+    epochs.retire(ylist);
+  }
+
+  /**
+       * Deleter of a root shared by a map and its snapshots: the last owner
+       * releases its X branches and retires it.
+       */
+  struct _RootRelease {
+    boost::shared_ptr<EpochManager> epochs;
+
+    _RootRelease(const boost::shared_ptr<EpochManager> &epochs)
+        : epochs(epochs) {}
+
+    void operator()(X_NODE *root) const {
+      std::vector<typename X_NODE::NodeType *> xnodes;
+      root->retrieveNodes(xnodes);
+      for (int i = 0; i < xnodes.size(); i++)
+        _releaseBranch(*epochs, xnodes[i]->value);
+      epochs->retire(root);
+      epochs->reclaim();
+    }
+  };
+
+  /**
+       * Makes the root private to this map, cloning it if it is shared with
+       * a snapshot. The clone points to the same X branches, which become
+       * shared in turn. Writers call it before locking an X key.
+       */
+  void _ownRoot() {
+    if (!_root_shared.load())
+      return;
+    boost::mutex::scoped_lock lock(_root_mutex);
+    if (!_root_shared.load())
+      return;
+    if (_root_owner.use_count() > 1) {
+      X_NODE *root = new X_NODE(_root_list->getMinKey(),
+                                _root_list->getMaxKey());
+      std::vector<typename X_NODE::NodeType *> xnodes;
+      _root_list->retrieveNodes(xnodes);
+      for (int i = 0; i < xnodes.size(); i++) {
+        xnodes[i]->value->references++;
+        root->insert(xnodes[i]->key, xnodes[i]->value);
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      _root_list = root;
+      _root_owner.reset(root, _RootRelease(_epochs));
+    }
+    _root_shared = false;
+  }
+
+  /**
+       * X branch ready to be modified: cloned, and replaced in the root, if
+       * it is shared with a snapshot. Columns of the clone are shared.
+       * @param ix X key of the branch
+       * @param ylist current branch
+       * @return private branch
+       */
+  Y_NODE *_writableBranch(K ix, Y_NODE *ylist) {
+    if (ylist->references.load() == 1)
+      return ylist;
+    Y_NODE *clone = new Y_NODE(_min_index_value, _max_index_value);
+    std::vector<typename Y_NODE::NodeType *> ynodes;
+    ylist->retrieveNodes(ynodes);
+    for (int j = 0; j < ynodes.size(); j++) {
+      ynodes[j]->value->references++;
+      clone->insert(ynodes[j]->key, ynodes[j]->value);
+    }
+    clone->version = ylist->version;
+    _root_list->insert(ix, clone);
+    _releaseBranch(*_epochs, ylist);
+    return clone;
+  }
+
+  /**
+       * Column ready to be modified: cloned with a copy of its voxels, and
+       * replaced in its (private) X branch, if it is shared with a snapshot.
+       * @param ix X key of the column
+       * @param iy Y key of the column
+       * @param ylist private X branch containing the column
+       * @param zlist current column
+       * @return private column
+       */
+  Z_NODE *_writableBranch(K ix, K iy, Y_NODE *ylist, Z_NODE *zlist) {
+    if (zlist->references.load() == 1)
+      return zlist;
+    Z_NODE *clone = new Z_NODE(_min_index_value, _max_index_value);
+    std::vector<typename Z_NODE::NodeType *> znodes;
+    zlist->retrieveNodes(znodes);
+    for (int k = 0; k < znodes.size(); k++)
+      clone->insert(znodes[k]->key, new V(*znodes[k]->value));
+    clone->version = zlist->version;
+    ylist->insert(iy, clone);
+    _columnCloned(ix, iy, zlist, clone);
+    _releaseBranch(*_epochs, zlist);
+    return clone;
+  }
+
+  /**
+       * Column (ix,iy) ready to be modified, created if missing, with its
+       * X branch (see _writableBranch). Requires _ownRoot and, with
+       * concurrency access, the lock of ix.
+       * @param ylist OUTPUT private X branch
+       * @return private column
+       */
+  Z_NODE *_writableColumn(K ix, K iy, Y_NODE *&ylist) {
+    const typename X_NODE::NodeType *xnode = _root_list->find(ix);
+    if (xnode == NULL) {
+      ylist = new Y_NODE(_min_index_value, _max_index_value);
+      _root_list->insert(ix, ylist);
+    } else {
+      ylist = _writableBranch(ix, xnode->value);
+    }
+
+    const typename Y_NODE::NodeType *ynode = ylist->find(iy);
+    if (ynode == NULL) {
+      Z_NODE *zlist = new Z_NODE(_min_index_value, _max_index_value);
+      ylist->insert(iy, zlist);
+      return zlist;
+    }
+    return _writableBranch(ix, iy, ylist, ynode->value);
+  }
+
+  /**
+       * Fuses new data into an existing voxel (V operator+).
+       */
+  void _fuseVoxel(Z_NODE *zlist, const typename Z_NODE::NodeType *voxel,
+                  V *data) {
+    _replaceVoxel(zlist, voxel, *(voxel->value) + *data);
+  }
+
+  /**
+       * Sets the value of an existing voxel. With snapshot reads the new
+       * value is a new object swapped in place of the old one, which is
+       * retired.
+       */
+  void _replaceVoxel(Z_NODE *zlist, const typename Z_NODE::NodeType *voxel,
+                     const V &value) {
+    if (!_snapshot_reads) {
+      *(voxel->value) = value;
+      return;
+    }
+    V *old_value = voxel->value;
+    zlist->insert(voxel->key, new V(value));
+    _epochs->retire(old_value);
+  }
+
+  /**
+       * Inserts KEY,VALUE pairs sorted by Key and missing from the list.
+       * The ones past the last Key of the list are appended in linear time
+       * (SkipList::appendSorted), the others are inserted one by one.
+       */
+  template <class LIST>
+  static void _insertSorted(
+      LIST *list,
+      const std::vector<std::pair<K, typename LIST::ValueType> > &pairs) {
+    long split = 0;
+    if (!list->empty()) {
+      K last = list->last()->key;
+      for (; split < long(pairs.size()) && pairs[split].first < last;
+           split++) {
+        list->insert(pairs[split].first, pairs[split].second);
+      }
+    }
+    if (split == 0) {
+      list->appendSorted(pairs);
     } else {
-      *(voxel->value) = *(voxel->value) + *data;
+      list->appendSorted(std::vector<std::pair<K, typename LIST::ValueType> >(
+          pairs.begin() + split, pairs.end()));
+    }
+  }
+
+  /**
+       * Private copy of a column of another map, built in linear time.
+       */
+  Z_NODE *_copyColumn(Z_NODE *column) {
+    std::vector<std::pair<K, V *> > pairs;
+    for (typename Z_NODE::NodeType *znode =
+             column->lowerBound(std::numeric_limits<K>::min());
+         znode != NULL; znode = column->next(znode)) {
+      pairs.push_back(std::make_pair(znode->key, new V(*znode->value)));
+    }
+    Z_NODE *zlist = new Z_NODE(_min_index_value, _max_index_value);
+    zlist->appendSorted(pairs);
+    return zlist;
+  }
+
+  /**
+       * Merges a column of another map into a private column of this map.
+       * Both lists are walked once in key order: common voxels are fused,
+       * missing ones copied and inserted (see _insertSorted).
+       * @return number of new voxels
+       */
+  template <class FUSION>
+  long _mergeColumn(Z_NODE *zlist, Z_NODE *other, FUSION &fusion) {
+    std::vector<std::pair<K, V *> > missing;
+    typename Z_NODE::NodeType *mine =
+        zlist->lowerBound(std::numeric_limits<K>::min());
+    for (typename Z_NODE::NodeType *theirs =
+             other->lowerBound(std::numeric_limits<K>::min());
+         theirs != NULL; theirs = other->next(theirs)) {
+      while (mine != NULL && mine->key < theirs->key)
+        mine = zlist->next(mine);
+      if (mine != NULL && mine->key == theirs->key) {
+        _replaceVoxel(zlist, mine, fusion(*mine->value, *theirs->value));
+      } else {
+        missing.push_back(std::make_pair(theirs->key, new V(*theirs->value)));
+      }
+    }
+    _insertSorted(zlist, missing);
+    return missing.size();
+  }
+
+  /**
+       * Merges a X branch of another map into a private X branch of this
+       * map: Y lists are walked once in key order, common columns merged
+       * (see _mergeColumn) and missing ones copied whole.
+       * @return number of new voxels
+       */
+  template <class FUSION>
+  long _mergeBranch(K ix, Y_NODE *ylist, Y_NODE *other, FUSION &fusion) {
+    long added = 0;
+    std::vector<std::pair<K, Z_NODE *> > missing;
+    typename Y_NODE::NodeType *mine =
+        ylist->lowerBound(std::numeric_limits<K>::min());
+    for (typename Y_NODE::NodeType *theirs =
+             other->lowerBound(std::numeric_limits<K>::min());
+         theirs != NULL; theirs = other->next(theirs)) {
+      while (mine != NULL && mine->key < theirs->key)
+        mine = ylist->next(mine);
+      if (mine != NULL && mine->key == theirs->key) {
+        Z_NODE *zlist = _writableBranch(ix, mine->key, ylist, mine->value);
+        added += _mergeColumn(zlist, theirs->value, fusion);
+        _touchColumn(ylist, zlist);
+        _columnMerged(ix, mine->key, zlist);
+      } else {
+        missing.push_back(
+            std::make_pair(theirs->key, _copyColumn(theirs->value)));
+      }
+    }
+    _insertSorted(ylist, missing);
+    for (int j = 0; j < missing.size(); j++) {
+      added += missing[j].second->getSize();
+      _touchColumn(ylist, missing[j].second);
+      _columnMerged(ix, missing[j].first, missing[j].second);
+    }
+    return added;
+  }
+
+  /**
+       * Sorts a footprint by voxel and fuses the contributions to the same
+       * voxel, dropping entries not flagged as valid.
+       */
+  static void _foldFootprint(std::vector<SourceVoxel> &footprint,
+                             const std::vector<char> &valid) {
+    long size = 0;
+    for (long i = 0; i < long(footprint.size()); i++) {
+      if (valid[i])
+        footprint[size++] = footprint[i];
+    }
+    footprint.resize(size);
+    std::sort(footprint.begin(), footprint.end());
+
+    size = 0;
+    for (long i = 0; i < long(footprint.size()); i++) {
+      if (size > 0 && footprint[size - 1].sameVoxel(footprint[i])) {
+        footprint[size - 1].data = footprint[size - 1].data + footprint[i].data;
+      } else {
+        footprint[size++] = footprint[i];
+      }
+    }
+    footprint.resize(size);
+  }
+
+  /**
+       * Integrates a sorted footprint, one X branch per task. Tasks run in
+       * parallel only with concurrency access, which derived maps may need
+       * for their own structures.
+       */
+  void _scatterFootprint(std::vector<SourceVoxel> &footprint) {
+    std::vector<long> branches;
+    _footprintBranches(footprint, branches);
+
+#pragma omp parallel for schedule(dynamic) if (this->hasConcurrencyAccess())
+    for (int b = 0; b < int(branches.size()) - 1; b++) {
+      for (long i = branches[b]; i < branches[b + 1]; i++) {
+        SourceVoxel &entry = footprint[i];
+        integrateVoxel(entry.ix, entry.iy, entry.iz, &entry.data);
+      }
+    }
+  }
+
+  /**
+       * Deintegrates a sorted footprint, one X branch per task, see
+       * deintegrateVoxels.
+       * @return number of erased voxels
+       */
+  long _deintegrateFootprint(const std::vector<SourceVoxel> &footprint) {
+    std::vector<long> branches;
+    _footprintBranches(footprint, branches);
+    _ownRoot();
+    long removed = 0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : removed) if (this->hasConcurrencyAccess())
+    for (int b = 0; b < int(branches.size()) - 1; b++) {
+      K ix = footprint[branches[b]].ix;
+      if (this->hasConcurrencyAccess())
+        this->_root_list->lock(ix);
+      removed += _deintegrateBranch(footprint, branches[b], branches[b + 1]);
+      if (this->hasConcurrencyAccess())
+        this->_root_list->unlock(ix);
+    }
+
+#pragma omp atomic
+    _voxel_counter -= int(removed);
+    _epochs->reclaim();
+    return removed;
+  }
+
+  /**
+       * Deintegrates the entries [begin, end) of a sorted footprint, all in
+       * the same X branch. Erased voxels are unlinked and retired, columns
+       * and the branch itself are pruned once they are empty.
+       * @return number of erased voxels
+       */
+  long _deintegrateBranch(const std::vector<SourceVoxel> &footprint,
+                          long begin, long end) {
+    K ix = footprint[begin].ix;
+    const typename X_NODE::NodeType *xnode = _root_list->find(ix);
+    if (xnode == NULL)
+      return 0;
+    Y_NODE *ylist = _writableBranch(ix, xnode->value);
+    Version version = _version.load(std::memory_order_relaxed);
+    long removed = 0;
+
+    for (long i = begin; i < end;) {
+      K iy = footprint[i].iy;
+      long column_end = i;
+      while (column_end < end && footprint[column_end].iy == iy)
+        column_end++;
+      const typename Y_NODE::NodeType *ynode = ylist->find(iy);
+      if (ynode == NULL) {
+        i = column_end;
+        continue;
+      }
+
+      Z_NODE *zlist = _writableBranch(ix, iy, ylist, ynode->value);
+      long erased = 0;
+      for (; i < column_end; i++) {
+        const typename Z_NODE::NodeType *voxel = zlist->find(footprint[i].iz);
+        if (voxel == NULL)
+          continue;
+        V value = *(voxel->value) - footprint[i].data;
+        if (!_deintegration_filter || _deintegration_filter(&value)) {
+          _replaceVoxel(zlist, voxel, value);
+          continue;
+        }
+        V *data = voxel->value;
+        _epochs->retire(zlist->unlink(footprint[i].iz));
+        _epochs->retire(data);
+        erased++;
+      }
+      _touchColumn(ylist, zlist);
+      if (erased == 0)
+        continue;
+
+      removed += erased;
+      if (!zlist->empty()) {
+        _columnTrimmed(ix, iy, zlist);
+        continue;
+      }
+      _epochs->retire(ylist->unlink(iy));
+      {
+        boost::mutex::scoped_lock lock(_erased_mutex);
+        _columnErased(ix, iy, zlist);
+        _erased_columns.push_back(ErasedColumn(ix, iy, version));
+      }
+      _releaseBranch(*_epochs, zlist);
+    }
+
+    if (ylist->empty()) {
+      _epochs->retire(_root_list->unlink(ix));
+      _releaseBranch(*_epochs, ylist);
+    }
+    return removed;
+  }
+
+  /**
+       * Offsets where each X branch starts in a sorted footprint, closed by
+       * the footprint size.
+       */
+  static void _footprintBranches(const std::vector<SourceVoxel> &footprint,
+                                 std::vector<long> &branches) {
+    for (long i = 0; i < long(footprint.size()); i++) {
+      if (i == 0 || footprint[i].ix != footprint[i - 1].ix)
+        branches.push_back(i);
+    }
+    branches.push_back(footprint.size());
+  }
+
+  /**
+       * Footprint entries as indexed voxels pointing to their data.
+       */
+  static std::vector<IndexedVoxel>
+  _indexedFootprint(std::vector<SourceVoxel> &footprint) {
+    std::vector<IndexedVoxel> voxels(footprint.size());
+    for (long i = 0; i < long(footprint.size()); i++) {
+      voxels[i] = IndexedVoxel(footprint[i].ix, footprint[i].iy,
+                               footprint[i].iz, &footprint[i].data);
     }
+    return voxels;
+  }
+
+  /**
+       * Removes the footprint of a source from the registry.
+       * @return FALSE if the source is unknown
+       */
+  bool _takeSource(const std::string &source,
+                   std::vector<SourceVoxel> &footprint) {
+    boost::mutex::scoped_lock lock(_sources_mutex);
+    typename std::map<std::string, VoxelFootprint<K, V> >::iterator it =
+        _sources.find(source);
+    if (it == _sources.end())
+      return false;
+    it->second.decode(footprint);
+    _sources.erase(it);
     return true;
   }
 
+  /**
+       * Adds a sorted footprint to the one of a source.
+       */
+  void _storeSource(const std::string &source,
+                    const std::vector<SourceVoxel> &footprint) {
+    boost::mutex::scoped_lock lock(_sources_mutex);
+    VoxelFootprint<K, V> &stored = _sources[source];
+    if (stored.size() == 0) {
+      stored.encode(footprint);
+      return;
+    }
+    std::vector<SourceVoxel> current;
+    stored.decode(current);
+    current.insert(current.end(), footprint.begin(), footprint.end());
+    _foldFootprint(current, std::vector<char>(current.size(), 1));
+    stored.encode(current);
+  }
+
+  /**
+       * Stamps a column and its X branch with the current map version.
+       * @param ylist Y branch containing the column
+       * @param zlist the column
+       */
+  void _touchColumn(Y_NODE *ylist, Z_NODE *zlist) {
+    Version version = _version.load(std::memory_order_relaxed);
+    zlist->touch(version);
+    ylist->touch(version);
+  }
+
   Index _max_index_value;
   Index _min_index_value;
   X_NODE *_root_list;
@@ -573,6 +2652,21 @@ protected:
   bool _initialized;
   bool _self_concurrency_management;
   IntegrationMap _current_integration_map;
+  std::atomic<Version> _version;
+  std::vector<ErasedColumn> _erased_columns;
+  // removals up to this version were pruned from _erased_columns
+  Version _erased_horizon;
+  boost::mutex _erased_mutex;
+  bool _snapshot_reads;
+  boost::shared_ptr<EpochManager> _epochs;
+  // root ownership is shared with snapshots, see snapshot()
+  boost::shared_ptr<X_NODE> _root_owner;
+  std::atomic<bool> _root_shared;
+  boost::mutex _root_mutex;
+  std::function<bool(const V *)> _deintegration_filter;
+  // contributions of the integrated sources, see integrateSource
+  std::map<std::string, VoxelFootprint<K, V> > _sources;
+  boost::mutex _sources_mutex;
 
   // concurrency
   boost::mutex mutex_map_mutex;
@@ -0,0 +1,627 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef STATICKDSKIPLIST_HPP
+#define STATICKDSKIPLIST_HPP
+
+#include <algorithm>
+#include <array>
+#include <boost/thread.hpp>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <skimap/SkipList.hpp>
+#include <skimap/utils/ParallelFetch.hpp>
+#include <skimap/utils/VoxelFilters.hpp>
+#include <skimap/voxels/GenericVoxelKD.hpp>
+#include <vector>
+
+namespace skimap {
+
+/**
+     * Largest index offset 'd' with d * d <= squared_radius.
+     */
+inline long radiusExtent(long squared_radius) {
+  long extent = long(std::sqrt(double(squared_radius)));
+  while (extent * extent > squared_radius)
+    extent--;
+  while ((extent + 1) * (extent + 1) <= squared_radius)
+    extent++;
+  return extent;
+}
+
+/**
+     * Typed levels of a StaticKDSkipList: a level is a SkipList of pointers
+     * to the next level, the last one (LEVELS = 1) a SkipList of voxels.
+     * Operations recurse over the levels at compile time and work on the
+     * dimension N - LEVELS of the N dimensional keys.
+     * K template represents datatype for indices.
+     * V template represents datatype for user data.
+     * LEVELS template represents number of levels from this one to the last.
+     */
+template <class K, class V, int DEPTH, int LEVELS> struct KDLevel {
+  typedef KDLevel<K, V, DEPTH, LEVELS - 1> Next;
+  typedef SkipList<K, typename Next::List *, DEPTH> List;
+  typedef typename List::NodeType Node;
+
+  template <std::size_t N>
+  static V *find(List *list, const std::array<K, N> &idx) {
+    const Node *node = list->find(idx[N - LEVELS]);
+    return node != NULL ? Next::find(node->value, idx) : NULL;
+  }
+
+  /**
+       * Integrates 'data' in the voxel of 'idx', creating missing branches
+       * with keys in [min_index, max_index].
+       * @return TRUE if the voxel has been created
+       */
+  template <std::size_t N>
+  static bool integrate(List *list, const std::array<K, N> &idx, K min_index,
+                        K max_index, V *data) {
+    const Node *node = list->find(idx[N - LEVELS]);
+    if (node == NULL) {
+      node = list->insert(idx[N - LEVELS],
+                          new typename Next::List(min_index, max_index));
+    }
+    return Next::integrate(node->value, idx, min_index, max_index, data);
+  }
+
+  /**
+       * Visits the voxels within [*min_idx, *max_idx] (every voxel if
+       * min_idx is NULL) pushing them into 'sink'.
+       * @param idx buffer, OUTPUT indices of the visited voxel
+       */
+  template <std::size_t N, class SINK>
+  static void visit(List *list, std::array<K, N> &idx,
+                    const std::array<K, N> *min_idx,
+                    const std::array<K, N> *max_idx, SINK &sink) {
+    const int dim = N - LEVELS;
+    Node *node = min_idx != NULL
+                     ? list->lowerBound((*min_idx)[dim])
+                     : list->lowerBound(std::numeric_limits<K>::min());
+    for (; node != NULL; node = list->next(node)) {
+      if (max_idx != NULL && node->key > (*max_idx)[dim])
+        break;
+      idx[dim] = node->key;
+      Next::visit(node->value, idx, min_idx, max_idx, sink);
+    }
+  }
+
+  /**
+       * Visits the voxels within the radius left by 'squared_radius' (the
+       * squared radius of the query minus the partial squared distance of
+       * the upper dimensions) pushing them into 'sink'.
+       */
+  template <std::size_t N, class SINK>
+  static void radius(List *list, const std::array<K, N> &center,
+                     std::array<K, N> &idx, long squared_radius, K min_index,
+                     SINK &sink) {
+    const int dim = N - LEVELS;
+    long extent = radiusExtent(squared_radius);
+    Node *node = list->lowerBound(
+        K(std::max(long(center[dim]) - extent, long(min_index))));
+    for (; node != NULL; node = list->next(node)) {
+      long d = long(node->key) - long(center[dim]);
+      if (d > extent)
+        break;
+      idx[dim] = node->key;
+      Next::radius(node->value, center, idx, squared_radius - d * d,
+                   min_index, sink);
+    }
+  }
+
+  /**
+       * Visits the dimension outward from the center index, nearest first,
+       * recursing while the partial squared distance can still improve the
+       * current K-th best candidate (see StaticKDSkipList::nearestSearch).
+       */
+  template <std::size_t N, class D, class HEAP, class F>
+  static void nearest(List *list, const std::array<K, N> &center,
+                      std::array<K, N> &idx, D base_squared, HEAP &heap, int k,
+                      D max_squared, F &filter, D resolution) {
+    const int dim = N - LEVELS;
+    Node *forward = list->lowerBound(center[dim]);
+    Node *backward = list->predecessor(center[dim]);
+    while (forward != NULL || backward != NULL) {
+      D forward_d2 = std::numeric_limits<D>::max();
+      D backward_d2 = std::numeric_limits<D>::max();
+      if (forward != NULL) {
+        D d = D(long(forward->key) - long(center[dim])) * resolution;
+        forward_d2 = base_squared + d * d;
+      }
+      if (backward != NULL) {
+        D d = D(long(center[dim]) - long(backward->key)) * resolution;
+        backward_d2 = base_squared + d * d;
+      }
+
+      bool use_forward = forward_d2 <= backward_d2;
+      D d2 = use_forward ? forward_d2 : backward_d2;
+      D worst = long(heap.size()) < k ? max_squared : heap.top().squared_distance;
+      if (d2 > worst)
+        break;
+
+      Node *node = use_forward ? forward : backward;
+      idx[dim] = node->key;
+      Next::nearest(node->value, center, idx, d2, heap, k, max_squared, filter,
+                    resolution);
+
+      if (use_forward)
+        forward = list->next(node);
+      else
+        backward = list->predecessor(node->key);
+    }
+  }
+
+  static void destroy(List *list) {
+    for (Node *node = list->lowerBound(std::numeric_limits<K>::min());
+         node != NULL; node = list->next(node)) {
+      Next::destroy(node->value);
+    }
+    delete list;
+  }
+};
+
+/**
+     * Last level: a SkipList of voxels.
+     */
+template <class K, class V, int DEPTH> struct KDLevel<K, V, DEPTH, 1> {
+  typedef SkipList<K, V *, DEPTH> List;
+  typedef typename List::NodeType Node;
+
+  template <std::size_t N>
+  static V *find(List *list, const std::array<K, N> &idx) {
+    const Node *node = list->find(idx[N - 1]);
+    return node != NULL ? node->value : NULL;
+  }
+
+  template <std::size_t N>
+  static bool integrate(List *list, const std::array<K, N> &idx, K min_index,
+                        K max_index, V *data) {
+    const Node *node = list->find(idx[N - 1]);
+    if (node == NULL) {
+      list->insert(idx[N - 1], new V(data));
+      return true;
+    }
+    *(node->value) = *(node->value) + *data;
+    return false;
+  }
+
+  template <std::size_t N, class SINK>
+  static void visit(List *list, std::array<K, N> &idx,
+                    const std::array<K, N> *min_idx,
+                    const std::array<K, N> *max_idx, SINK &sink) {
+    Node *node = min_idx != NULL
+                     ? list->lowerBound((*min_idx)[N - 1])
+                     : list->lowerBound(std::numeric_limits<K>::min());
+    for (; node != NULL; node = list->next(node)) {
+      if (max_idx != NULL && node->key > (*max_idx)[N - 1])
+        break;
+      idx[N - 1] = node->key;
+      sink.push(idx, node->value);
+    }
+  }
+
+  template <std::size_t N, class SINK>
+  static void radius(List *list, const std::array<K, N> &center,
+                     std::array<K, N> &idx, long squared_radius, K min_index,
+                     SINK &sink) {
+    long extent = radiusExtent(squared_radius);
+    Node *node = list->lowerBound(
+        K(std::max(long(center[N - 1]) - extent, long(min_index))));
+    for (; node != NULL; node = list->next(node)) {
+      if (long(node->key) - long(center[N - 1]) > extent)
+        break;
+      idx[N - 1] = node->key;
+      sink.push(idx, node->value);
+    }
+  }
+
+  template <std::size_t N, class D, class HEAP, class F>
+  static void nearest(List *list, const std::array<K, N> &center,
+                      std::array<K, N> &idx, D base_squared, HEAP &heap, int k,
+                      D max_squared, F &filter, D resolution) {
+    Node *forward = list->lowerBound(center[N - 1]);
+    Node *backward = list->predecessor(center[N - 1]);
+    while (forward != NULL || backward != NULL) {
+      D forward_d2 = std::numeric_limits<D>::max();
+      D backward_d2 = std::numeric_limits<D>::max();
+      if (forward != NULL) {
+        D d = D(long(forward->key) - long(center[N - 1])) * resolution;
+        forward_d2 = base_squared + d * d;
+      }
+      if (backward != NULL) {
+        D d = D(long(center[N - 1]) - long(backward->key)) * resolution;
+        backward_d2 = base_squared + d * d;
+      }
+
+      bool use_forward = forward_d2 <= backward_d2;
+      D d2 = use_forward ? forward_d2 : backward_d2;
+      D worst = long(heap.size()) < k ? max_squared : heap.top().squared_distance;
+      if (d2 > worst)
+        break;
+
+      Node *node = use_forward ? forward : backward;
+      if (filter(node->value)) {
+        idx[N - 1] = node->key;
+        heap.push(typename HEAP::value_type(d2, idx, node->value));
+        if (long(heap.size()) > k)
+          heap.pop();
+      }
+
+      if (use_forward)
+        forward = list->next(node);
+      else
+        backward = list->predecessor(node->key);
+    }
+  }
+
+  static void destroy(List *list) {
+    for (Node *node = list->lowerBound(std::numeric_limits<K>::min());
+         node != NULL; node = list->next(node)) {
+      delete node->value;
+    }
+    delete list;
+  }
+};
+
+/**
+     * KDSkipList with the number of dimensions fixed at compile time: every
+     * level is a SkipList typed with its own branches (see KDLevel), keys
+     * are std::array and operations recurse over the levels at compile time,
+     * so find and integrateVoxel allocate nothing but the new branches and
+     * voxels. Writers of different first indices run concurrently, under
+     * STRIPES mutexes.
+     * V template represents datatype for user data.
+     * K template represents datatype for indices.
+     * D template represents datatype for coordinates.
+     * DIM template represents number of dimensions.
+     * DEPTH template represents max depth of the skip lists.
+     */
+template <class V, class K, class D, int DIM, int DEPTH = 8>
+class StaticKDSkipList {
+  static_assert(DIM >= 2, "StaticKDSkipList needs at least 2 dimensions");
+
+public:
+  typedef GenericVoxelKD<V, D> VoxelKD;
+
+  typedef K Index;
+  typedef KDLevel<K, V, DEPTH, DIM> ROOT_LEVEL;
+  typedef typename ROOT_LEVEL::List KNODE;
+
+  typedef std::array<Index, DIM> Indices;
+  typedef std::array<D, DIM> Coordinates;
+
+  static const int STRIPES = 64;
+
+  /**
+       */
+  StaticKDSkipList(D resolution)
+      : _min_index_value(std::numeric_limits<K>::min()),
+        _max_index_value(std::numeric_limits<K>::max()),
+        _resolution(resolution), _self_concurrency_management(false) {
+    _root_list = new KNODE(_min_index_value, _max_index_value);
+  }
+
+  /**
+       */
+  StaticKDSkipList(K min_index, K max_index, D resolution)
+      : _min_index_value(min_index), _max_index_value(max_index),
+        _resolution(resolution), _self_concurrency_management(false) {
+    _root_list = new KNODE(_min_index_value, _max_index_value);
+  }
+
+  virtual ~StaticKDSkipList() { ROOT_LEVEL::destroy(_root_list); }
+
+  bool isValidIndices(const Indices &idx) {
+    bool valid = true;
+    for (int i = 0; i < DIM; i++) {
+      valid &= idx[i] <= _max_index_value && idx[i] >= _min_index_value;
+    }
+    return valid;
+  }
+
+  bool coordinatesToIndex(const Coordinates &cds, Indices &idx) {
+    for (int i = 0; i < DIM; i++) {
+      idx[i] = K(floor(cds[i] / _resolution));
+    }
+    return isValidIndices(idx);
+  }
+
+  bool indexToCoordinates(const Indices &idx, Coordinates &cds) {
+    for (int i = 0; i < DIM; i++) {
+      cds[i] = idx[i] * _resolution + _resolution * 0.5;
+    }
+    return true;
+  }
+
+  V *find(const Indices &idx) {
+    if (!isValidIndices(idx))
+      return NULL;
+    return ROOT_LEVEL::find(_root_list, idx);
+  }
+
+  V *find(const Coordinates &cds) {
+    Indices idx;
+    if (coordinatesToIndex(cds, idx)) {
+      return find(idx);
+    }
+    return NULL;
+  }
+
+  bool integrateVoxel(const Coordinates &cds, V *data) {
+    Indices idx;
+    if (coordinatesToIndex(cds, idx)) {
+      return integrateVoxel(idx, data);
+    }
+    return false;
+  }
+
+  /**
+       * Integrates a voxel (V operator+ with the existing one). With
+       * concurrency access, writers lock the stripe of their first index,
+       * and the root list while adding a first index to it.
+       */
+  bool integrateVoxel(const Indices &idx, V *data) {
+    if (!isValidIndices(idx))
+      return false;
+
+    boost::mutex::scoped_lock lock(_stripes[_stripe(idx[0])],
+                                   boost::defer_lock);
+    if (hasConcurrencyAccess())
+      lock.lock();
+
+    const typename KNODE::NodeType *node = _root_list->find(idx[0]);
+    if (node == NULL) {
+      typename ROOT_LEVEL::Next::List *branch =
+          new typename ROOT_LEVEL::Next::List(_min_index_value,
+                                              _max_index_value);
+      if (hasConcurrencyAccess())
+        _root_list->lock(idx[0]);
+      node = _root_list->insert(idx[0], branch);
+      if (hasConcurrencyAccess())
+        _root_list->unlock(idx[0]);
+    }
+    ROOT_LEVEL::Next::integrate(node->value, idx, _min_index_value,
+                                _max_index_value, data);
+    return true;
+  }
+
+  /**
+       * Fetches all voxels with a two-pass parallel gather (see
+       * parallelGather). Capacity of 'voxels' is reused across calls.
+       * @param voxels OUTPUT voxels
+       */
+  void fetchVoxels(std::vector<VoxelKD> &voxels) {
+    _fetchVoxels(voxels, NULL, NULL);
+  }
+
+  /**
+       * Fetches the voxels within [min_idx, max_idx], bounds applied on
+       * every dimension.
+       * @param voxels OUTPUT voxels
+       */
+  void fetchVoxels(std::vector<VoxelKD> &voxels, const Indices &min_idx,
+                   const Indices &max_idx) {
+    _fetchVoxels(voxels, &min_idx, &max_idx);
+  }
+
+  /**
+       * Radius search: voxels whose indices are within 'radius' from
+       * 'center', or within the box of half side 'radius' if 'boxed'. Each
+       * dimension is visited only within the radius left by the upper ones.
+       * @param voxels OUTPUT voxels
+       */
+  void radiusSearch(const Indices &center, K radius,
+                    std::vector<VoxelKD> &voxels, bool boxed = false) {
+    Indices min_idx, max_idx;
+    for (int i = 0; i < DIM; i++) {
+      min_idx[i] = K(std::max(long(center[i]) - long(radius),
+                              long(_min_index_value)));
+      max_idx[i] = K(std::min(long(center[i]) + long(radius),
+                              long(_max_index_value)));
+    }
+    if (boxed) {
+      _fetchVoxels(voxels, &min_idx, &max_idx);
+      return;
+    }
+
+    std::vector<typename KNODE::NodeType *> nodes;
+    _root_list->retrieveNodesByRange(min_idx[0], max_idx[0], nodes);
+    long squared_radius = long(radius) * long(radius);
+    parallelGather(
+        int(nodes.size()),
+        [&](int i) {
+          CountSink sink;
+          _radiusBranch(nodes[i], center, squared_radius, sink);
+          return sink.count;
+        },
+        [&](int i, VoxelKD *output) {
+          WriteSink sink(this, output);
+          _radiusBranch(nodes[i], center, squared_radius, sink);
+        },
+        voxels);
+  }
+
+  void radiusSearch(const Coordinates &center, D radius,
+                    std::vector<VoxelKD> &voxels, bool boxed = false) {
+    Indices icenter;
+    coordinatesToIndex(center, icenter);
+    radiusSearch(icenter, K(floor(radius / _resolution)), voxels, boxed);
+  }
+
+  /**
+       * K-Nearest Neighbours search, see KDSkipList::nearestSearch.
+       * @param center query indices
+       * @param k number of neighbours
+       * @param voxels OUTPUT neighbours sorted by increasing distance
+       * @param distances OUTPUT euclidean distances of the neighbours
+       * @param filter functor bool(const V*) discarding unwanted voxels
+       * @param max_distance max euclidean distance of a neighbour
+       */
+  template <class F>
+  void nearestSearch(const Indices &center, int k,
+                     std::vector<VoxelKD> &voxels, std::vector<D> &distances,
+                     F filter, D max_distance = std::numeric_limits<D>::max()) {
+    voxels.clear();
+    distances.clear();
+    if (k <= 0)
+      return;
+
+    std::priority_queue<NeighbourCandidate> heap;
+    D max_squared = max_distance < std::sqrt(std::numeric_limits<D>::max())
+                        ? max_distance * max_distance
+                        : std::numeric_limits<D>::max();
+
+    Indices idx;
+    ROOT_LEVEL::nearest(_root_list, center, idx, D(0), heap, k, max_squared,
+                        filter, _resolution);
+
+    voxels.resize(heap.size());
+    distances.resize(heap.size());
+    for (int i = int(heap.size()) - 1; i >= 0; i--) {
+      const NeighbourCandidate &c = heap.top();
+      voxels[i] = _voxel(c.idx, c.data);
+      distances[i] = std::sqrt(c.squared_distance);
+      heap.pop();
+    }
+  }
+
+  void nearestSearch(const Indices &center, int k,
+                     std::vector<VoxelKD> &voxels) {
+    std::vector<D> distances;
+    nearestSearch(center, k, voxels, distances, AllVoxelsFilter<V>());
+  }
+
+  void nearestSearch(const Coordinates &center, int k,
+                     std::vector<VoxelKD> &voxels) {
+    Indices icenter;
+    voxels.clear();
+    if (coordinatesToIndex(center, icenter)) {
+      nearestSearch(icenter, k, voxels);
+    }
+  }
+
+  void enableConcurrencyAccess(bool status = true) {
+    _self_concurrency_management = status;
+  }
+
+  bool hasConcurrencyAccess() { return _self_concurrency_management; }
+
+protected:
+  /**
+       * Sink counting visited voxels
+       */
+  struct CountSink {
+    long count;
+
+    CountSink() : count(0) {}
+
+    void push(const Indices &idx, V *data) { count++; }
+  };
+
+  /**
+       * Sink writing visited voxels in a presized buffer
+       */
+  struct WriteSink {
+    StaticKDSkipList *map;
+    VoxelKD *output;
+
+    WriteSink(StaticKDSkipList *map, VoxelKD *output)
+        : map(map), output(output) {}
+
+    void push(const Indices &idx, V *data) {
+      *output++ = map->_voxel(idx, data);
+    }
+  };
+
+  /**
+       * Candidate of the K-Nearest Neighbours heap, ordered by distance
+       */
+  struct NeighbourCandidate {
+    D squared_distance;
+    Indices idx;
+    V *data;
+
+    NeighbourCandidate(D squared_distance, const Indices &idx, V *data)
+        : squared_distance(squared_distance), idx(idx), data(data) {}
+
+    bool operator<(const NeighbourCandidate &other) const {
+      return squared_distance < other.squared_distance;
+    }
+  };
+
+  void _fetchVoxels(std::vector<VoxelKD> &voxels, const Indices *min_idx,
+                    const Indices *max_idx) {
+    std::vector<typename KNODE::NodeType *> nodes;
+    if (min_idx != NULL)
+      _root_list->retrieveNodesByRange((*min_idx)[0], (*max_idx)[0], nodes);
+    else
+      _root_list->retrieveNodes(nodes);
+
+    parallelGather(
+        int(nodes.size()),
+        [&](int i) {
+          CountSink sink;
+          _visitBranch(nodes[i], min_idx, max_idx, sink);
+          return sink.count;
+        },
+        [&](int i, VoxelKD *output) {
+          WriteSink sink(this, output);
+          _visitBranch(nodes[i], min_idx, max_idx, sink);
+        },
+        voxels);
+  }
+
+  /**
+       * Visits the voxels of a first level node.
+       */
+  template <class SINK>
+  void _visitBranch(typename KNODE::NodeType *node, const Indices *min_idx,
+                    const Indices *max_idx, SINK &sink) {
+    Indices idx;
+    idx[0] = node->key;
+    ROOT_LEVEL::Next::visit(node->value, idx, min_idx, max_idx, sink);
+  }
+
+  /**
+       * Visits the voxels of a first level node within the squared radius
+       * left by its distance from 'center'.
+       */
+  template <class SINK>
+  void _radiusBranch(typename KNODE::NodeType *node, const Indices &center,
+                     long squared_radius, SINK &sink) {
+    Indices idx;
+    idx[0] = node->key;
+    long d = long(node->key) - long(center[0]);
+    ROOT_LEVEL::Next::radius(node->value, center, idx, squared_radius - d * d,
+                             _min_index_value, sink);
+  }
+
+  VoxelKD _voxel(const Indices &idx, V *data) {
+    std::vector<D> cds(DIM);
+    for (int i = 0; i < DIM; i++) {
+      cds[i] = idx[i] * _resolution + _resolution * 0.5;
+    }
+    return VoxelKD(cds, data);
+  }
+
+  static int _stripe(K key) { return int((unsigned long)(key) % STRIPES); }
+
+  Index _min_index_value;
+  Index _max_index_value;
+  KNODE *_root_list;
+  D _resolution;
+  bool _self_concurrency_management;
+
+  // writers, striped by first index
+  boost::mutex _stripes[STRIPES];
+};
+}
+
+#endif /* STATICKDSKIPLIST_HPP */
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef EPOCHMANAGER_HPP
+#define EPOCHMANAGER_HPP
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <cstddef>
+#include <vector>
+
+namespace skimap
+{
+
+/**
+     * Epoch-based reclamation. Readers enter an epoch (ReadGuard) before
+     * traversing a shared structure and leave it when done; writers unlink
+     * objects and retire them instead of deleting them. A retired object is
+     * deleted only once every reader that could have reached it has left,
+     * i.e. when all active readers entered after its retirement.
+     * Readers never block writers nor each other, a writer only takes a
+     * short mutex to queue retired objects.
+     */
+class EpochManager
+{
+public:
+  static const int MAX_READERS = 128;
+
+  /**
+       * RAII reader section. While a guard lives, no object retired after
+       * its creation is deleted.
+       */
+  class ReadGuard
+  {
+  public:
+    ReadGuard(EpochManager &manager) : _manager(manager)
+    {
+      _slot = _manager.enter();
+    }
+
+    ~ReadGuard() { _manager.leave(_slot); }
+
+  private:
+    ReadGuard(const ReadGuard &);
+    ReadGuard &operator=(const ReadGuard &);
+
+    EpochManager &_manager;
+    int _slot;
+  };
+
+  EpochManager() : _epoch(1)
+  {
+    for (int i = 0; i < MAX_READERS; i++)
+      _readers[i].store(IDLE);
+  }
+
+  /**
+       * Deletes every pending object, no reader must be active.
+       */
+  ~EpochManager()
+  {
+    for (size_t i = 0; i < _retired.size(); i++)
+      _retired[i].destroy(_retired[i].object);
+  }
+
+  /**
+       * Enters the current epoch. Spins only if all reader slots are busy.
+       * @return reader slot, to be passed to leave
+       */
+  int enter()
+  {
+    for (int i = 0;; i = (i + 1) % MAX_READERS)
+    {
+      unsigned long idle = IDLE;
+      unsigned long epoch = _epoch.load();
+      if (!_readers[i].compare_exchange_strong(idle, epoch))
+        continue;
+      // republish until the announced epoch is current, so a concurrent
+      // retire either sees this reader or happened before its traversal
+      unsigned long current = _epoch.load();
+      while (current != epoch)
+      {
+        epoch = current;
+        _readers[i].store(epoch);
+        current = _epoch.load();
+      }
+      return i;
+    }
+  }
+
+  /**
+       * Leaves the epoch entered with enter.
+       * @param slot reader slot
+       */
+  void leave(int slot) { _readers[slot].store(IDLE); }
+
+  /**
+       * Retires an object already unlinked from the shared structure. It is
+       * deleted by a later reclaim, once no reader can reach it.
+       * @param object object to delete
+       */
+  template <class T>
+  void retire(T *object)
+  {
+    if (object == NULL)
+      return;
+    boost::mutex::scoped_lock lock(_retired_mutex);
+    _retired.push_back(Retired(object, &EpochManager::_destroy<T>,
+                               _epoch.fetch_add(1)));
+  }
+
+  /**
+       * Deletes the retired objects no active reader can reach.
+       * @return number of deleted objects
+       */
+  int reclaim()
+  {
+    unsigned long oldest = _oldestReader();
+    std::vector<Retired> ready;
+    {
+      boost::mutex::scoped_lock lock(_retired_mutex);
+      std::vector<Retired> pending;
+      for (size_t i = 0; i < _retired.size(); i++)
+      {
+        if (_retired[i].epoch < oldest)
+          ready.push_back(_retired[i]);
+        else
+          pending.push_back(_retired[i]);
+      }
+      _retired.swap(pending);
+    }
+    for (size_t i = 0; i < ready.size(); i++)
+      ready[i].destroy(ready[i].object);
+    return int(ready.size());
+  }
+
+  /**
+       * @return number of retired objects waiting for deletion
+       */
+  int pending()
+  {
+    boost::mutex::scoped_lock lock(_retired_mutex);
+    return _retired.size();
+  }
+
+protected:
+  static const unsigned long IDLE = 0;
+
+  struct Retired
+  {
+    void *object;
+    void (*destroy)(void *);
+    unsigned long epoch;
+
+    Retired(void *object, void (*destroy)(void *), unsigned long epoch)
+        : object(object), destroy(destroy), epoch(epoch) {}
+  };
+
+  template <class T>
+  static void _destroy(void *object)
+  {
+    delete static_cast<T *>(object);
+  }
+
+  /**
+       * Epoch of the oldest active reader, past the current one if none.
+       */
+  unsigned long _oldestReader()
+  {
+    unsigned long oldest = _epoch.load() + 1;
+    for (int i = 0; i < MAX_READERS; i++)
+    {
+      unsigned long epoch = _readers[i].load();
+      if (epoch != IDLE && epoch < oldest)
+        oldest = epoch;
+    }
+    return oldest;
+  }
+
+  boost::atomic<unsigned long> _epoch;
+  boost::atomic<unsigned long> _readers[MAX_READERS];
+  std::vector<Retired> _retired;
+  boost::mutex _retired_mutex;
+};
+}
+
+#endif /* EPOCHMANAGER_HPP */
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef FRUSTUM_HPP
+#define FRUSTUM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace skimap
+{
+
+/**
+     * Camera frustum expressed in map frame. Planes are built as in
+     * slamdunk::FeatureTracker::setFrustum (far, near, top, bottom, left,
+     * right) and a point is inside iff n.p + d < 0 for every plane.
+     * D template represents datatype for coordinates.
+     */
+template <typename D>
+struct Frustum
+{
+  // plane i: planes[i][0..2] normal, planes[i][3] offset
+  D planes[6][4];
+  // near corners tl,tr,br,bl then far corners in the same order
+  D corners[8][3];
+
+  /**
+       * Builds the frustum of a pinhole camera.
+       * @param fx focal length x
+       * @param fy focal length y
+       * @param cx principal point x
+       * @param cy principal point y
+       * @param width image width
+       * @param height image height
+       * @param pose camera to map rigid transform, 4x4 row-major
+       * @param near_plane near plane depth
+       * @param far_plane far plane depth
+       */
+  Frustum(D fx, D fy, D cx, D cy, int width, int height, const D pose[16],
+          D near_plane, D far_plane)
+  {
+    D rays[4][3] = {{-cx / fx, -cy / fy, 1},
+                    {(width - cx) / fx, -cy / fy, 1},
+                    {(width - cx) / fx, (height - cy) / fy, 1},
+                    {-cx / fx, (height - cy) / fy, 1}};
+
+    D camera_planes[6][4] = {{0, 0, 1, -far_plane}, {0, 0, -1, near_plane}};
+    _planeThroughOrigin(rays[1], rays[0], camera_planes[2]); // top
+    _planeThroughOrigin(rays[3], rays[2], camera_planes[3]); // bottom
+    _planeThroughOrigin(rays[0], rays[3], camera_planes[4]); // left
+    _planeThroughOrigin(rays[2], rays[1], camera_planes[5]); // right
+
+    for (int i = 0; i < 6; i++)
+    {
+      // n_map = R n, d_map = d - n_map . t
+      D d = camera_planes[i][3];
+      for (int r = 0; r < 3; r++)
+      {
+        planes[i][r] = pose[r * 4] * camera_planes[i][0] +
+                       pose[r * 4 + 1] * camera_planes[i][1] +
+                       pose[r * 4 + 2] * camera_planes[i][2];
+        d -= planes[i][r] * pose[r * 4 + 3];
+      }
+      planes[i][3] = d;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+      D depth = i < 4 ? near_plane : far_plane;
+      D p[3] = {rays[i % 4][0] * depth, rays[i % 4][1] * depth, depth};
+      for (int r = 0; r < 3; r++)
+      {
+        corners[i][r] = pose[r * 4] * p[0] + pose[r * 4 + 1] * p[1] +
+                        pose[r * 4 + 2] * p[2] + pose[r * 4 + 3];
+      }
+    }
+  }
+
+  /**
+       * @return TRUE if the point is inside the frustum
+       */
+  bool contains(D x, D y, D z) const
+  {
+    for (int i = 0; i < 6; i++)
+    {
+      if (planes[i][0] * x + planes[i][1] * y + planes[i][2] * z +
+              planes[i][3] >=
+          0)
+        return false;
+    }
+    return true;
+  }
+
+  /**
+       * Bounding box of the frustum clipped by the vertical slab
+       * [x0, x1] x [y0, y1] (unbounded Z). Each face is clipped against the
+       * slab, the vertices of the clipped faces bound the intersection.
+       * @param min_point OUTPUT min corner
+       * @param max_point OUTPUT max corner
+       * @return FALSE if the slab does not intersect the frustum
+       */
+  bool clippedBounds(D x0, D x1, D y0, D y1, D min_point[3],
+                     D max_point[3]) const
+  {
+    static const int faces[6][4] = {{0, 1, 2, 3}, {4, 5, 6, 7},
+                                    {0, 1, 5, 4}, {1, 2, 6, 5},
+                                    {2, 3, 7, 6}, {3, 0, 4, 7}};
+    // slab half-spaces as (axis, sign, bound): sign * p[axis] <= sign * bound
+    const D bounds[4] = {x0, x1, y0, y1};
+    const int axes[4] = {0, 0, 1, 1};
+    const D signs[4] = {-1, 1, -1, 1};
+
+    bool found = false;
+    std::vector<Point> polygon, clipped;
+    for (int f = 0; f < 6; f++)
+    {
+      polygon.clear();
+      for (int v = 0; v < 4; v++)
+        polygon.push_back(Point(corners[faces[f][v]]));
+
+      for (int c = 0; c < 4 && !polygon.empty(); c++)
+      {
+        if (std::isinf(bounds[c]))
+          continue;
+        clipped.clear();
+        for (int v = 0; v < polygon.size(); v++)
+        {
+          const Point &a = polygon[v];
+          const Point &b = polygon[(v + 1) % polygon.size()];
+          D da = signs[c] * (a.p[axes[c]] - bounds[c]);
+          D db = signs[c] * (b.p[axes[c]] - bounds[c]);
+          if (da <= 0)
+            clipped.push_back(a);
+          if ((da < 0 && db > 0) || (da > 0 && db < 0))
+            clipped.push_back(a.lerp(b, da / (da - db)));
+        }
+        polygon.swap(clipped);
+      }
+
+      for (int v = 0; v < polygon.size(); v++)
+      {
+        for (int r = 0; r < 3; r++)
+        {
+          if (!found || polygon[v].p[r] < min_point[r])
+            min_point[r] = polygon[v].p[r];
+          if (!found || polygon[v].p[r] > max_point[r])
+            max_point[r] = polygon[v].p[r];
+        }
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  /**
+       * Bounding box of the whole frustum.
+       */
+  void bounds(D min_point[3], D max_point[3]) const
+  {
+    D inf = std::numeric_limits<D>::infinity();
+    clippedBounds(-inf, inf, -inf, inf, min_point, max_point);
+  }
+
+protected:
+  struct Point
+  {
+    D p[3];
+
+    Point(const D *v)
+    {
+      p[0] = v[0];
+      p[1] = v[1];
+      p[2] = v[2];
+    }
+
+    Point lerp(const Point &other, D t) const
+    {
+      D v[3] = {p[0] + t * (other.p[0] - p[0]), p[1] + t * (other.p[1] - p[1]),
+                p[2] + t * (other.p[2] - p[2])};
+      return Point(v);
+    }
+  };
+
+  /**
+       * Plane through origin, a and b, with normal a x b normalized.
+       */
+  static void _planeThroughOrigin(const D a[3], const D b[3], D plane[4])
+  {
+    plane[0] = a[1] * b[2] - a[2] * b[1];
+    plane[1] = a[2] * b[0] - a[0] * b[2];
+    plane[2] = a[0] * b[1] - a[1] * b[0];
+    D norm = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] +
+                       plane[2] * plane[2]);
+    plane[0] /= norm;
+    plane[1] /= norm;
+    plane[2] /= norm;
+    plane[3] = 0;
+  }
+};
+}
+
+#endif /* FRUSTUM_HPP */
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef OCCUPANCYRASTER_HPP
+#define OCCUPANCYRASTER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace skimap
+{
+
+/**
+     * Row-major int8 occupancy raster of a window of map cells, laid out as
+     * nav_msgs/OccupancyGrid data: cell (col,row) is the index
+     * (min_x + col, min_y + row) and values are OCCUPIED, FREE or UNKNOWN.
+     * The window grows to follow the map unless auto_grow is disabled, in
+     * which case cells outside it are ignored.
+     * After each rasterization 'resized' tells whether the window changed
+     * and the dirty_* fields bound the rewritten cells (empty if
+     * dirty_min_col > dirty_max_col).
+     * K template represents datatype for indices.
+     */
+template <typename K>
+struct OccupancyRaster
+{
+  static const int8_t OCCUPIED = 100;
+  static const int8_t FREE = 0;
+  static const int8_t UNKNOWN = -1;
+
+  K min_x, min_y;
+  int width, height;
+  std::vector<int8_t> data;
+  bool auto_grow;
+
+  bool resized;
+  int dirty_min_col, dirty_max_col, dirty_min_row, dirty_max_row;
+
+  OccupancyRaster()
+      : min_x(0), min_y(0), width(0), height(0), auto_grow(true),
+        resized(false)
+  {
+    clearDirty();
+  }
+
+  /**
+       * Raster of a fixed window.
+       * @param min_x index of the first column
+       * @param min_y index of the first row
+       * @param width
+       * @param height
+       */
+  OccupancyRaster(K min_x, K min_y, int width, int height)
+      : min_x(min_x), min_y(min_y), width(0), height(0), auto_grow(false),
+        resized(false)
+  {
+    setWindow(min_x, min_y, width, height);
+    clearDirty();
+  }
+
+  /**
+       * Moves/resizes the window keeping the content of the overlapping
+       * cells, new cells are UNKNOWN.
+       */
+  void setWindow(K new_min_x, K new_min_y, int new_width, int new_height)
+  {
+    std::vector<int8_t> new_data(long(new_width) * new_height, UNKNOWN);
+    for (int row = 0; row < height; row++)
+    {
+      long new_row = long(min_y) + row - new_min_y;
+      if (new_row < 0 || new_row >= new_height)
+        continue;
+      for (int col = 0; col < width; col++)
+      {
+        long new_col = long(min_x) + col - new_min_x;
+        if (new_col < 0 || new_col >= new_width)
+          continue;
+        new_data[new_row * new_width + new_col] = data[long(row) * width + col];
+      }
+    }
+    data.swap(new_data);
+    min_x = new_min_x;
+    min_y = new_min_y;
+    width = new_width;
+    height = new_height;
+    resized = true;
+  }
+
+  /**
+       * Grows the window, if allowed, to contain the index box
+       * [box_min_x, box_max_x] x [box_min_y, box_max_y].
+       */
+  void include(K box_min_x, K box_max_x, K box_min_y, K box_max_y)
+  {
+    if (!auto_grow || box_min_x > box_max_x || box_min_y > box_max_y)
+      return;
+    if (width > 0 && height > 0 && box_min_x >= min_x && box_min_y >= min_y &&
+        long(box_max_x) < long(min_x) + width &&
+        long(box_max_y) < long(min_y) + height)
+      return;
+
+    long x0 = box_min_x, x1 = box_max_x, y0 = box_min_y, y1 = box_max_y;
+    if (width > 0 && height > 0)
+    {
+      x0 = std::min(x0, long(min_x));
+      y0 = std::min(y0, long(min_y));
+      x1 = std::max(x1, long(min_x) + width - 1);
+      y1 = std::max(y1, long(min_y) + height - 1);
+    }
+    setWindow(K(x0), K(y0), int(x1 - x0 + 1), int(y1 - y0 + 1));
+  }
+
+  /**
+       * Linear index of a map cell, -1 if outside the window.
+       */
+  long cellIndex(K ix, K iy) const
+  {
+    long col = long(ix) - min_x;
+    long row = long(iy) - min_y;
+    if (col < 0 || col >= width || row < 0 || row >= height)
+      return -1;
+    return row * width + col;
+  }
+
+  void clearDirty()
+  {
+    dirty_min_col = dirty_min_row = 0;
+    dirty_max_col = dirty_max_row = -1;
+  }
+
+  void markDirty(int min_col, int max_col, int min_row, int max_row)
+  {
+    if (dirty_min_col > dirty_max_col)
+    {
+      dirty_min_col = min_col;
+      dirty_max_col = max_col;
+      dirty_min_row = min_row;
+      dirty_max_row = max_row;
+      return;
+    }
+    dirty_min_col = std::min(dirty_min_col, min_col);
+    dirty_max_col = std::max(dirty_max_col, max_col);
+    dirty_min_row = std::min(dirty_min_row, min_row);
+    dirty_max_row = std::max(dirty_max_row, max_row);
+  }
+};
+
+template <typename K>
+const int8_t OccupancyRaster<K>::OCCUPIED;
+template <typename K>
+const int8_t OccupancyRaster<K>::FREE;
+template <typename K>
+const int8_t OccupancyRaster<K>::UNKNOWN;
+}
+
+#endif /* OCCUPANCYRASTER_HPP */
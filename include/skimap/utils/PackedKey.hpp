@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef PACKEDKEY_HPP
+#define PACKEDKEY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace skimap {
+
+/**
+     * Packs an index (ix, iy, iz) in a single 64 bit key. Each index is
+     * biased to unsigned and uses at most 21 bits, keys are column-major
+     * (X, then Y, then Z) and never 0, so 0 is free to mark empty slots.
+     * K template represents datatype for indices.
+     */
+template <typename K> struct PackedKey {
+  typedef uint64_t Key;
+
+  static const int BITS = 8 * sizeof(K) < 21 ? 8 * sizeof(K) : 21;
+
+  /**
+       * Bias of the indices: valid ones are in [-bias, bias - 1].
+       */
+  static long bias() { return 1L << (BITS - 1); }
+
+  static Key unbias(K index) { return Key(long(index) + bias()); }
+
+  /**
+       * Packs biased indices; the +1 keeps keys above 0. A component one past
+       * its range (e.g. ux + 1) still gives a key past every key of the lower
+       * ones, which seeks rely on.
+       */
+  static Key pack(Key ux, Key uy, Key uz) {
+    return ((ux << (2 * BITS)) + (uy << BITS) + uz) + 1;
+  }
+
+  static void unpack(Key key, Key &ux, Key &uy, Key &uz) {
+    Key mask = (Key(1) << BITS) - 1;
+    key -= 1;
+    uz = key & mask;
+    uy = (key >> BITS) & mask;
+    ux = key >> (2 * BITS);
+  }
+
+  static Key packIndex(K ix, K iy, K iz) {
+    return pack(unbias(ix), unbias(iy), unbias(iz));
+  }
+
+  static void unpackIndex(Key key, K &ix, K &iy, K &iz) {
+    Key ux, uy, uz;
+    unpack(key, ux, uy, uz);
+    ix = K(long(ux) - bias());
+    iy = K(long(uy) - bias());
+    iz = K(long(uz) - bias());
+  }
+
+  /**
+       * Voxel keys of a batch of points given as arrays of coordinates
+       * (x[], y[], z[]), optionally moved by a rigid transform first. Each
+       * coordinate is scaled by the inverse resolution and floored, points
+       * outside [min_index, max_index] (clamped to the packable range) get
+       * key 0. The loop has no branches nor calls, so it vectorizes (omp
+       * simd). Scaling by the inverse resolution may differ from a division
+       * by one voxel on points lying exactly on a voxel boundary.
+       * @param transform rigid transform, 4x4 (or 3x4) row-major, or NULL
+       * @param keys OUTPUT 'size' keys
+       */
+  template <typename D>
+  static void fromCoordinates(const D *x, const D *y, const D *z, long size,
+                              const D inverse_resolution[3], long min_index,
+                              long max_index, const D *transform, Key *keys) {
+    static const D IDENTITY[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+    const D *t = transform != NULL ? transform : IDENTITY;
+    const D t0 = t[0], t1 = t[1], t2 = t[2], t3 = t[3];
+    const D t4 = t[4], t5 = t[5], t6 = t[6], t7 = t[7];
+    const D t8 = t[8], t9 = t[9], t10 = t[10], t11 = t[11];
+    const D rx = inverse_resolution[0], ry = inverse_resolution[1],
+            rz = inverse_resolution[2];
+    // floor(s) in range iff lo <= s < hi + 1
+    const D lo = D(std::max(min_index, -bias()));
+    const D hi = D(std::min(max_index, bias() - 1) + 1);
+    const int offset = int(bias());
+
+#pragma omp simd
+    for (long i = 0; i < size; i++) {
+      D sx = (t0 * x[i] + t1 * y[i] + t2 * z[i] + t3) * rx;
+      D sy = (t4 * x[i] + t5 * y[i] + t6 * z[i] + t7) * ry;
+      D sz = (t8 * x[i] + t9 * y[i] + t10 * z[i] + t11) * rz;
+      // bitwise, not short-circuit, operators keep the loop branch free
+      int valid = (sx >= lo) & (sx < hi) & (sy >= lo) & (sy < hi) &
+                  (sz >= lo) & (sz < hi);
+      // out of range values (or NaN) never reach the integer conversion
+      sx = _keepIf(sx, valid);
+      sy = _keepIf(sy, valid);
+      sz = _keepIf(sz, valid);
+      // floor as truncation corrected on negative values
+      int fx = int(sx), fy = int(sy), fz = int(sz);
+      fx -= sx < D(fx);
+      fy -= sy < D(fy);
+      fz -= sz < D(fz);
+      Key key = pack(Key(fx + offset), Key(fy + offset), Key(fz + offset));
+      keys[i] = key * Key(valid);
+    }
+  }
+
+  /**
+       * 'value' if 'keep' is 1, 0 if it is 0. Works on the bits of the value,
+       * since a select on floating point values does not vectorize.
+       */
+  template <typename D> static D _keepIf(D value, int keep) {
+    typedef typename std::conditional<sizeof(D) == 4, int32_t, int64_t>::type
+        Bits;
+    Bits bits;
+    std::memcpy(&bits, &value, sizeof(D));
+    bits &= -Bits(keep);
+    std::memcpy(&value, &bits, sizeof(D));
+    return value;
+  }
+};
+}
+
+#endif /* PACKEDKEY_HPP */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef PARALLELFETCH_HPP
+#define PARALLELFETCH_HPP
+
+#include <algorithm>
+#include <omp.h>
+#include <vector>
+
+namespace skimap
+{
+
+/**
+     * Two-pass parallel gather. A first parallel pass counts the outputs of
+     * each work item, an exclusive prefix sum gives each item its offset and
+     * a second parallel pass lets every item write its outputs directly in
+     * place. No thread-private copies nor critical sections are involved.
+     * The output vector is resized, never cleared, so a vector reused across
+     * calls keeps its capacity and is not reallocated.
+     * @param items number of work items (e.g. X columns)
+     * @param count functor long(int item) returning the outputs of an item
+     * @param fill functor void(int item, T *output) writing exactly
+     * count(item) outputs starting from 'output'
+     * @param output OUTPUT vector
+     */
+template <class T, class COUNT, class FILL>
+void parallelGather(int items, COUNT count, FILL fill, std::vector<T> &output)
+{
+  std::vector<long> offsets(items + 1, 0);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < items; i++)
+  {
+    offsets[i + 1] = count(i);
+  }
+
+  for (int i = 0; i < items; i++)
+  {
+    offsets[i + 1] += offsets[i];
+  }
+
+  output.resize(offsets[items]);
+  if (offsets[items] == 0)
+    return;
+
+  T *data = &output[0];
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < items; i++)
+  {
+    if (offsets[i + 1] > offsets[i])
+      fill(i, data + offsets[i]);
+  }
+}
+
+/**
+     * Two-pass parallel gather over a source that may change between the
+     * passes (e.g. a map read under an epoch while it is being integrated).
+     * Each item writes at most the outputs counted in the first pass, the
+     * ones added in the meantime are dropped, and items writing less leave
+     * holes that are compacted at the end.
+     * @param items number of work items (e.g. X columns)
+     * @param count functor long(int item) returning the outputs of an item
+     * @param fill functor long(int item, T *output, long capacity) writing
+     * at most 'capacity' outputs starting from 'output' and returning how
+     * many it wrote
+     * @param output OUTPUT vector
+     */
+template <class T, class COUNT, class FILL>
+void parallelGatherBounded(int items, COUNT count, FILL fill,
+                           std::vector<T> &output)
+{
+  std::vector<long> offsets(items + 1, 0);
+  std::vector<long> written(items, 0);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < items; i++)
+  {
+    offsets[i + 1] = count(i);
+  }
+
+  for (int i = 0; i < items; i++)
+  {
+    offsets[i + 1] += offsets[i];
+  }
+
+  output.resize(offsets[items]);
+  if (offsets[items] == 0)
+    return;
+
+  T *data = &output[0];
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < items; i++)
+  {
+    long capacity = offsets[i + 1] - offsets[i];
+    if (capacity > 0)
+      written[i] = fill(i, data + offsets[i], capacity);
+  }
+
+  long size = 0;
+  for (int i = 0; i < items; i++)
+  {
+    if (size != offsets[i])
+      std::copy(data + offsets[i], data + offsets[i] + written[i],
+                data + size);
+    size += written[i];
+  }
+  output.resize(size);
+}
+}
+
+#endif /* PARALLELFETCH_HPP */
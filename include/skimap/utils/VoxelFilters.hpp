@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef VOXELFILTERS_HPP
+#define VOXELFILTERS_HPP
+
+#include <cstddef>
+
+namespace skimap
+{
+
+/**
+     * Filter accepting every voxel. Used as default filter by queries.
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct AllVoxelsFilter
+{
+  bool operator()(const V *data) const { return data != NULL; }
+};
+
+/**
+     * Filter accepting voxels whose weight is greater or equal than a
+     * threshold. User data must expose a 'w' field (e.g. VoxelDataRGBW).
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct MinWeightFilter
+{
+  double min_weight;
+
+  MinWeightFilter(double min_weight) : min_weight(min_weight) {}
+
+  bool operator()(const V *data) const
+  {
+    return data != NULL && double(data->w) >= min_weight;
+  }
+};
+
+/**
+     * Filter accepting voxels with a positive weight. As deintegration
+     * filter it erases the voxels whose weight reached zero. User data must
+     * expose a 'w' field (e.g. VoxelDataRGBW).
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct PositiveWeightFilter
+{
+  bool operator()(const V *data) const
+  {
+    return data != NULL && data->w > 0;
+  }
+};
+}
+
+#endif /* VOXELFILTERS_HPP */
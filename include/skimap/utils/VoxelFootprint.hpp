@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef VOXELFOOTPRINT_HPP
+#define VOXELFOOTPRINT_HPP
+
+#include <vector>
+
+namespace skimap
+{
+
+/**
+     * Compressed set of voxels sorted by (ix, iy, iz), each with a payload,
+     * e.g. what a keyframe integrated in a map. Keys are delta encoded as
+     * varints: a voxel following another one in the same column costs a
+     * couple of bytes instead of three full indices. Payloads are stored
+     * as they are.
+     * ENTRY must expose ix, iy, iz and data fields (see
+     * SkipListMapV2::SourceVoxel).
+     * K template represents datatype for indices.
+     * V template represents datatype for payloads.
+     */
+template <typename K, typename V>
+class VoxelFootprint
+{
+public:
+  VoxelFootprint() {}
+
+  /**
+       * Replaces the content with sorted entries, without duplicates.
+       */
+  template <class ENTRY>
+  void encode(const std::vector<ENTRY> &entries)
+  {
+    _keys.clear();
+    _values.clear();
+    _values.reserve(entries.size());
+    long px = 0, py = 0, pz = 0;
+    for (long i = 0; i < long(entries.size()); i++)
+    {
+      long x = entries[i].ix, y = entries[i].iy, z = entries[i].iz;
+      _putSigned(x - px);
+      if (i == 0 || x != px)
+      {
+        _putSigned(y - py);
+        _putSigned(z - pz);
+      }
+      else if (y != py)
+      {
+        _putUnsigned(y - py);
+        _putSigned(z - pz);
+      }
+      else
+      {
+        // same column: the Z step is at least 1
+        _putUnsigned(0);
+        _putUnsigned(z - pz - 1);
+      }
+      px = x;
+      py = y;
+      pz = z;
+      _values.push_back(entries[i].data);
+    }
+    std::vector<unsigned char>(_keys).swap(_keys);
+  }
+
+  /**
+       * Decodes the entries, sorted by key.
+       * @param entries OUTPUT entries
+       */
+  template <class ENTRY>
+  void decode(std::vector<ENTRY> &entries) const
+  {
+    entries.resize(_values.size());
+    long px = 0, py = 0, pz = 0;
+    long offset = 0;
+    for (long i = 0; i < long(_values.size()); i++)
+    {
+      long x = px + _getSigned(offset);
+      long y, z;
+      if (i == 0 || x != px)
+      {
+        y = py + _getSigned(offset);
+        z = pz + _getSigned(offset);
+      }
+      else
+      {
+        long dy = _getUnsigned(offset);
+        y = py + dy;
+        z = dy != 0 ? pz + _getSigned(offset) : pz + 1 + _getUnsigned(offset);
+      }
+      entries[i].ix = K(x);
+      entries[i].iy = K(y);
+      entries[i].iz = K(z);
+      entries[i].data = _values[i];
+      px = x;
+      py = y;
+      pz = z;
+    }
+  }
+
+  /**
+       * @return number of voxels
+       */
+  long size() const { return _values.size(); }
+
+  /**
+       * @return bytes used by keys and payloads
+       */
+  long bytes() const { return _keys.size() + _values.size() * sizeof(V); }
+
+protected:
+  void _putUnsigned(unsigned long value)
+  {
+    while (value >= 0x80)
+    {
+      _keys.push_back((unsigned char)(value | 0x80));
+      value >>= 7;
+    }
+    _keys.push_back((unsigned char)value);
+  }
+
+  void _putSigned(long value)
+  {
+    // zigzag: small magnitudes of both signs get short codes
+    _putUnsigned(value < 0 ? ((unsigned long)(-(value + 1)) << 1) | 1
+                           : (unsigned long)value << 1);
+  }
+
+  unsigned long _getUnsigned(long &offset) const
+  {
+    unsigned long value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do
+    {
+      byte = _keys[offset++];
+      value |= (unsigned long)(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    return value;
+  }
+
+  long _getSigned(long &offset) const
+  {
+    unsigned long value = _getUnsigned(offset);
+    return (value & 1) ? -long(value >> 1) - 1 : long(value >> 1);
+  }
+
+  std::vector<unsigned char> _keys;
+  std::vector<V> _values;
+};
+}
+
+#endif /* VOXELFOOTPRINT_HPP */
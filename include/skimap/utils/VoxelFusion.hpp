@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#ifndef VOXELFUSION_HPP
+#define VOXELFUSION_HPP
+
+namespace skimap
+{
+
+/**
+     * Fusion policy summing the two voxels (V operator+), as integrateVoxel
+     * does. Used as default policy by merges.
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct SumFusion
+{
+  V operator()(const V &mine, const V &theirs) const { return mine + theirs; }
+};
+
+/**
+     * Fusion policy keeping the voxel of the target map.
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct KeepFusion
+{
+  V operator()(const V &mine, const V &theirs) const { return mine; }
+};
+
+/**
+     * Fusion policy replacing the voxel of the target map with the merged
+     * one.
+     * V template represents datatype for user data.
+     */
+template <typename V>
+struct ReplaceFusion
+{
+  V operator()(const V &mine, const V &theirs) const { return theirs; }
+};
+}
+
+#endif /* VOXELFUSION_HPP */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+
+// Skimap
+#include <skimap/DistanceField.hpp>
+#include <skimap/SkiMap.hpp>
+#include <skimap/voxels/VoxelDataRGBW.hpp>
+
+/**
+ * Distance field fed by the version journal of a SkiMap. Each round
+ * integrates a batch of random voxels and erases a random box, then the
+ * field integrates the changes since the previous round; every few rounds
+ * the erased columns are pruned first, forcing the full obstacle check.
+ * Distances are checked against a brute force search of the occupied
+ * voxels.
+ *
+ * usage: distance_field_test ROUNDS BATCH EXTENT MAX_DISTANCE
+ * Voxels are random in [0, EXTENT)^3 indices, voxels with weight below 2
+ * are not obstacles.
+ */
+
+typedef float CoordinatesType;
+typedef int16_t IndexType;
+typedef skimap::VoxelDataRGBW<uint16_t, float> VoxelData;
+typedef skimap::SkiMap<VoxelData, IndexType, CoordinatesType> SKIMAP;
+typedef skimap::DistanceField<IndexType, CoordinatesType> FIELD;
+
+const CoordinatesType resolution = 0.1;
+const CoordinatesType min_weight = 2;
+
+/**
+ * Cells of the box around the voxels whose field distance differs from
+ * the brute force one.
+ */
+int checkField(SKIMAP &map, FIELD &field, int extent) {
+  std::vector<SKIMAP::Voxel3D> obstacles;
+  map.fetchVoxels(obstacles, skimap::MinWeightFilter<VoxelData>(min_weight));
+  int margin = int(field.maxDistance() / resolution) + 1;
+
+  int failures = 0;
+  for (int x = -margin; x < extent + margin; x++) {
+    for (int y = -margin; y < extent + margin; y++) {
+      for (int z = -margin; z < extent + margin; z++) {
+        CoordinatesType cx, cy, cz;
+        map.indexToCoordinates(IndexType(x), IndexType(y), IndexType(z), cx,
+                               cy, cz);
+        CoordinatesType best = std::numeric_limits<CoordinatesType>::max();
+        for (int i = 0; i < obstacles.size(); i++) {
+          CoordinatesType d = std::sqrt(std::pow(obstacles[i].x - cx, 2) +
+                                        std::pow(obstacles[i].y - cy, 2) +
+                                        std::pow(obstacles[i].z - cz, 2));
+          best = std::min(best, d);
+        }
+        // cells at the truncation distance may go either way
+        if (std::fabs(best - field.maxDistance()) < 1e-4)
+          continue;
+        bool near = best < field.maxDistance();
+        CoordinatesType distance;
+        bool found = field.getDistance(IndexType(x), IndexType(y),
+                                       IndexType(z), distance);
+        if (found != near || (near && std::fabs(distance - best) > 1e-3)) {
+          failures++;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 8;
+  int batch = argc > 2 ? atoi(argv[2]) : 60;
+  int extent = argc > 3 ? atoi(argv[3]) : 20;
+  CoordinatesType max_distance = argc > 4 ? atof(argv[4]) : 0.5;
+
+  SKIMAP map(resolution);
+  FIELD field(resolution, max_distance);
+  SKIMAP::Version fed_version = 0;
+  skimap::MinWeightFilter<VoxelData> occupied(min_weight);
+
+  srand(0);
+  int failures = 0;
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < batch; i++) {
+      VoxelData voxel(255, 255, 255, 1);
+      map.integrateVoxel(IndexType(rand() % extent),
+                         IndexType(rand() % extent),
+                         IndexType(rand() % extent), &voxel);
+    }
+    if (round > 0) {
+      IndexType x = rand() % extent, y = rand() % extent;
+      map.eraseRegion(SKIMAP::IndexBox(x, x + extent / 4, y, y + extent / 4,
+                                       0, IndexType(extent)));
+    }
+
+    SKIMAP::Version version = map.commitVersion();
+    if (round % 4 == 3) {
+      map.pruneErasedUpTo(version);
+    }
+    field.integrateChangedSince(map, fed_version, occupied);
+    fed_version = version;
+
+    int round_failures = checkField(map, field, extent);
+    printf("round %d: %ld voxels, %d failures\n", round, map.voxelsCount(),
+           round_failures);
+    failures += round_failures;
+  }
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Skimap
+#include <skimap/FinalMap.hpp>
+#include <skimap/HashedVoxelMap.hpp>
+#include <skimap/SkiMap.hpp>
+#include <skimap/voxels/VoxelDataRGBW.hpp>
+
+/**
+ * Per-voxel cost of integrateVoxel and find, called through a pointer to the
+ * map (virtual dispatch) and on its FinalMap variant (static binding).
+ *
+ * usage: integration_benchmark N_POINTS EXTENT RESOLUTION REPETITIONS
+ * Points are random in a cube of side EXTENT meters, integrated REPETITIONS
+ * times; a small cube keeps the map in cache and isolates the call overhead.
+ */
+
+typedef float CoordinatesType;
+typedef int16_t IndexType;
+typedef skimap::VoxelDataRGBW<uint16_t, float> VoxelData;
+typedef skimap::SkiMap<VoxelData, IndexType, CoordinatesType> SKIMAP;
+typedef skimap::HashedVoxelMap<VoxelData, IndexType, CoordinatesType>
+    HASHED_MAP;
+
+auto _current_time = std::chrono::high_resolution_clock::now();
+void getTime() { _current_time = std::chrono::high_resolution_clock::now(); }
+
+/**
+ * Nanoseconds elapsed since the last getTime/deltaTime.
+ */
+double deltaTime() {
+  auto t1 = _current_time;
+  getTime();
+  auto t2 = _current_time;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+}
+
+template <class MAP>
+void benchmark(const char *name, MAP *map, std::vector<CoordinatesType> &points,
+               int repetitions) {
+  VoxelData voxel(255, 255, 255, 1);
+  long calls = repetitions * long(points.size() / 3);
+  long found = 0;
+
+  getTime();
+  for (int r = 0; r < repetitions; r++) {
+    for (size_t i = 0; i < points.size(); i += 3) {
+      map->integrateVoxel(points[i], points[i + 1], points[i + 2], &voxel);
+    }
+  }
+  double t_integrate = deltaTime() / calls;
+
+  for (int r = 0; r < repetitions; r++) {
+    for (size_t i = 0; i < points.size(); i += 3) {
+      found += map->find(points[i], points[i + 1], points[i + 2]) != NULL;
+    }
+  }
+  double t_find = deltaTime() / calls;
+
+  printf("%-24s integrate %8.1f ns/voxel   find %8.1f ns/voxel   (%ld found)\n",
+         name, t_integrate, t_find, found);
+}
+
+int main(int argc, char **argv) {
+  int n_points = argc > 1 ? atoi(argv[1]) : 200000;
+  CoordinatesType extent = argc > 2 ? atof(argv[2]) : 1.0;
+  CoordinatesType resolution = argc > 3 ? atof(argv[3]) : 0.05;
+  int repetitions = argc > 4 ? atoi(argv[4]) : 10;
+
+  srand(0);
+  std::vector<CoordinatesType> points(3 * n_points);
+  for (size_t i = 0; i < points.size(); i++) {
+    points[i] = extent * rand() / CoordinatesType(RAND_MAX);
+  }
+
+  SKIMAP *map = new SKIMAP(resolution);
+  map->enableConcurrencyAccess(false);
+  benchmark("SkiMap (virtual)", map, points, repetitions);
+  delete map;
+
+  skimap::FinalMap<SKIMAP> *final_map =
+      new skimap::FinalMap<SKIMAP>(resolution);
+  final_map->enableConcurrencyAccess(false);
+  benchmark("SkiMap (final)", final_map, points, repetitions);
+  delete final_map;
+
+  HASHED_MAP *hashed_map = new HASHED_MAP(resolution);
+  hashed_map->enableConcurrencyAccess(false);
+  benchmark("HashedVoxelMap (virtual)", hashed_map, points, repetitions);
+  delete hashed_map;
+
+  skimap::FinalMap<HASHED_MAP> *final_hashed_map =
+      new skimap::FinalMap<HASHED_MAP>(resolution);
+  final_hashed_map->enableConcurrencyAccess(false);
+  benchmark("HashedVoxelMap (final)", final_hashed_map, points, repetitions);
+  delete final_hashed_map;
+
+  return 0;
+}
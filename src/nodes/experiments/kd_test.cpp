@@ -34,6 +34,7 @@
 
 // Skimap
 #include <skimap/KDSkipList.hpp>
+#include <skimap/StaticKDSkipList.hpp>
 #include <skimap/voxels/VoxelDataMatrix.hpp>
 
 #define MAX_RANDOM_COLOR 1.0
@@ -207,6 +208,47 @@ std::vector<int> computeFlann(int ndim, Points &points, CoordinatesType radius,
   return indices;
 }
 
+/**
+ * Same benchmark as the "kdskip" branch on StaticKDSkipList, DIM fixed at
+ * compile time.
+ */
+template <int N>
+void computeStaticKDSkip(Points &points, float resolution, CoordinatesType radius, std::string name)
+{
+  typedef skimap::StaticKDSkipList<VoxelData, IndexType, CoordinatesType, N> StaticKD;
+  typedef typename StaticKD::VoxelKD Voxel;
+
+  StaticKD kd_skip_list(resolution);
+  kd_skip_list.enableConcurrencyAccess(true);
+
+  getTime();
+
+#pragma omp parallel for
+  for (int i = 0; i < points.size(); i++)
+  {
+    typename StaticKD::Coordinates cds;
+    std::copy(points[i].begin(), points[i].end(), cds.begin());
+    VoxelData voxel;
+    voxel.matrix.push_back(points[i]);
+    kd_skip_list.integrateVoxel(cds, &voxel);
+  }
+  double time_creation = deltaTime();
+
+  typename StaticKD::Coordinates radius_center;
+  radius_center.fill(MAX_RANDOM_COORD / 2.0);
+
+  getTime();
+  std::vector<Voxel> voxels;
+  kd_skip_list.radiusSearch(radius_center, radius, voxels);
+  double time_search = deltaTime();
+
+  double vm, rss;
+  process_mem_usage(vm, rss);
+  double memory = rss;
+
+  printResults(name, time_creation, time_search, memory);
+}
+
 int main(int argc, char **argv)
 {
 
@@ -317,6 +359,56 @@ int main(int argc, char **argv)
       }
     }
   }
+  else if (algo.compare("kdskip_batch") == 0)
+  {
+    skimap::KDSkipList<VoxelData, IndexType, CoordinatesType> kd_skip_list(DIM, resolution);
+    typedef skimap::KDSkipList<VoxelData, IndexType, CoordinatesType>::VoxelKD Voxel;
+
+    kd_skip_list.enableConcurrencyAccess(true);
+
+    // the voxels are built in the timed section, as the other algorithms do
+    getTime();
+    std::vector<VoxelData> voxels_data(integration_data.size());
+    for (int i = 0; i < integration_data.size(); i++)
+    {
+      voxels_data[i].matrix.push_back(integration_data[i]);
+    }
+    kd_skip_list.integrateVoxels(integration_data, voxels_data.data());
+    double time_creation = deltaTime();
+
+    std::vector<CoordinatesType> radius_center(DIM, MAX_RANDOM_COORD / 2.0);
+
+    getTime();
+    std::vector<Voxel> voxels;
+    kd_skip_list.radiusSearch(radius_center, radius, voxels);
+    double time_search = deltaTime();
+
+    double vm, rss;
+    process_mem_usage(vm, rss);
+    double memory = rss;
+
+    printResults(algo, time_creation, time_search, memory);
+  }
+  else if (algo.compare("kdskip_static") == 0)
+  {
+    switch (DIM)
+    {
+    case 2:
+      computeStaticKDSkip<2>(integration_data, resolution, radius, algo);
+      break;
+    case 3:
+      computeStaticKDSkip<3>(integration_data, resolution, radius, algo);
+      break;
+    case 4:
+      computeStaticKDSkip<4>(integration_data, resolution, radius, algo);
+      break;
+    case 5:
+      computeStaticKDSkip<5>(integration_data, resolution, radius, algo);
+      break;
+    default:
+      printf(" unsupported dimension");
+    }
+  }
 
   if (_debug)
   {
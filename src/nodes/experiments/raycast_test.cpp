@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2017 daniele de gregorio, University of Bologna - All Rights
+ * Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the GNU GPLv3 license.
+ *
+ * please write to: d.degregorio@unibo.it
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Skimap
+#include <skimap/SkiMap.hpp>
+#include <skimap/voxels/VoxelDataRGBW.hpp>
+
+/**
+ * Ray casting along single axes. Rays without components on the other axes
+ * cross missing X branches and columns for their whole range, every cast
+ * is checked against a voxel by voxel walk of the same axis.
+ *
+ * usage: raycast_test N_VOXELS EXTENT RANGE
+ * Voxels are random in [-EXTENT, EXTENT)^3 indices, rays start from the
+ * index grid and stop at RANGE meters.
+ */
+
+typedef float CoordinatesType;
+typedef int16_t IndexType;
+typedef skimap::VoxelDataRGBW<uint16_t, float> VoxelData;
+typedef skimap::SkiMap<VoxelData, IndexType, CoordinatesType> SKIMAP;
+
+const CoordinatesType resolution = 0.1;
+
+/**
+ * Distance of the first voxel met walking from 'index' along 'axis', -1 if
+ * none is within 'range'.
+ */
+CoordinatesType walkAxis(SKIMAP &map, long index[3], int axis, int step,
+                         CoordinatesType range) {
+  long cell[3] = {index[0], index[1], index[2]};
+  for (int i = 0; i * resolution <= range; i++) {
+    if (map.find(IndexType(cell[0]), IndexType(cell[1]),
+                 IndexType(cell[2])) != NULL) {
+      // the origin is the center of its cell
+      return i == 0 ? 0 : (i - 0.5) * resolution;
+    }
+    cell[axis] += step;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int n_voxels = argc > 1 ? atoi(argv[1]) : 2000;
+  int extent = argc > 2 ? atoi(argv[2]) : 40;
+  CoordinatesType range = argc > 3 ? atof(argv[3]) : 10.0;
+
+  SKIMAP map(resolution);
+  srand(0);
+  for (int i = 0; i < n_voxels; i++) {
+    VoxelData voxel(255, 255, 255, 1);
+    map.integrateVoxel(IndexType(rand() % (2 * extent) - extent),
+                       IndexType(rand() % (2 * extent) - extent),
+                       IndexType(rand() % (2 * extent) - extent), &voxel);
+  }
+
+  int casts = 0, hits = 0, failures = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    for (int step = -1; step <= 1; step += 2) {
+      // origins also outside the voxels extent, i.e. in missing branches
+      for (int i = 0; i < 500; i++) {
+        long index[3];
+        for (int a = 0; a < 3; a++) {
+          index[a] = rand() % (4 * extent) - 2 * extent;
+        }
+        CoordinatesType direction[3] = {0, 0, 0};
+        direction[axis] = step;
+
+        SKIMAP::RayHit hit;
+        bool found = map.castRay((index[0] + 0.5) * resolution,
+                                 (index[1] + 0.5) * resolution,
+                                 (index[2] + 0.5) * resolution, direction[0],
+                                 direction[1], direction[2], range, hit);
+        CoordinatesType expected = walkAxis(map, index, axis, step, range);
+        if (found != (expected >= 0) ||
+            (found && std::fabs(hit.distance - expected) > 1e-3)) {
+          failures++;
+        }
+        casts++;
+        hits += found;
+      }
+    }
+  }
+
+  printf("%d rays, %d hits, %d failures\n", casts, hits, failures);
+  return failures == 0 ? 0 : 1;
+}
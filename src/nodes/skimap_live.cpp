@@ -17,9 +17,11 @@
 #include <string.h>
 
 // ROS
+#include <map_msgs/OccupancyGridUpdate.h>
 #include <message_filters/subscriber.h>
 #include <message_filters/sync_policies/approximate_time.h>
 #include <message_filters/time_synchronizer.h>
+#include <nav_msgs/OccupancyGrid.h>
 #include <ros/ros.h>
 #include <tf/transform_listener.h>
 #include <visualization_msgs/MarkerArray.h>
@@ -30,6 +32,7 @@
 #include <opencv2/opencv.hpp>
 
 // Skimap
+#include <skimap/HashedVoxelMap.hpp>
 #include <skimap/SkiMap.hpp>
 #include <skimap/voxels/VoxelDataRGBW.hpp>
 
@@ -38,7 +41,9 @@ typedef skimap::VoxelDataRGBW<uint16_t, float> VoxelDataColor;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float> SKIMAP;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float>::Voxel3D Voxel3D;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float>::Tiles2D Tiles2D;
-SKIMAP *map;
+typedef skimap::HashedVoxelMap<VoxelDataColor, int16_t, float> HASHED_MAP;
+SKIMAP *map = NULL;
+HASHED_MAP *hashed_map = NULL;
 
 // Ros
 ros::NodeHandle *nh;
@@ -46,6 +51,24 @@ tf::TransformListener *tf_listener;
 ros::Publisher cloud_publisher;
 ros::Publisher map_publisher;
 ros::Publisher map_2d_publisher;
+ros::Publisher grid_publisher;
+ros::Publisher grid_update_publisher;
+
+/**
+ * Marker content of a (X,Y) column
+ */
+struct ColumnMarker {
+  std::vector<geometry_msgs::Point> points;
+  std::vector<std_msgs::ColorRGBA> colors;
+};
+
+// 3D Map and 2D Grid kept across frames, updated only on changed columns
+std::map<std::pair<int16_t, int16_t>, ColumnMarker> voxels_cache;
+std::map<std::pair<int16_t, int16_t>, Tiles2D> tiles_cache;
+SKIMAP::Version published_version = 0;
+
+// Occupancy Grid rasterized in place, updated only on changed columns
+SKIMAP::Raster occupancy_raster;
 
 // Live Params
 std::string base_frame_name = "slam_map";
@@ -287,6 +310,47 @@ void fillVisualizationMarkerWithVoxels(
   }
 }
 
+/**
+ * Publishes the Occupancy Grid raster: the whole grid if its window changed,
+ * an update message with the dirty rectangle otherwise.
+ * @param frame_id Target frame
+ * @param time Timestamp
+ * @param raster Occupancy raster
+ */
+void publishOccupancyGrid(std::string frame_id, ros::Time time,
+                          SKIMAP::Raster &raster) {
+  if (raster.resized) {
+    nav_msgs::OccupancyGrid grid;
+    grid.header.frame_id = frame_id;
+    grid.header.stamp = time;
+    grid.info.map_load_time = time;
+    grid.info.resolution = mapParameters.map_resolution;
+    grid.info.width = raster.width;
+    grid.info.height = raster.height;
+    grid.info.origin.position.x = raster.min_x * mapParameters.map_resolution;
+    grid.info.origin.position.y = raster.min_y * mapParameters.map_resolution;
+    grid.info.origin.position.z = mapParameters.ground_level;
+    grid.info.origin.orientation.w = 1.0;
+    grid.data = raster.data;
+    grid_publisher.publish(grid);
+  } else if (raster.dirty_min_col <= raster.dirty_max_col) {
+    map_msgs::OccupancyGridUpdate update;
+    update.header.frame_id = frame_id;
+    update.header.stamp = time;
+    update.x = raster.dirty_min_col;
+    update.y = raster.dirty_min_row;
+    update.width = raster.dirty_max_col - raster.dirty_min_col + 1;
+    update.height = raster.dirty_max_row - raster.dirty_min_row + 1;
+    update.data.reserve(update.width * update.height);
+    for (int row = raster.dirty_min_row; row <= raster.dirty_max_row; row++) {
+      std::vector<int8_t>::iterator begin =
+          raster.data.begin() + long(row) * raster.width + update.x;
+      update.data.insert(update.data.end(), begin, begin + update.width);
+    }
+    grid_update_publisher.publish(update);
+  }
+}
+
 /**
  * Fills Visualization Marker with 2D Tiles coming from a 2D Query in SkiMap.
  * Represent in a black/white chessboard the occupied/free space respectively
@@ -377,10 +441,11 @@ struct IntegrationParameters {
  * "commitBatchIntegration". By removing
  * these two lines the integration will be launched in single-thread mode
  * @param measurement
- * @param map
+ * @param map either backend (SKIMAP or HASHED_MAP)
  * @param base_to_camera
  */
-void integrateMeasurement(SensorMeasurement measurement, SKIMAP *&map,
+template <class MAP>
+void integrateMeasurement(SensorMeasurement measurement, MAP *&map,
                           tf::Transform base_to_camera) {
 
   std::vector<ColorPoint> points = measurement.points;
@@ -406,6 +471,93 @@ void integrateMeasurement(SensorMeasurement measurement, SKIMAP *&map,
   integrationParameters.integration_counter++;
 }
 
+/**
+ * Publishes the 3D Map, the 2D Grid and the Occupancy Grid. Only the columns
+ * changed since the last call are fetched, the caches of the others are
+ * reused; erased columns are dropped from the caches
+ * @param stamp Timestamp
+ */
+void publishMaps(ros::Time stamp) {
+  SKIMAP::Version version = map->commitVersion();
+  SKIMAP::Version since = published_version;
+  std::vector<SKIMAP::ErasedColumn> erased;
+  if (!map->fetchErasedSince(since, erased)) {
+    // removals were pruned, caches are rebuilt from the whole map
+    voxels_cache.clear();
+    tiles_cache.clear();
+    since = 0;
+  }
+  for (int i = 0; i < erased.size(); i++) {
+    std::pair<int16_t, int16_t> column(erased[i].ix, erased[i].iy);
+    voxels_cache.erase(column);
+    tiles_cache.erase(column);
+  }
+
+  /**
+   * 3D Map Publisher. Every voxel of a changed column is fetched, so the
+   * cached column is replaced as a whole
+   */
+  std::vector<Voxel3D> changed_voxels;
+  map->fetchChangedSince(since, changed_voxels);
+  visualization_msgs::Marker changed_marker;
+  fillVisualizationMarkerWithVoxels(changed_marker, changed_voxels,
+                                    mapParameters.min_voxel_weight);
+  int16_t ix, iy, iz;
+  for (int i = 0; i < changed_voxels.size(); i++) {
+    map->coordinatesToIndex(changed_voxels[i].x, changed_voxels[i].y,
+                            changed_voxels[i].z, ix, iy, iz);
+    voxels_cache.erase(std::make_pair(ix, iy));
+  }
+  for (int i = 0; i < changed_marker.points.size(); i++) {
+    const geometry_msgs::Point &point = changed_marker.points[i];
+    map->coordinatesToIndex(point.x, point.y, point.z, ix, iy, iz);
+    ColumnMarker &column = voxels_cache[std::make_pair(ix, iy)];
+    column.points.push_back(point);
+    column.colors.push_back(changed_marker.colors[i]);
+  }
+  visualization_msgs::Marker map_marker = createVisualizationMarker(
+      base_frame_name, stamp, 1, VisualizationType::VOXEL_MAP);
+  for (auto it = voxels_cache.begin(); it != voxels_cache.end(); ++it) {
+    map_marker.points.insert(map_marker.points.end(),
+                             it->second.points.begin(),
+                             it->second.points.end());
+    map_marker.colors.insert(map_marker.colors.end(),
+                             it->second.colors.begin(),
+                             it->second.colors.end());
+  }
+  map_publisher.publish(map_marker);
+
+  /**
+   * 2D Grid Publisher
+   */
+  std::vector<Tiles2D> changed_tiles;
+  map->fetchChangedSince(since, changed_tiles, mapParameters.agent_height);
+  for (int i = 0; i < changed_tiles.size(); i++) {
+    map->coordinatesToIndex(changed_tiles[i].x, changed_tiles[i].y,
+                            changed_tiles[i].z, ix, iy, iz);
+    tiles_cache[std::make_pair(ix, iy)] = changed_tiles[i];
+  }
+  std::vector<Tiles2D> tiles;
+  tiles.reserve(tiles_cache.size());
+  for (auto it = tiles_cache.begin(); it != tiles_cache.end(); ++it) {
+    tiles.push_back(it->second);
+  }
+  visualization_msgs::Marker map_2d_marker = createVisualizationMarker(
+      base_frame_name, stamp, 1, VisualizationType::VOXEL_GRID);
+  fillVisualizationMarkerWithTiles(map_2d_marker, tiles);
+  map_2d_publisher.publish(map_2d_marker);
+
+  /**
+   * Occupancy Grid Publisher
+   */
+  map->rasterizeChangedSince(
+      published_version, occupancy_raster, mapParameters.agent_height,
+      skimap::MinWeightFilter<VoxelDataColor>(mapParameters.min_voxel_weight));
+  publishOccupancyGrid(base_frame_name, stamp, occupancy_raster);
+  published_version = version;
+  map->pruneErasedUpTo(published_version);
+}
+
 /**
  * RGB + DEPTH callback
  */
@@ -455,29 +607,37 @@ void callback(const sensor_msgs::ImageConstPtr &rgb_msg,
    * Map Integration
    */
   timings.startTimer("Integration");
-  integrateMeasurement(measurement, map, base_to_camera);
+  if (hashed_map != NULL)
+    integrateMeasurement(measurement, hashed_map, base_to_camera);
+  else
+    integrateMeasurement(measurement, map, base_to_camera);
   timings.printTime("Integration");
 
   /**
-   * 3D Map Publisher
+   * 3D Map and 2D Grid Publishers. The hashed backend has no column
+   * versions: it fetches the whole map and publishes no occupancy grid
    */
-  std::vector<Voxel3D> voxels;
-  map->fetchVoxels(voxels);
-  visualization_msgs::Marker map_marker = createVisualizationMarker(
-      base_frame_name, rgb_msg->header.stamp, 1, VisualizationType::VOXEL_MAP);
-  fillVisualizationMarkerWithVoxels(map_marker, voxels,
-                                    mapParameters.min_voxel_weight);
-  map_publisher.publish(map_marker);
-
-  /**
-   * 2D Grid Publisher
-   */
-  std::vector<Tiles2D> tiles;
-  map->fetchTiles(tiles, mapParameters.agent_height);
-  visualization_msgs::Marker map_2d_marker = createVisualizationMarker(
-      base_frame_name, rgb_msg->header.stamp, 1, VisualizationType::VOXEL_GRID);
-  fillVisualizationMarkerWithTiles(map_2d_marker, tiles);
-  map_2d_publisher.publish(map_2d_marker);
+  if (hashed_map != NULL) {
+    std::vector<Voxel3D> voxels;
+    hashed_map->fetchVoxels(voxels, skimap::MinWeightFilter<VoxelDataColor>(
+                                        mapParameters.min_voxel_weight));
+    visualization_msgs::Marker map_marker =
+        createVisualizationMarker(base_frame_name, rgb_msg->header.stamp, 1,
+                                  VisualizationType::VOXEL_MAP);
+    fillVisualizationMarkerWithVoxels(map_marker, voxels,
+                                      mapParameters.min_voxel_weight);
+    map_publisher.publish(map_marker);
+
+    std::vector<Tiles2D> tiles;
+    hashed_map->fetchTiles(tiles, mapParameters.agent_height);
+    visualization_msgs::Marker map_2d_marker =
+        createVisualizationMarker(base_frame_name, rgb_msg->header.stamp, 1,
+                                  VisualizationType::VOXEL_GRID);
+    fillVisualizationMarkerWithTiles(map_2d_marker, tiles);
+    map_2d_publisher.publish(map_2d_marker);
+  } else {
+    publishMaps(rgb_msg->header.stamp);
+  }
 
   /**
    * Cloud publisher
@@ -514,6 +674,13 @@ int main(int argc, char **argv) {
   map_publisher = nh->advertise<visualization_msgs::Marker>(map_topic, 1);
   map_2d_publisher = nh->advertise<visualization_msgs::Marker>(map_2d_topic, 1);
 
+  // Occupancy Grid Publishers
+  std::string grid_topic =
+      nh->param<std::string>("grid_publisher_topic", "live_grid");
+  grid_publisher = nh->advertise<nav_msgs::OccupancyGrid>(grid_topic, 1, true);
+  grid_update_publisher = nh->advertise<map_msgs::OccupancyGridUpdate>(
+      grid_topic + "_updates", 10);
+
   int hz;
   nh->param<int>("hz", hz, 30);
 
@@ -538,7 +705,15 @@ int main(int argc, char **argv) {
   nh->param<bool>("height_color", mapParameters.height_color, false);
   nh->param<int>("chisel_step", mapParameters.chisel_step, 10);
   nh->param<float>("agent_height", mapParameters.agent_height, 1.0f);
-  map = new SKIMAP(mapParameters.map_resolution, mapParameters.ground_level);
+
+  // Map backend: "skimap", or "hashed" (see HashedVoxelMap)
+  std::string map_backend;
+  nh->param<std::string>("map_backend", map_backend, "skimap");
+  if (map_backend == "hashed")
+    hashed_map =
+        new HASHED_MAP(mapParameters.map_resolution, mapParameters.ground_level);
+  else
+    map = new SKIMAP(mapParameters.map_resolution, mapParameters.ground_level);
 
   // Topics
   std::string camera_rgb_topic, camera_depth_topic;
@@ -7,6 +7,7 @@
  * please write to: d.degregorio@unibo.it
  */
 
+#include <atomic>
 #include <boost/thread/thread.hpp>
 #include <chrono>
 #include <cstdint>
@@ -16,9 +17,11 @@
 #include <string.h>
 
 // ROS
+#include <map_msgs/OccupancyGridUpdate.h>
 #include <message_filters/subscriber.h>
 #include <message_filters/sync_policies/approximate_time.h>
 #include <message_filters/time_synchronizer.h>
+#include <nav_msgs/OccupancyGrid.h>
 #include <ros/ros.h>
 #include <tf/transform_listener.h>
 #include <visualization_msgs/MarkerArray.h>
@@ -34,6 +37,7 @@
 #include <boost/thread/thread.hpp>
 
 // Skimap
+#include <skimap/HashedVoxelMap.hpp>
 #include <skimap/SkiMap.hpp>
 #include <skimap/voxels/VoxelDataRGBW.hpp>
 #include <skimap_ros/SkimapIntegrationService.h>
@@ -43,12 +47,16 @@ typedef skimap::VoxelDataRGBW<uint8_t, int16_t> VoxelDataColor;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float> SKIMAP;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float>::Voxel3D Voxel3D;
 typedef skimap::SkiMap<VoxelDataColor, int16_t, float>::Tiles2D Tiles2D;
-SKIMAP *map;
+typedef skimap::HashedVoxelMap<VoxelDataColor, int16_t, float> HASHED_MAP;
+SKIMAP *map = NULL;
+HASHED_MAP *hashed_map = NULL;
 
 // Ros
 ros::NodeHandle *nh;
 tf::TransformListener *tf_listener;
 ros::Publisher map_publisher;
+ros::Publisher grid_publisher;
+ros::Publisher grid_update_publisher;
 
 // Live parameters
 std::string base_frame_name = "world";
@@ -61,6 +69,7 @@ struct map_service_parameters
   float map_resolution;
   int min_voxel_weight;
   float ground_level;
+  float agent_height;
   float height_color_step;
   bool height_color_enabled;
   float camera_max_z;
@@ -69,10 +78,14 @@ struct map_service_parameters
 } map_service_parameters;
 
 /**
+ * Serializes map writers. Readers of the SkiMap do not take it: they read the
+ * map under an epoch guard (snapshot reads) while integration goes on. The
+ * hashed map fuses voxels in place, so its readers take it too.
  */
 struct MapSynchManager
 {
   boost::mutex map_mutex;
+  std::atomic<bool> hashed_map_changed;
 } map_synch_manager;
 
 /**
@@ -97,6 +110,54 @@ struct IntegrationPoint
   }
 };
 
+/**
+ * Publishes the Occupancy Grid raster: the whole grid if its window changed,
+ * an update message with the dirty rectangle otherwise.
+ * @param frame_id Target frame
+ * @param time Timestamp
+ * @param raster Occupancy raster
+ */
+void publishOccupancyGrid(std::string frame_id, ros::Time time,
+                          SKIMAP::Raster &raster)
+{
+  if (raster.resized)
+  {
+    nav_msgs::OccupancyGrid grid;
+    grid.header.frame_id = frame_id;
+    grid.header.stamp = time;
+    grid.info.map_load_time = time;
+    grid.info.resolution = map_service_parameters.map_resolution;
+    grid.info.width = raster.width;
+    grid.info.height = raster.height;
+    grid.info.origin.position.x =
+        raster.min_x * map_service_parameters.map_resolution;
+    grid.info.origin.position.y =
+        raster.min_y * map_service_parameters.map_resolution;
+    grid.info.origin.position.z = map_service_parameters.ground_level;
+    grid.info.origin.orientation.w = 1.0;
+    grid.data = raster.data;
+    grid_publisher.publish(grid);
+  }
+  else if (raster.dirty_min_col <= raster.dirty_max_col)
+  {
+    map_msgs::OccupancyGridUpdate update;
+    update.header.frame_id = frame_id;
+    update.header.stamp = time;
+    update.x = raster.dirty_min_col;
+    update.y = raster.dirty_min_row;
+    update.width = raster.dirty_max_col - raster.dirty_min_col + 1;
+    update.height = raster.dirty_max_row - raster.dirty_min_row + 1;
+    update.data.reserve(update.width * update.height);
+    for (int row = raster.dirty_min_row; row <= raster.dirty_max_row; row++)
+    {
+      std::vector<int8_t>::iterator begin =
+          raster.data.begin() + long(row) * raster.width + update.x;
+      update.data.insert(update.data.end(), begin, begin + update.width);
+    }
+    grid_update_publisher.publish(update);
+  }
+}
+
 /**
  * Creates a "blank" visualization marker with some attributes
  * @param frame_id Base TF Origin for the map points
@@ -192,18 +253,31 @@ createVisualizationMarker(std::string frame_id, ros::Time time, int id,
  */
 void integrateVoxels(std::vector<IntegrationPoint> &integration_points)
 {
-  boost::mutex::scoped_lock lock(map_synch_manager.map_mutex);
-  // map->startBatchIntegration();
-  //#pragma omp parallel for
+  // valid points as coordinate arrays, converted to voxel keys in batch
+  std::vector<float> xs, ys, zs;
+  std::vector<VoxelDataColor> voxels_data;
   for (int i = 0; i < integration_points.size(); i++)
   {
     IntegrationPoint &ip = integration_points[i];
     if (!ip.valid)
       continue;
-    map->integrateVoxel(float(ip.x), float(ip.y), float(ip.z),
-                        &(ip.voxel_data));
+    xs.push_back(ip.x);
+    ys.push_back(ip.y);
+    zs.push_back(ip.z);
+    voxels_data.push_back(ip.voxel_data);
   }
-  // map->commitBatchIntegration();
+
+  boost::mutex::scoped_lock lock(map_synch_manager.map_mutex);
+  if (hashed_map != NULL)
+    hashed_map->integrateVoxels(xs.data(), ys.data(), zs.data(),
+                                voxels_data.data(), long(xs.size()));
+  else
+    map->integrateVoxels(xs.data(), ys.data(), zs.data(), voxels_data.data(),
+                         long(xs.size()));
+  if (hashed_map != NULL)
+    map_synch_manager.hashed_map_changed = true;
+  else
+    map->reclaim();
 }
 
 /**
@@ -295,7 +369,13 @@ int main(int argc, char **argv)
 
   // Map Publisher
   std::string map_topic = nh->param<std::string>("map_topic", "live_map");
-  map_publisher = nh->advertise<visualization_msgs::Marker>(map_topic, 1);
+  map_publisher = nh->advertise<visualization_msgs::Marker>(map_topic, 1, true);
+
+  // Occupancy Grid Publishers
+  std::string grid_topic = nh->param<std::string>("grid_topic", "live_grid");
+  grid_publisher = nh->advertise<nav_msgs::OccupancyGrid>(grid_topic, 1, true);
+  grid_update_publisher = nh->advertise<map_msgs::OccupancyGridUpdate>(
+      grid_topic + "_updates", 10);
 
   // Services
   ros::ServiceServer service_integration =
@@ -312,39 +392,143 @@ int main(int argc, char **argv)
   nh->param<float>("camera_max_z", map_service_parameters.camera_max_z, 1.5f);
   nh->param<float>("map_resolution", map_service_parameters.map_resolution, 0.05f);
   nh->param<float>("ground_level", map_service_parameters.ground_level, 0.15f);
+  nh->param<float>("agent_height", map_service_parameters.agent_height, 1.0f);
   nh->param<float>("camera_min_z", map_service_parameters.camera_min_z, 0.01f);
   nh->param<int>("min_voxel_weight", map_service_parameters.min_voxel_weight, 10);
   nh->param<float>("height_color_step", map_service_parameters.height_color_step, 0.5f);
   nh->param<bool>("height_color", map_service_parameters.height_color_enabled, false);
   nh->param<std::string>("height_axis", map_service_parameters.height_axis, "z");
 
-  map = new SKIMAP(map_service_parameters.map_resolution, map_service_parameters.ground_level);
+  // Levels of detail: coarse maps at 2x, 4x, ... voxel size. With a positive
+  // voxel budget the published marker uses the finest level fitting it
+  int lod_levels;
+  nh->param<int>("lod_levels", lod_levels, 0);
+  int max_published_voxels;
+  nh->param<int>("max_published_voxels", max_published_voxels, 0);
+
+  // Map backend: "skimap", or "hashed" (see HashedVoxelMap) which only
+  // publishes the 3D marker, without levels of detail nor occupancy grid
+  std::string map_backend;
+  nh->param<std::string>("map_backend", map_backend, "skimap");
+  if (map_backend == "hashed")
+  {
+    hashed_map = new HASHED_MAP(map_service_parameters.map_resolution,
+                                map_service_parameters.ground_level);
+    // queries read the table while integration goes on
+    hashed_map->enableConcurrencyAccess(true);
+    map_synch_manager.hashed_map_changed = false;
+  }
+  else
+  {
+    map = new SKIMAP(map_service_parameters.map_resolution, map_service_parameters.ground_level);
+    map->setLevelsOfDetail(lod_levels);
+    map->enableSnapshotReads(true);
+  }
+
+  // Integration service callbacks run in their own thread, so publishing
+  // below never delays them
+  ros::AsyncSpinner spinner(1);
+  spinner.start();
 
   // Spin & Time
   ros::Rate r(hz);
+  SKIMAP::Version published_version = 0;
+  SKIMAP::Raster occupancy_raster;
 
   // Spin
   while (nh->ok())
   {
 
     /**
-    * 3D Map Publisher
+    * Map outputs are rebuilt only if the map changed since the last ones,
+    * latched publishers serve them to late subscribers. The map is read
+    * under an epoch guard, which only keeps the fetched voxels allocated
+    * until the marker is built: integration keeps running, so the outputs
+    * may mix voxels of consecutive integrations
     */
-    if (auto_publish_markers)
+    std::vector<Voxel3D> voxels;
+    visualization_msgs::Marker map_marker;
+    bool changed = false;
+    if (hashed_map != NULL)
     {
-
-      std::vector<Voxel3D> voxels;
+      // voxels of the table are never freed, but integration fuses into
+      // them in place: the marker reads them under the map mutex
+      if (map_synch_manager.hashed_map_changed && auto_publish_markers)
       {
         boost::mutex::scoped_lock lock(map_synch_manager.map_mutex);
-        map->fetchVoxels(voxels);
+        map_synch_manager.hashed_map_changed = false;
+        hashed_map->fetchVoxels(voxels, skimap::MinWeightFilter<VoxelDataColor>(
+                                            map_service_parameters.min_voxel_weight));
+        map_marker = createVisualizationMarker(
+            base_frame_name, ros::Time::now(),
+            1, voxels, map_service_parameters.min_voxel_weight);
+        map_publisher.publish(map_marker);
+      }
+    }
+    else
+    {
+      SKIMAP::ReadGuard guard(map->epochManager());
+      if (map->lastModifiedVersion() > published_version)
+      {
+        changed = true;
+        SKIMAP::Version version;
+        {
+          // Writers stamp columns with the current version under the map
+          // mutex: committing under it too, no column can get the committed
+          // version after the scan below and be missed by the next one
+          boost::mutex::scoped_lock lock(map_synch_manager.map_mutex);
+          version = map->commitVersion();
+        }
+        if (auto_publish_markers)
+        {
+          int level = 0;
+          if (max_published_voxels > 0)
+          {
+            level = map->fetchVoxelsWithBudget(
+                voxels, max_published_voxels,
+                skimap::MinWeightFilter<VoxelDataColor>(
+                    map_service_parameters.min_voxel_weight));
+          }
+          else
+          {
+            map->fetchVoxels(voxels, skimap::MinWeightFilter<VoxelDataColor>(
+                                         map_service_parameters.min_voxel_weight));
+          }
+          map_marker = createVisualizationMarker(
+              base_frame_name, ros::Time::now(),
+              1, voxels, map_service_parameters.min_voxel_weight);
+          map_marker.scale.x = map_marker.scale.y = map_marker.scale.z =
+              map_service_parameters.map_resolution * (1 << level);
+        }
+        map->rasterizeChangedSince(
+            published_version, occupancy_raster,
+            map_service_parameters.agent_height,
+            skimap::MinWeightFilter<VoxelDataColor>(
+                map_service_parameters.min_voxel_weight));
+        published_version = version;
+        // the raster is the only consumer of the erased columns
+        map->pruneErasedUpTo(published_version);
+      }
+    }
+
+    if (changed)
+    {
+      /**
+      * 3D Map Publisher
+      */
+      if (auto_publish_markers)
+      {
+        map_publisher.publish(map_marker);
       }
-      visualization_msgs::Marker map_marker = createVisualizationMarker(
-          base_frame_name, ros::Time::now(),
-          1, voxels, map_service_parameters.min_voxel_weight);
-      map_publisher.publish(map_marker);
+
+      /**
+      * Occupancy Grid Publisher
+      */
+      publishOccupancyGrid(base_frame_name, ros::Time::now(),
+                           occupancy_raster);
     }
 
-    ros::spinOnce();
     r.sleep();
   }
+  spinner.stop();
 }
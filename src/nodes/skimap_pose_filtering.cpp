@@ -13,6 +13,7 @@
 #include <cstdint>
 #include <boost/thread/thread.hpp>
 #include <chrono>
+#include <omp.h>
 
 //ROS
 #include <ros/ros.h>
@@ -63,6 +64,40 @@ struct MapParameters
     int min_voxel_weight;
 } mapParameters;
 
+/**
+ * Voxel with the largest pose set among the ones offered, and their count.
+ * Ties are broken on the voxel coordinates, so the result does not depend on
+ * the order of the offers
+ */
+struct LargestVoxel
+{
+    Voxel3D voxel;
+    int size;
+    int count;
+
+    LargestVoxel() : size(-1), count(0) {}
+
+    void offer(const Voxel3D &v, int v_size)
+    {
+        if (v_size > size ||
+            (v_size == size &&
+             (v.x < voxel.x ||
+              (v.x == voxel.x && (v.y < voxel.y ||
+                                  (v.y == voxel.y && v.z < voxel.z))))))
+        {
+            voxel = v;
+            size = v_size;
+        }
+    }
+
+    void merge(const LargestVoxel &other)
+    {
+        if (other.size >= 0)
+            offer(other.voxel, other.size);
+        count += other.count;
+    }
+};
+
 /**
  * 
  * @param argc
@@ -132,22 +167,25 @@ int main(int argc, char **argv)
             ros::Duration(1.0).sleep();
         }
 
-        std::vector<Voxel3D> voxels;
-        map->fetchVoxels(voxels);
-        int max_voxel = -1;
-        int max_size = -1;
-        for (int i = 0; i < voxels.size(); i++)
+        /**
+         * Voxel with the largest pose set, searched without materializing
+         * the voxel list: each thread keeps its own maximum, reduced once
+         */
+        std::vector<LargestVoxel> thread_largest(omp_get_max_threads());
+        map->forEachVoxel([&](const Voxel3D &v) {
+            LargestVoxel &largest = thread_largest[omp_get_thread_num()];
+            largest.count++;
+            largest.offer(v, int(v.data->size()));
+        });
+        LargestVoxel largest;
+        for (int i = 0; i < thread_largest.size(); i++)
         {
-            Voxel3D &v = voxels[i];
-            if (v.data->size() > max_size)
-            {
-                max_size = v.data->size();
-                max_voxel = i;
-            }
+            largest.merge(thread_largest[i]);
         }
-        if (max_voxel >= 0)
+        int voxels_count = largest.count;
+        if (largest.size >= 0)
         {
-            Voxel3D &v = voxels[max_voxel];
+            Voxel3D &v = largest.voxel;
             cv::Vec3f trans;
             cv::Vec4f rot;
             v.data->average(trans, rot);
@@ -166,7 +204,7 @@ int main(int argc, char **argv)
                                      base_frame_name,
                                      fitlered_name));
         }
-        ROS_INFO("Size: %d", int(voxels.size()));
+        ROS_INFO("Size: %d", voxels_count);
 
         ros::spinOnce();
         r.sleep();
@@ -40,7 +40,7 @@
 
 //Skimap
 //#include <skimap/voxels/VoxelDataRGBW.hpp>
-#include <skimap/SkipListMap.hpp>
+#include <skimap/SkipListMapV2.hpp>
 
 #include "skimap/voxels/VoxelDataRGBW.hpp"
 
@@ -48,8 +48,8 @@
 bool mapping = true;
 float map_resolution = 0.05f;
 typedef skimap::VoxelDataRGBW<uint16_t, float> VoxelDataColor;
-typedef skimap::SkipListMap<VoxelDataColor, int16_t, float> SkipListMapRGBVolume;
-typedef skimap::SkipListMap<VoxelDataColor, int16_t, float>::Voxel3D SkipListMapVoxel3D;
+typedef skimap::SkipListMapV2<VoxelDataColor, int16_t, float> SkipListMapRGBVolume;
+typedef skimap::SkipListMapV2<VoxelDataColor, int16_t, float>::Voxel3D SkipListMapVoxel3D;
 SkipListMapRGBVolume *map_rgb;
 
 //defines
@@ -64,8 +64,7 @@ ros::Publisher map_publisher;
 std::map<std::string, int> test_map_id;
 visualization_msgs::MarkerArray test_array;
 std::vector<VoxelDataColor> voxels_to_integrate;
-std::vector<Eigen::Vector4d> poses_to_integrate;
-std::vector<bool> voxels_to_integrate_mask;
+std::vector<SkipListMapVoxel3D> poses_to_integrate;
 
 //Live Cloud
 std::string base_frame_name = "slam_map";
@@ -232,38 +231,29 @@ void create_feature_tracker(slamdunk::FeatureTrackerParams &ft_params, std::stri
 }
 
 /**
- * Integrating measurements in global Map
+ * Integrating measurements in global Map. The Map remembers the contribution of the keyframe, integrating it again replaces it
  */
-void integrate_cloud_in_map(pcl::PointCloud<PointType>::Ptr &cloud, Eigen::Matrix4d &camera_pose, bool deintegration = false)
+void integrate_cloud_in_map(std::string key, pcl::PointCloud<PointType>::Ptr &cloud, Eigen::Matrix4d &camera_pose)
 {
 
-    //Prepares Voxels and Poses buffers just first time to avoid unuseful realloc
-    if (voxels_to_integrate.empty())
-    {
-        voxels_to_integrate.resize(cloud->points.size());
-        poses_to_integrate.resize(cloud->points.size());
-        voxels_to_integrate_mask.resize(cloud->points.size());
-    }
+    //Buffers keep their capacity across keyframes
+    voxels_to_integrate.resize(cloud->points.size());
+    poses_to_integrate.clear();
 
-#pragma omp for nowait
     for (int i = 0; i < cloud->points.size(); i++)
     {
-        poses_to_integrate[i] << cloud->points[i].x, cloud->points[i].y, cloud->points[i].z, 1;
-        voxels_to_integrate_mask[i] = cloud->points[i].z >= camera_distance_min && cloud->points[i].z <= camera_distance_max;
-        poses_to_integrate[i] = camera_pose * poses_to_integrate[i];
+        if (cloud->points[i].z < camera_distance_min || cloud->points[i].z > camera_distance_max)
+            continue;
+        Eigen::Vector4d point(cloud->points[i].x, cloud->points[i].y, cloud->points[i].z, 1);
+        point = camera_pose * point;
         voxels_to_integrate[i].r = cloud->points[i].r;
         voxels_to_integrate[i].g = cloud->points[i].g;
         voxels_to_integrate[i].b = cloud->points[i].b;
-        voxels_to_integrate[i].w = deintegration ? -1 : 1;
+        voxels_to_integrate[i].w = 1;
+        poses_to_integrate.push_back(SkipListMapVoxel3D(float(point[0]), float(point[1]), float(point[2]), &(voxels_to_integrate[i])));
     }
 
-    map_rgb->startBatchIntegration();
-    for (int i = 0; i < voxels_to_integrate.size(); i++)
-    {
-        if (voxels_to_integrate_mask[i])
-            map_rgb->integrateVoxel(float(poses_to_integrate[i][0]), float(poses_to_integrate[i][1]), float(poses_to_integrate[i][2]), &(voxels_to_integrate[i]));
-    }
-    map_rgb->commitBatchIntegration();
+    map_rgb->replaceSource(key, poses_to_integrate);
 }
 
 /**
@@ -271,37 +261,26 @@ void integrate_cloud_in_map(pcl::PointCloud<PointType>::Ptr &cloud, Eigen::Matri
  * @param key
  * @param cloud 
  */
-void consume_cloud(std::string key, pcl::PointCloud<PointType>::Ptr &cloud, bool publish_cloud, bool deintegrate)
+void consume_cloud(std::string key, pcl::PointCloud<PointType>::Ptr &cloud, bool publish_cloud)
 {
     Eigen::Matrix4d cam_in_map_pose;
     slam_dunk_scene.getGenericPoseInMapFrame(slam_dunk_scene.poses[key].matrix(), cam_in_map_pose);
 
-    if (!deintegrate)
+    if (publish_cloud)
     {
-        if (publish_cloud)
-        {
-            pcl::PointCloud<PointType>::Ptr cloud_trans(new pcl::PointCloud<PointType>);
-            pcl::transformPointCloud(*cloud, *cloud_trans, cam_in_map_pose);
+        pcl::PointCloud<PointType>::Ptr cloud_trans(new pcl::PointCloud<PointType>);
+        pcl::transformPointCloud(*cloud, *cloud_trans, cam_in_map_pose);
 
-            pcl::PCLPointCloud2 cloud2;
-            pcl::toPCLPointCloud2(*cloud_trans, cloud2);
-            pcl_conversions::fromPCL(cloud2, current_live_cloud);
+        pcl::PCLPointCloud2 cloud2;
+        pcl::toPCLPointCloud2(*cloud_trans, cloud2);
+        pcl_conversions::fromPCL(cloud2, current_live_cloud);
 
-            current_live_cloud.header.stamp = ros::Time::now(); //(slam_dunk_scene.rgbd_frames[key].secs, slam_dunk_scene.rgbd_frames[key].nsecs);
-            current_live_cloud.header.frame_id = base_frame_name;
-        }
-        if (mapping)
-        {
-            integrate_cloud_in_map(cloud, cam_in_map_pose);
-        }
+        current_live_cloud.header.stamp = ros::Time::now(); //(slam_dunk_scene.rgbd_frames[key].secs, slam_dunk_scene.rgbd_frames[key].nsecs);
+        current_live_cloud.header.frame_id = base_frame_name;
     }
-    else
+    if (mapping)
     {
-
-        if (mapping)
-        {
-            integrate_cloud_in_map(cloud, cam_in_map_pose);
-        }
+        integrate_cloud_in_map(key, cloud, cam_in_map_pose);
     }
 }
 
@@ -456,7 +435,7 @@ void scene_new_entries_callback(std::vector<slamdunk::ConsumingEntry> &new_entri
         key = new_entries[i].key;
         if (!new_entries[i].replacement)
         {
-            consume_cloud(key, slam_dunk_scene.clouds[key], true, false);
+            consume_cloud(key, slam_dunk_scene.clouds[key], true);
         }
     }
 }
@@ -473,9 +452,9 @@ void scene_optimized_entries_callback(std::vector<slamdunk::ConsumingEntry> &opt
         key = optimized_entries[i].key;
         if (optimized_entries[i].replacement)
         {
-            consume_cloud(key, slam_dunk_scene.clouds[key], false, true);
+            //The keyframe cloud is integrated again under the corrected pose, replacing its old contribution
             slam_dunk_scene.addPose(optimized_entries[i].key, optimized_entries[i].new_pose);
-            consume_cloud(key, slam_dunk_scene.clouds[key], false, false);
+            consume_cloud(key, slam_dunk_scene.clouds[key], false);
         }
     }
 }
@@ -572,6 +551,8 @@ int main(int argc, char **argv)
     mapping = nh->param<bool>("mapping", false);
     map_resolution = nh->param<float>("map_resolution", 0.05f);
     map_rgb = new SkipListMapRGBVolume(-32000, 32000, map_resolution, map_resolution, map_resolution);
+    map_rgb->enableConcurrencyAccess(true);
+    map_rgb->setDeintegrationFilter(skimap::PositiveWeightFilter<VoxelDataColor>());
     map_publisher = nh->advertise<visualization_msgs::Marker>("slam_map", 1);
     camera_distance_max = nh->param<float>("camera_distance_max", 3.0f);
     camera_distance_min = nh->param<float>("camera_distance_min", 0.4f);